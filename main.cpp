@@ -1,15 +1,97 @@
+// libstdc++ runs execution::par algorithms on TBB whenever its headers are installed, and the
+// build then has to link with -ltbb. SEARCH_SERVER_NO_TBB runs them sequentially instead, so
+// that the tree links without TBB.
+#ifdef SEARCH_SERVER_NO_TBB
+#define _GLIBCXX_USE_TBB_PAR_BACKEND 0
+#endif
+
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <execution>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <optional>
+#include <queue>
+#include <random>
 #include <set>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 #include <iostream>
 
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SEARCH_SERVER_HAS_MMAP 1
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SEARCH_SERVER_HAS_X86_SIMD 1
+#endif
+
+#if __has_include(<sys/socket.h>) && __has_include(<sys/wait.h>) && __has_include(<poll.h>)
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define SEARCH_SERVER_HAS_SOCKETS 1
+#endif
+
+#if !defined(SEARCH_SERVER_NO_TBB) && __has_include(<tbb/global_control.h>)
+#include <tbb/global_control.h>
+#define SEARCH_SERVER_HAS_TBB 1
+#endif
+
 using namespace std;
 
 const int MAX_RESULT_DOCUMENT_COUNT = 5;
+const double RELEVANCE_EPSILON = 1e-6;
+const int PARALLEL_SHARD_COUNT = 64;
+// A query is scored into a dense buffer when it has a posting per this many documents or more.
+// Every thread that scores such a query keeps a 9-byte relevance and state per document of the
+// largest range it scored until it exits; narrower queries use scratch sized to their postings.
+const size_t DENSE_SCORING_DOCUMENTS_PER_POSTING = 64;
+const size_t POSTING_BLOCK_SIZE = 128;
+// Shorter posting lists are smaller uncompressed
+const size_t MIN_COMPRESSED_POSTING_COUNT = 16;
+const size_t INGEST_BATCH_SIZE = 4096;
+// Documents of ConcurrentSearchServer are published once a pending segment has this many
+const size_t CONCURRENT_SEGMENT_SIZE = 4096;
+// Segments of one size tier are merged this many at a time
+const size_t SEGMENT_MERGE_FACTOR = 4;
+// Threads of SearchMetrics share this many slots of counters
+const size_t METRICS_SLOT_COUNT = 16;
+const int MINUTES_IN_DAY = 1440;
 
 string ReadLine() {
     string s;
@@ -24,26 +106,69 @@ int ReadLineWithNumber() {
     return result;
 }
 
-vector<string> SplitIntoWords(const string& text) {
-    vector<string> words;
-    string word;
-    for (const char c : text) {
-        if (c == ' ') {
-            if (!word.empty()) {
-                words.push_back(word);
-                word.clear();
-            }
-        } else {
-            word += c;
+// Calls function(word) for every space-separated word of text, without allocating
+template <typename Function>
+void ForEachWord(string_view text, Function function) {
+    while (true) {
+        const size_t word_begin = text.find_first_not_of(' ');
+        if (word_begin == text.npos) {
+            break;
         }
+        text.remove_prefix(word_begin);
+        const size_t word_end = text.find(' ');
+        function(text.substr(0, word_end));
+        if (word_end == text.npos) {
+            break;
+        }
+        text.remove_prefix(word_end);
     }
-    if (!word.empty()) {
-        words.push_back(word);
-    }
+}
 
+// Words are views into text, so text must outlive them
+vector<string_view> SplitIntoWords(string_view text) {
+    vector<string_view> words;
+    ForEachWord(text, [&words](string_view word) {
+        words.push_back(word);
+    });
     return words;
 }
 
+// Writes "<name>: <microseconds> us" to the stream when it goes out of scope
+class LogDuration {
+public:
+    using Clock = chrono::steady_clock;
+
+    explicit LogDuration(string_view name, ostream& stream = cerr)
+        : name_(name)
+        , stream_(stream) {
+    }
+
+    LogDuration(const LogDuration&) = delete;
+    LogDuration& operator=(const LogDuration&) = delete;
+
+    ~LogDuration() {
+        const auto duration = chrono::duration_cast<chrono::microseconds>(Clock::now() - start_time_);
+        stream_ << name_ << ": "s << duration.count() << " us"s << '\n';
+    }
+
+private:
+    string name_;
+    ostream& stream_;
+    const Clock::time_point start_time_ = Clock::now();
+};
+
+#define SEARCH_SERVER_CONCAT_INTERNAL(x, y) x##y
+#define SEARCH_SERVER_CONCAT(x, y) SEARCH_SERVER_CONCAT_INTERNAL(x, y)
+
+// Stage timers cost nothing unless the build defines SEARCH_SERVER_PROFILE
+#ifdef SEARCH_SERVER_PROFILE
+#define LOG_DURATION(name) LogDuration SEARCH_SERVER_CONCAT(profile_guard_, __LINE__)(name)
+#define LOG_DURATION_STREAM(name, stream) LogDuration SEARCH_SERVER_CONCAT(profile_guard_, __LINE__)(name, stream)
+#else
+#define LOG_DURATION(name) static_cast<void>(0)
+#define LOG_DURATION_STREAM(name, stream) static_cast<void>(0)
+#endif
+
 
 struct Document {
     int id;
@@ -51,6 +176,25 @@ struct Document {
     int rating;
 };
 
+// Relevances closer than RELEVANCE_EPSILON are treated as equal and ordered by rating
+bool IsMoreRelevant(const Document& lhs, const Document& rhs) {
+    if (abs(lhs.relevance - rhs.relevance) < RELEVANCE_EPSILON) {
+        return lhs.rating > rhs.rating;
+    } else {
+        return lhs.relevance > rhs.relevance;
+    }
+}
+
+// Leaves only the top_count most relevant documents, ordered; the rest are never sorted
+void SelectTopDocuments(vector<Document>& documents, size_t top_count) {
+    if (documents.size() > top_count) {
+        partial_sort(documents.begin(), documents.begin() + top_count, documents.end(), IsMoreRelevant);
+        documents.resize(top_count);
+    } else {
+        sort(documents.begin(), documents.end(), IsMoreRelevant);
+    }
+}
+
 
 enum class DocumentStatus {
     ACTUAL,
@@ -58,584 +202,6554 @@ enum class DocumentStatus {
     BANNED,
     REMOVED,
 };
+const size_t DOCUMENT_STATUS_COUNT = static_cast<size_t>(DocumentStatus::REMOVED) + 1;
 
+// Instruction set of the loop that accumulates relevance, all kernels give identical results
+enum class ScoringKernel {
+    SCALAR,
+    SSE2,
+    AVX2,
+};
 
-class SearchServer {
-public:
-    void SetStopWords(const string& text) {
-        for (const string& word : SplitIntoWords(text)) {
-            stop_words_.insert(word);
-        }
+string_view GetScoringKernelName(ScoringKernel kernel) {
+    switch (kernel) {
+    case ScoringKernel::SSE2:
+        return "SSE2"sv;
+    case ScoringKernel::AVX2:
+        return "AVX2"sv;
+    default:
+        return "scalar"sv;
     }
+}
 
-    void AddDocument(int document_id, const string& document, DocumentStatus status, const vector<int>& ratings) {
-        const vector<string> words = SplitIntoWordsNoStop(document);
-        const double inv_word_count = 1.0 / words.size();
-        for (const string& word : words) {
-            word_to_document_freqs_[word][document_id] += inv_word_count;
-        }
-        documents_.emplace(document_id,
-            DocumentData{
-                ComputeAverageRating(ratings),
-                status
-            });
+string_view GetDocumentStatusName(DocumentStatus status) {
+    switch (status) {
+    case DocumentStatus::ACTUAL:
+        return "ACTUAL"sv;
+    case DocumentStatus::IRRELEVANT:
+        return "IRRELEVANT"sv;
+    case DocumentStatus::BANNED:
+        return "BANNED"sv;
+    default:
+        return "REMOVED"sv;
+    }
+}
+
+// One line of a bulk document file: "id<TAB>status<TAB>ratings<TAB>text",
+// where status is a DocumentStatus name and ratings are separated by spaces
+struct DocumentRecord {
+    int id;
+    DocumentStatus status;
+    vector<int> ratings;
+    string_view text;
+};
+
+int ParseRecordNumber(string_view text, string_view line) {
+    int number = 0;
+    const auto [end, error] = from_chars(text.data(), text.data() + text.size(), number);
+    if (error != errc() || end != text.data() + text.size()) {
+        throw invalid_argument("Invalid number in document record: "s + string(line));
     }
+    return number;
+}
 
+DocumentStatus ParseDocumentStatus(string_view text, string_view line) {
+    static const map<string_view, DocumentStatus> statuses = {
+        {"ACTUAL"sv, DocumentStatus::ACTUAL},
+        {"IRRELEVANT"sv, DocumentStatus::IRRELEVANT},
+        {"BANNED"sv, DocumentStatus::BANNED},
+        {"REMOVED"sv, DocumentStatus::REMOVED},
+    };
+    const auto it = statuses.find(text);
+    if (it == statuses.end()) {
+        throw invalid_argument("Invalid status in document record: "s + string(line));
+    }
+    return it->second;
+}
 
-    vector<Document> FindTopDocuments(const string& raw_query, DocumentStatus given_status = DocumentStatus::ACTUAL) const {
-        return FindTopDocuments(raw_query, [given_status](int document_id, DocumentStatus status, int rating) { return status == given_status; });
+// The text of the record is a view into line
+DocumentRecord ParseDocumentRecord(string_view line) {
+    string_view fields[3];
+    string_view rest = line;
+    for (string_view& field : fields) {
+        const size_t tab = rest.find('\t');
+        if (tab == rest.npos) {
+            throw invalid_argument("Document record must have 4 fields: "s + string(line));
+        }
+        field = rest.substr(0, tab);
+        rest.remove_prefix(tab + 1);
     }
+    DocumentRecord record{ParseRecordNumber(fields[0], line), ParseDocumentStatus(fields[1], line), {}, rest};
+    for (const string_view rating : SplitIntoWords(fields[2])) {
+        record.ratings.push_back(ParseRecordNumber(rating, line));
+    }
+    return record;
+}
 
+struct IngestStats {
+    size_t document_count = 0;
+    size_t byte_count = 0;
+    double seconds = 0.0;
+};
 
 
-template <typename DocumentPredicate>
-    vector<Document> FindTopDocuments(const string& raw_query,DocumentPredicate document_predicate) const {
-        const Query query = ParseQuery(raw_query);
+using TermId = uint32_t;
+
+// Stores every distinct term once. Term bytes are packed into large chunks that are never
+// reallocated, so the views handed out stay valid for the lifetime of the pool.
+class TermPool {
+public:
+    static constexpr TermId NO_TERM = numeric_limits<TermId>::max();
 
-        auto matched_documents = FindAllDocuments(query, document_predicate);
+    struct MemoryStats {
+        size_t term_count;
+        size_t term_bytes;
+        size_t arena_bytes;
+        size_t dictionary_bytes;
+    };
 
-        sort(matched_documents.begin(), matched_documents.end(),
-             [](const Document& lhs, const Document& rhs) {
-                if (abs(lhs.relevance - rhs.relevance) < 1e-6) {
-                    return lhs.rating > rhs.rating;
-                } else {
-                    return lhs.relevance > rhs.relevance;
-                }
-             });
-        if (matched_documents.size() > MAX_RESULT_DOCUMENT_COUNT) {
-            matched_documents.resize(MAX_RESULT_DOCUMENT_COUNT);
+    TermId Intern(string_view term) {
+        if (const auto it = term_ids_.find(term); it != term_ids_.end()) {
+            return it->second;
         }
-        return matched_documents;
+        const TermId term_id = static_cast<TermId>(terms_.size());
+        const string_view stored_term = Store(term);
+        terms_.push_back(stored_term);
+        term_ids_.emplace(stored_term, term_id);
+        return term_id;
+    }
+
+    TermId Find(string_view term) const {
+        const auto it = term_ids_.find(term);
+        return it == term_ids_.end() ? NO_TERM : it->second;
     }
 
+    string_view GetTerm(TermId term_id) const {
+        return terms_[term_id];
+    }
 
+    size_t GetTermCount() const {
+        return terms_.size();
+    }
 
+    // Dictionary size is estimated from the libstdc++ node layout
+    MemoryStats GetMemoryStats() const {
+        const size_t node_bytes = sizeof(void*) + sizeof(pair<const string_view, TermId>) + sizeof(size_t);
+        return {
+            terms_.size(),
+            term_bytes_,
+            arena_bytes_,
+            term_ids_.bucket_count() * sizeof(void*) + term_ids_.size() * node_bytes
+                + terms_.capacity() * sizeof(string_view)
+        };
+    }
 
-    int GetDocumentCount() const {
-        return documents_.size();
+private:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    vector<unique_ptr<char[]>> chunks_;
+    char* chunk_free_begin_ = nullptr;
+    size_t chunk_free_size_ = 0;
+    size_t arena_bytes_ = 0;
+    size_t term_bytes_ = 0;
+    vector<string_view> terms_;
+    unordered_map<string_view, TermId> term_ids_;
+
+    string_view Store(string_view term) {
+        if (term.size() > chunk_free_size_) {
+            const size_t chunk_size = max(CHUNK_SIZE, term.size());
+            chunks_.push_back(make_unique<char[]>(chunk_size));
+            chunk_free_begin_ = chunks_.back().get();
+            chunk_free_size_ = chunk_size;
+            arena_bytes_ += chunk_size;
+        }
+        char* data = chunk_free_begin_;
+        copy(term.begin(), term.end(), data);
+        chunk_free_begin_ += term.size();
+        chunk_free_size_ -= term.size();
+        term_bytes_ += term.size();
+        return {data, term.size()};
     }
+};
 
-    tuple<vector<string>, DocumentStatus> MatchDocument(const string& raw_query, int document_id) const {
-        const Query query = ParseQuery(raw_query);
-        vector<string> matched_words;
-        for (const string& word : query.plus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
-            }
-            if (word_to_document_freqs_.at(word).count(document_id)) {
-                matched_words.push_back(word);
-            }
+
+// Read-only contents of a whole file. The file is mapped into memory where the OS
+// supports it, otherwise it is read into a buffer.
+class MappedFile {
+public:
+    explicit MappedFile(const string& path) {
+#ifdef SEARCH_SERVER_HAS_MMAP
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("Can't open "s + path);
         }
-        for (const string& word : query.minus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
-            }
-            if (word_to_document_freqs_.at(word).count(document_id)) {
-                matched_words.clear();
-                break;
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) {
+            close(fd);
+            throw runtime_error("Can't stat "s + path);
+        }
+        size_ = static_cast<size_t>(file_stat.st_size);
+        if (size_ > 0) {
+            void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                throw runtime_error("Can't map "s + path);
             }
+            data_ = static_cast<const char*>(data);
+            is_mapped_ = true;
+        }
+        close(fd);
+#else
+        ifstream input(path, ios::binary);
+        if (!input) {
+            throw runtime_error("Can't open "s + path);
+        }
+        buffer_.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#ifdef SEARCH_SERVER_HAS_MMAP
+        if (is_mapped_) {
+            munmap(const_cast<char*>(data_), size_);
         }
-        return {matched_words, documents_.at(document_id).status};
+#endif
+    }
+
+    const char* GetData() const {
+        return data_;
+    }
+
+    size_t GetSize() const {
+        return size_;
     }
 
 private:
-    struct DocumentData {
-        int rating;
-        DocumentStatus status;
-    };
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    bool is_mapped_ = false;
+    vector<char> buffer_;
+};
 
 
+// Binary snapshot of a SearchServer: a fixed header followed by the payload.
+// Numbers are stored in the byte order of the machine that wrote the snapshot.
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t payload_size;
+    uint64_t checksum;
+};
 
-    set<string> stop_words_;
-    map<string, map<int, double>> word_to_document_freqs_;
-    map<int, DocumentData> documents_;
+const char SNAPSHOT_MAGIC[8] = {'S', 'R', 'C', 'H', 'S', 'N', 'A', 'P'};
+const uint32_t SNAPSHOT_VERSION = 2;
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
 
+// FNV-1a
+uint64_t UpdateSnapshotChecksum(uint64_t checksum, const char* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        checksum ^= static_cast<unsigned char>(data[i]);
+        checksum *= 0x100000001b3ULL;
+    }
+    return checksum;
+}
 
+const uint64_t SNAPSHOT_CHECKSUM_SEED = 0xcbf29ce484222325ULL;
 
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(ostream& output)
+        : output_(output) {
+    }
 
-    bool IsStopWord(const string& word) const {
-        return stop_words_.count(word) > 0;
+    template <typename Value>
+    void Write(const Value& value) {
+        static_assert(is_trivially_copyable_v<Value>);
+        WriteBytes(reinterpret_cast<const char*>(&value), sizeof(value));
     }
 
-    vector<string> SplitIntoWordsNoStop(const string& text) const {
-        vector<string> words;
-        for (const string& word : SplitIntoWords(text)) {
-            if (!IsStopWord(word)) {
-                words.push_back(word);
-            }
-        }
-        return words;
+    void WriteBytes(const char* data, size_t size) {
+        output_.write(data, size);
+        checksum_ = UpdateSnapshotChecksum(checksum_, data, size);
+        size_ += size;
     }
 
-    static int ComputeAverageRating(const vector<int>& ratings) {
-        if (ratings.empty()) {
-            return 0;
-        }
-        int rating_sum = 0;
-        for (const int rating : ratings) {
-            rating_sum += rating;
+    // Payload starts right after the header, which keeps the same alignment as the file start
+    void AlignTo(size_t alignment) {
+        while (size_ % alignment != 0) {
+            Write('\0');
         }
-        return rating_sum / static_cast<int>(ratings.size());
     }
 
-    struct QueryWord {
-        string data;
-        bool is_minus;
-        bool is_stop;
-    };
+    uint64_t GetChecksum() const {
+        return checksum_;
+    }
 
-    QueryWord ParseQueryWord(string text) const {
-        bool is_minus = false;
-        // Word shouldn't be empty
-        if (text[0] == '-') {
-            is_minus = true;
-            text = text.substr(1);
-        }
-        return {
-            text,
-            is_minus,
-            IsStopWord(text)
-        };
+    uint64_t GetSize() const {
+        return size_;
     }
 
-    struct Query {
-        set<string> plus_words;
-        set<string> minus_words;
-    };
+private:
+    ostream& output_;
+    uint64_t checksum_ = SNAPSHOT_CHECKSUM_SEED;
+    uint64_t size_ = 0;
+};
 
-    Query ParseQuery(const string& text) const {
-        Query query;
-        for (const string& word : SplitIntoWords(text)) {
-            const QueryWord query_word = ParseQueryWord(word);
-            if (!query_word.is_stop) {
-                if (query_word.is_minus) {
-                    query.minus_words.insert(query_word.data);
-                } else {
-                    query.plus_words.insert(query_word.data);
-                }
-            }
-        }
-        return query;
+class SnapshotReader {
+public:
+    SnapshotReader(const char* data, size_t size)
+        : data_(data)
+        , size_(size) {
     }
 
-    // Existence required
-    double ComputeWordInverseDocumentFreq(const string& word) const {
-        return log(GetDocumentCount() * 1.0 / word_to_document_freqs_.at(word).size());
+    template <typename Value>
+    Value Read() {
+        static_assert(is_trivially_copyable_v<Value>);
+        Value value;
+        memcpy(&value, Take(sizeof(value)), sizeof(value));
+        return value;
     }
 
+    // Returns a pointer into the snapshot itself, nothing is copied
+    template <typename Value>
+    const Value* TakeArray(size_t count) {
+        if (count > (size_ - position_) / sizeof(Value)) {
+            throw runtime_error("Snapshot is truncated"s);
+        }
+        return reinterpret_cast<const Value*>(Take(count * sizeof(Value)));
+    }
+
+    const char* Take(size_t size) {
+        if (size > size_ - position_) {
+            throw runtime_error("Snapshot is truncated"s);
+        }
+        const char* data = data_ + position_;
+        position_ += size;
+        return data;
+    }
 
+    void AlignTo(size_t alignment) {
+        Take((alignment - position_ % alignment) % alignment);
+    }
 
-    template <typename DocumentPredicate>
+private:
+    const char* data_;
+    size_t size_;
+    size_t position_ = 0;
+};
 
 
-    vector<Document> FindAllDocuments(const Query& query, DocumentPredicate document_predicate) const {
-    map<int, double> document_to_relevance;
-    for (const string& word : query.plus_words) {
-    if (word_to_document_freqs_.count(word) == 0) { continue;}
+// LRU cache of search results with a memory cap. Every entry remembers the index generation
+// it was computed at and is dropped on lookup once the index has changed. Thread-safe.
+class QueryResultCache {
+public:
+    struct Stats {
+        size_t hit_count = 0;
+        size_t miss_count = 0;
+        size_t invalidation_count = 0;
+        size_t eviction_count = 0;
+        size_t entry_count = 0;
+        size_t byte_count = 0;
+    };
 
+    explicit QueryResultCache(size_t max_bytes)
+        : max_bytes_(max_bytes) {
+    }
 
-            const double inverse_document_freq = ComputeWordInverseDocumentFreq(word);
-            for (const auto [document_id, term_freq] : word_to_document_freqs_.at(word)) {
+    optional<vector<Document>> Find(const string& key, uint64_t generation) {
+        lock_guard guard(mutex_);
+        const auto it = entries_by_key_.find(key);
+        if (it == entries_by_key_.end()) {
+            ++stats_.miss_count;
+            return nullopt;
+        }
+        if (it->second->generation != generation) {
+            ++stats_.miss_count;
+            ++stats_.invalidation_count;
+            Erase(it->second);
+            return nullopt;
+        }
+        ++stats_.hit_count;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return it->second->documents;
+    }
 
+    void Insert(string key, uint64_t generation, vector<Document> documents) {
+        lock_guard guard(mutex_);
+        if (const auto it = entries_by_key_.find(key); it != entries_by_key_.end()) {
+            Erase(it->second);
+        }
+        entries_.push_front({move(key), generation, move(documents)});
+        const auto entry = entries_.begin();
+        entries_by_key_.emplace(entry->key, entry);
+        stats_.byte_count += GetEntryBytes(*entry);
+        while (stats_.byte_count > max_bytes_ && !entries_.empty()) {
+            ++stats_.eviction_count;
+            Erase(prev(entries_.end()));
+        }
+    }
 
+    Stats GetStats() const {
+        lock_guard guard(mutex_);
+        Stats stats = stats_;
+        stats.entry_count = entries_.size();
+        return stats;
+    }
 
-                if (document_predicate (document_id, documents_.at(document_id).status, documents_.at(document_id).rating) )
-                {
-                    document_to_relevance[document_id] += term_freq * inverse_document_freq;
-                }
+private:
+    struct Entry {
+        string key;
+        uint64_t generation;
+        vector<Document> documents;
+    };
 
+    size_t max_bytes_;
+    // Most recently used first
+    list<Entry> entries_;
+    unordered_map<string_view, list<Entry>::iterator> entries_by_key_;
+    Stats stats_;
+    mutable mutex mutex_;
+
+    // Estimated from the libstdc++ list and hash table node layouts
+    static size_t GetEntryBytes(const Entry& entry) {
+        return sizeof(Entry) + 2 * sizeof(void*) + entry.key.capacity() + entry.documents.capacity() * sizeof(Document)
+            + sizeof(pair<const string_view, list<Entry>::iterator>) + 2 * sizeof(void*);
+    }
 
+    void Erase(list<Entry>::iterator entry) {
+        stats_.byte_count -= GetEntryBytes(*entry);
+        entries_by_key_.erase(entry->key);
+        entries_.erase(entry);
+    }
+};
 
-            }
-        }
+// Latency histograms and work counters of a SearchServer. A thread updates its own slot with
+// relaxed atomics, so recording takes no locks and threads don't share cache lines; snapshots
+// sum the slots. Histograms are HDR-style: every power of two of nanoseconds is split into
+// SUB_BUCKET_COUNT linear buckets, so a latency is known within 1/SUB_BUCKET_COUNT of itself.
+class SearchMetrics {
+public:
+    enum class Operation {
+        ADD_DOCUMENT,
+        FIND_TOP_DOCUMENTS,
+        MATCH_DOCUMENT,
+        PARSE_QUERY,
+    };
+    static constexpr size_t OPERATION_COUNT = static_cast<size_t>(Operation::PARSE_QUERY) + 1;
 
-        for (const string& word : query.minus_words) {
-            if (word_to_document_freqs_.count(word) == 0) {
-                continue;
+    enum class Counter {
+        POSTINGS_SCANNED,
+        CANDIDATES_SCORED,
+        RESULTS_RETURNED,
+    };
+    static constexpr size_t COUNTER_COUNT = static_cast<size_t>(Counter::RESULTS_RETURNED) + 1;
+
+    static constexpr int SUB_BUCKET_BITS = 3;
+    static constexpr uint64_t SUB_BUCKET_COUNT = uint64_t{1} << SUB_BUCKET_BITS;
+    // Longer latencies, about 18 minutes, fall into the last bucket
+    static constexpr int MAX_LATENCY_BITS = 40;
+    static constexpr size_t BUCKET_COUNT = (MAX_LATENCY_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+    struct Histogram {
+        array<uint64_t, BUCKET_COUNT> bucket_counts = {};
+        uint64_t count = 0;
+        uint64_t total_nanoseconds = 0;
+
+        // Upper bound of the bucket holding the given fraction of the latencies, 0 when empty
+        uint64_t GetPercentileNanoseconds(double fraction) const {
+            if (count == 0) {
+                return 0;
             }
-            for (const auto [document_id, _] : word_to_document_freqs_.at(word)) {
-                document_to_relevance.erase(document_id);
+            const uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(ceil(fraction * count)));
+            uint64_t seen_count = 0;
+            size_t i = 0;
+            for (; i + 1 < BUCKET_COUNT; ++i) {
+                seen_count += bucket_counts[i];
+                if (seen_count >= rank) {
+                    break;
+                }
             }
+            return GetBucketEnd(i) - 1;
         }
+    };
 
-        vector<Document> matched_documents;
-        for (const auto [document_id, relevance] : document_to_relevance) {
-            matched_documents.push_back({
-                document_id,
-                relevance,
-                documents_.at(document_id).rating
-            });
-        }
-        return matched_documents;
-    }
-};
-
-// ==================== для примера =========================
-
+    struct Snapshot {
+        array<Histogram, OPERATION_COUNT> latencies;
+        array<uint64_t, COUNTER_COUNT> counters = {};
 
-void PrintDocument(const Document& document) {
-    cout << "{ "s
-         << "document_id = "s << document.id << ", "s
-         << "relevance = "s << document.relevance << ", "s
-         << "rating = "s << document.rating
-         << " }"s << endl;
-}
-/* Подставьте вашу реализацию класса SearchServer сюда */
+        const Histogram& GetLatencies(Operation operation) const {
+            return latencies[static_cast<size_t>(operation)];
+        }
 
+        uint64_t GetCounter(Counter counter) const {
+            return counters[static_cast<size_t>(counter)];
+        }
+    };
 
+    SearchMetrics() {
+        for (Slot& slot : slots_) {
+            for (auto& bucket_counts : slot.bucket_counts) {
+                for (atomic<uint64_t>& bucket_count : bucket_counts) {
+                    bucket_count.store(0, memory_order_relaxed);
+                }
+            }
+            for (atomic<uint64_t>& total_nanoseconds : slot.total_nanoseconds) {
+                total_nanoseconds.store(0, memory_order_relaxed);
+            }
+            for (atomic<uint64_t>& counter : slot.counters) {
+                counter.store(0, memory_order_relaxed);
+            }
+        }
+    }
 
+    void RecordLatency(Operation operation, uint64_t nanoseconds) {
+        Slot& slot = GetSlot();
+        const size_t index = static_cast<size_t>(operation);
+        slot.bucket_counts[index][GetBucketIndex(nanoseconds)].fetch_add(1, memory_order_relaxed);
+        slot.total_nanoseconds[index].fetch_add(nanoseconds, memory_order_relaxed);
+    }
 
-template <typename LeftValue, typename RightValue>
-void AssertEqualImpl(const LeftValue& left, const RightValue& right,
-    const std::string& left_expression, const std::string& right_expression,
-    const std::string& file, const std::string& function_name,
-    unsigned line, const std::string& hint) {
-    if (left != right) {
-        std::cerr << std::boolalpha;
-        std::cerr << file << "(" << line << "): " << function_name << ": ";
-        std::cerr << "ASSERT_EQUAL(" << left_expression << ", " << right_expression << ") failed: ";
-        std::cerr << left << " != " << right << ".";
+    void Add(Counter counter, uint64_t value) {
+        GetSlot().counters[static_cast<size_t>(counter)].fetch_add(value, memory_order_relaxed);
+    }
 
-        if (!hint.empty()) {
-            std::cerr << " Hint: " << hint;
+    // Updates that race with the snapshot may be seen partly
+    Snapshot GetSnapshot() const {
+        Snapshot snapshot;
+        for (const Slot& slot : slots_) {
+            for (size_t operation = 0; operation < OPERATION_COUNT; ++operation) {
+                Histogram& histogram = snapshot.latencies[operation];
+                for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+                    const uint64_t bucket_count = slot.bucket_counts[operation][i].load(memory_order_relaxed);
+                    histogram.bucket_counts[i] += bucket_count;
+                    histogram.count += bucket_count;
+                }
+                histogram.total_nanoseconds += slot.total_nanoseconds[operation].load(memory_order_relaxed);
+            }
+            for (size_t counter = 0; counter < COUNTER_COUNT; ++counter) {
+                snapshot.counters[counter] += slot.counters[counter].load(memory_order_relaxed);
+            }
         }
+        return snapshot;
+    }
 
-        std::cerr << std::endl;
-        std::cerr << std::noboolalpha;
+    static string_view GetOperationName(Operation operation) {
+        switch (operation) {
+        case Operation::ADD_DOCUMENT:
+            return "add_document"sv;
+        case Operation::FIND_TOP_DOCUMENTS:
+            return "find_top_documents"sv;
+        case Operation::MATCH_DOCUMENT:
+            return "match_document"sv;
+        default:
+            return "parse_query"sv;
+        }
+    }
 
-        abort();
+    // Values below SUB_BUCKET_COUNT get a bucket each, larger ones share a bucket with the
+    // values that agree with them in the SUB_BUCKET_BITS bits after the leading one
+    static size_t GetBucketIndex(uint64_t nanoseconds) {
+        nanoseconds = min(nanoseconds, (uint64_t{1} << MAX_LATENCY_BITS) - 1);
+        if (nanoseconds < SUB_BUCKET_COUNT) {
+            return static_cast<size_t>(nanoseconds);
+        }
+#if defined(__GNUC__) || defined(__clang__)
+        const int exponent = 63 - __builtin_clzll(nanoseconds);
+#else
+        int exponent = 0;
+        while (nanoseconds >> (exponent + 1)) {
+            ++exponent;
+        }
+#endif
+        return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT + ((nanoseconds >> (exponent - SUB_BUCKET_BITS)) - SUB_BUCKET_COUNT);
     }
-}
 
-void AssertImpl(bool value, const std::string& expression,
-    const std::string& file, const std::string& function_name,
-    unsigned line, const std::string& hint) {
-    if (!value) {
-        std::cerr << file << "(" << line << "): " << function_name << ": ";
-        std::cerr << "ASSERT(" << expression << ") failed.";
-        if (!hint.empty()) {
-            std::cerr << " Hint: " << hint;
+    // The first latency past the bucket
+    static uint64_t GetBucketEnd(size_t index) {
+        if (index < SUB_BUCKET_COUNT) {
+            return index + 1;
         }
-        std::cerr << std::endl;
-        abort();
+        const int exponent = static_cast<int>(index / SUB_BUCKET_COUNT) + SUB_BUCKET_BITS - 1;
+        return (SUB_BUCKET_COUNT + index % SUB_BUCKET_COUNT + 1) << (exponent - SUB_BUCKET_BITS);
     }
-}
 
-#define ASSERT_EQUAL(a, b) AssertEqualImpl((a), (b), #a, #b, __FILE__, __FUNCTION__, __LINE__, "")
+private:
+    struct alignas(64) Slot {
+        array<array<atomic<uint64_t>, BUCKET_COUNT>, OPERATION_COUNT> bucket_counts;
+        array<atomic<uint64_t>, OPERATION_COUNT> total_nanoseconds;
+        array<atomic<uint64_t>, COUNTER_COUNT> counters;
+    };
 
-#define ASSERT_EQUAL_HINT(a, b, hint) AssertEqualImpl((a), (b), #a, #b, __FILE__, __FUNCTION__, __LINE__, (hint))
+    array<Slot, METRICS_SLOT_COUNT> slots_;
 
-#define ASSERT(expr) AssertImpl(!!(expr), #expr, __FILE__, __FUNCTION__, __LINE__, "")
+    Slot& GetSlot() {
+        static atomic<size_t> next_thread_index{0};
+        thread_local const size_t thread_index = next_thread_index++;
+        return slots_[thread_index % METRICS_SLOT_COUNT];
+    }
+};
 
-#define ASSERT_HINT(expr, hint) AssertImpl(!!(expr), #expr, __FILE__, __FUNCTION__, __LINE__, (hint))
+// Records the latency of an operation when it goes out of scope; does nothing without metrics
+class ScopedLatency {
+public:
+    using Clock = chrono::steady_clock;
 
-#define RUN_TEST(function) function(); std::cerr << #function " OK\n"
+    ScopedLatency(SearchMetrics* metrics, SearchMetrics::Operation operation)
+        : metrics_(metrics)
+        , operation_(operation) {
+        if (metrics_ != nullptr) {
+            start_time_ = Clock::now();
+        }
+    }
 
-/*
-   Подставьте сюда вашу реализацию макросов
-   ASSERT, ASSERT_EQUAL, ASSERT_EQUAL_HINT, ASSERT_HINT и RUN_TEST
-*/
+    ScopedLatency(const ScopedLatency&) = delete;
+    ScopedLatency& operator=(const ScopedLatency&) = delete;
 
+    ~ScopedLatency() {
+        if (metrics_ != nullptr) {
+            const auto duration = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start_time_);
+            metrics_->RecordLatency(operation_, duration.count());
+        }
+    }
 
+private:
+    SearchMetrics* metrics_;
+    SearchMetrics::Operation operation_;
+    Clock::time_point start_time_;
+};
 
+class ConcurrentSearchServer;
+class ShardedSearchServer;
 
-// -------- Начало модульных тестов поисковой системы ----------
+class SearchServer {
+public:
+    // Reusable scratch memory of queries, defined next to the query structures it holds
+    class QueryContext;
 
-// Тест проверяет, что поисковая система исключает стоп-слова при добавлении документов
-void TestExcludeStopWordsFromAddedDocumentContent() {
-    const int doc_id = 42;
-    const string content = "cat in the city"s;
-    const vector<int> ratings = {1, 2, 3};
-    {
-        SearchServer server;
-        server.AddDocument(doc_id, content, DocumentStatus::ACTUAL, ratings);
-        const auto found_docs = server.FindTopDocuments("in"s);
-        ASSERT_EQUAL(found_docs.size(), 1u);
-        const Document& doc0 = found_docs[0];
-        ASSERT_EQUAL(doc0.id, doc_id);
+    void SetStopWords(string_view text) {
+        for (const string_view word : SplitIntoWords(text)) {
+            terms_[AddTerm(word)].is_stop_word = true;
+        }
+        ++generation_;
     }
 
-    {
-        SearchServer server;
-        server.SetStopWords("in the"s);
-        server.AddDocument(doc_id, content, DocumentStatus::ACTUAL, ratings);
-        ASSERT_HINT(server.FindTopDocuments("in"s).empty(), "Stop words must be excluded from documents"s);
+    void AddDocument(int document_id, string_view document, DocumentStatus status, const vector<int>& ratings) {
+        const ScopedLatency latency(metrics_.get(), SearchMetrics::Operation::ADD_DOCUMENT);
+        const map<string_view, double> word_freqs = ComputeWordFreqs(SplitIntoWordsNoStop(document));
+        const DocumentOrdinal ordinal = AddDocumentOrdinal(document_id,
+            DocumentData{
+                ComputeAverageRating(ratings),
+                status
+            });
+        map<string_view, double>& document_word_freqs = ordinal_word_freqs_[ordinal];
+        for (const auto& [word, term_freq] : word_freqs) {
+            const TermId term_id = AddTerm(word);
+            AddPosting(terms_[term_id].postings, ordinal, term_freq);
+            document_word_freqs[term_pool_.GetTerm(term_id)] += term_freq;
+        }
+        ++generation_;
     }
-}
 
+    // Streams DocumentRecord lines through a pipeline: a reader thread fills batches of
+    // batch_size records, tokenizer workers build partial indexes of a batch in parallel,
+    // and the partial indexes of the previous batch are merged into the server meanwhile.
+    // Throws invalid_argument on a malformed record; batches merged before it stay in the server.
+    IngestStats AddDocuments(istream& input, size_t batch_size = INGEST_BATCH_SIZE) {
+        const auto start = chrono::steady_clock::now();
+        // Tokenizers must not read the pool while the merge stage grows it
+        unordered_set<string_view> stop_words;
+        for (TermId term_id = 0; term_id < terms_.size(); ++term_id) {
+            if (terms_[term_id].is_stop_word) {
+                stop_words.insert(term_pool_.GetTerm(term_id));
+            }
+        }
 
+        IngestStats stats;
+        const auto read_batch = [&input, batch_size] {
+            auto batch = make_unique<IngestBatch>();
+            vector<size_t> line_ends;
+            string line;
+            while (line_ends.size() < batch_size && getline(input, line)) {
+                if (line.empty()) {
+                    continue;
+                }
+                batch->text += line;
+                line_ends.push_back(batch->text.size());
+            }
+            size_t line_begin = 0;
+            for (const size_t line_end : line_ends) {
+                batch->lines.push_back(string_view(batch->text).substr(line_begin, line_end - line_begin));
+                line_begin = line_end;
+            }
+            return batch;
+        };
+        const auto tokenize_batch = [&stop_words](unique_ptr<IngestBatch> batch) {
+            const size_t worker_count = max<size_t>(1, thread::hardware_concurrency());
+            const size_t chunk_size = (batch->lines.size() + worker_count - 1) / worker_count;
+            batch->partial_indexes.resize((batch->lines.size() + chunk_size - 1) / chunk_size);
+            vector<size_t> chunks(batch->partial_indexes.size());
+            iota(chunks.begin(), chunks.end(), 0);
+            // Parallel algorithms terminate on exceptions, so errors are passed out by hand
+            vector<exception_ptr> errors(chunks.size());
+            for_each(execution::par, chunks.begin(), chunks.end(), [&](size_t chunk) {
+                const auto first = batch->lines.begin() + chunk * chunk_size;
+                const auto last = batch->lines.begin() + min(batch->lines.size(), (chunk + 1) * chunk_size);
+                try {
+                    batch->partial_indexes[chunk] = BuildPartialIndex(first, last, stop_words);
+                } catch (...) {
+                    errors[chunk] = current_exception();
+                }
+            });
+            for (const exception_ptr& error : errors) {
+                if (error) {
+                    rethrow_exception(error);
+                }
+            }
+            return batch;
+        };
 
+        future<unique_ptr<IngestBatch>> reading = async(launch::async, read_batch);
+        future<unique_ptr<IngestBatch>> tokenizing;
+        while (true) {
+            unique_ptr<IngestBatch> batch = reading.get();
+            const bool is_last = batch->lines.empty();
+            future<unique_ptr<IngestBatch>> next_tokenizing;
+            if (!is_last) {
+                reading = async(launch::async, read_batch);
+                stats.document_count += batch->lines.size();
+                stats.byte_count += batch->text.size() + batch->lines.size();
+                next_tokenizing = async(launch::async, tokenize_batch, move(batch));
+            }
+            if (tokenizing.valid()) {
+                MergeBatch(*tokenizing.get());
+            }
+            tokenizing = move(next_tokenizing);
+            if (is_last) {
+                break;
+            }
+        }
+        UpdateInverseDocumentFreqs();
+        stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return stats;
+    }
 
-//Добавление документов. Добавленный документ должен находиться по поисковому запросу, который содержит слова из документа.
-void TestAddDocument() {
+    // Writes stop words, the term dictionary, posting lists and documents into a binary snapshot
+    void Save(const string& path) const {
+        ofstream output(path, ios::binary);
+        if (!output) {
+            throw runtime_error("Can't create "s + path);
+        }
+        SnapshotHeader header = {};
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        SnapshotWriter writer(output);
+        const TermId term_count = static_cast<TermId>(term_pool_.GetTermCount());
+        writer.Write<uint64_t>(term_count);
+        for (TermId term_id = 0; term_id < term_count; ++term_id) {
+            const string_view term = term_pool_.GetTerm(term_id);
+            writer.Write<uint32_t>(term.size());
+            writer.WriteBytes(term.data(), term.size());
+            writer.Write<uint8_t>(terms_[term_id].is_stop_word);
+            writer.Write<uint64_t>(terms_[term_id].postings.size());
+        }
+        writer.AlignTo(alignof(Posting));
+        for (const Term& term : terms_) {
+            term.postings.ForEachBlock(0, numeric_limits<DocumentOrdinal>::max(), [&writer](const Posting* begin, const Posting* end) {
+                for (const Posting* it = begin; it != end; ++it) {
+                    // Padding bytes are zeroed to keep the checksum reproducible
+                    Posting posting;
+                    memset(&posting, 0, sizeof(posting));
+                    posting.document_ordinal = it->document_ordinal;
+                    posting.term_freq = it->term_freq;
+                    writer.Write(posting);
+                }
+            });
+        }
+        // Ordinals of removed documents are kept, so that postings stay valid
+        writer.Write<uint64_t>(ordinal_document_ids_.size());
+        for (DocumentOrdinal ordinal = 0; ordinal < ordinal_document_ids_.size(); ++ordinal) {
+            const int document_id = ordinal_document_ids_[ordinal];
+            const auto id_it = document_ordinals_.find(document_id);
+            const map<string_view, double>& word_freqs = ordinal_word_freqs_[ordinal];
+            writer.Write<int32_t>(document_id);
+            writer.Write<int32_t>(ordinal_ratings_[ordinal]);
+            writer.Write<int32_t>(static_cast<int32_t>(ordinal_statuses_[ordinal]));
+            writer.Write<uint8_t>(id_it != document_ordinals_.end() && id_it->second == ordinal);
+            writer.Write<uint64_t>(word_freqs.size());
+            for (const auto& [word, term_freq] : word_freqs) {
+                writer.Write<uint32_t>(term_pool_.Find(word));
+                writer.Write<double>(term_freq);
+            }
+        }
 
-        const std::vector<int> ratings = { 1 };
-        const int document_id = 42;
-        const std::string content1 = "cat in the city";
-        const std::string content2 = "dog was found";
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.byte_order = SNAPSHOT_BYTE_ORDER;
+        header.payload_size = writer.GetSize();
+        header.checksum = writer.GetChecksum();
+        output.seekp(0);
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        if (!output) {
+            throw runtime_error("Can't write "s + path);
+        }
+    }
 
-        
-            SearchServer server;
+    // Posting lists of the loaded server point straight into the mapped snapshot and are copied
+    // only when a document is added to or removed from them
+    static SearchServer Load(const string& path) {
+        auto snapshot = make_unique<MappedFile>(path);
+        SnapshotHeader header;
+        if (snapshot->GetSize() < sizeof(header)) {
+            throw runtime_error(path + " is not a search server snapshot"s);
+        }
+        memcpy(&header, snapshot->GetData(), sizeof(header));
+        if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+            throw runtime_error(path + " is not a search server snapshot"s);
+        }
+        if (header.version != SNAPSHOT_VERSION || header.byte_order != SNAPSHOT_BYTE_ORDER) {
+            throw runtime_error(path + " has unsupported snapshot version or byte order"s);
+        }
+        const char* payload = snapshot->GetData() + sizeof(header);
+        if (header.payload_size != snapshot->GetSize() - sizeof(header)
+            || UpdateSnapshotChecksum(SNAPSHOT_CHECKSUM_SEED, payload, header.payload_size) != header.checksum) {
+            throw runtime_error(path + " is corrupted"s);
+        }
 
-            server.AddDocument(document_id, content1, DocumentStatus::ACTUAL, ratings);
-            server.AddDocument(document_id + 1, content2, DocumentStatus::ACTUAL, ratings);
+        SnapshotReader reader(payload, header.payload_size);
+        SearchServer server;
+        const uint64_t term_count = reader.Read<uint64_t>();
+        vector<uint64_t> posting_counts;
+        for (uint64_t i = 0; i < term_count; ++i) {
+            const uint32_t term_size = reader.Read<uint32_t>();
+            const TermId term_id = server.AddTerm(string_view(reader.Take(term_size), term_size));
+            if (term_id != i) {
+                throw runtime_error(path + " has duplicate terms"s);
+            }
+            server.terms_[term_id].is_stop_word = reader.Read<uint8_t>() != 0;
+            posting_counts.push_back(reader.Read<uint64_t>());
+        }
+        reader.AlignTo(alignof(Posting));
+        for (uint64_t i = 0; i < term_count; ++i) {
+            server.terms_[i].postings = PostingList(reader.TakeArray<Posting>(posting_counts[i]), posting_counts[i]);
+        }
+        const uint64_t ordinal_count = reader.Read<uint64_t>();
+        for (DocumentBitmap& documents : server.status_documents_) {
+            documents.Resize(ordinal_count);
+        }
+        for (uint64_t ordinal = 0; ordinal < ordinal_count; ++ordinal) {
+            const int document_id = reader.Read<int32_t>();
+            server.ordinal_document_ids_.push_back(document_id);
+            server.ordinal_ratings_.push_back(reader.Read<int32_t>());
+            const int32_t status = reader.Read<int32_t>();
+            if (status < 0 || static_cast<size_t>(status) >= DOCUMENT_STATUS_COUNT) {
+                throw runtime_error(path + " is corrupted"s);
+            }
+            server.ordinal_statuses_.push_back(static_cast<DocumentStatus>(status));
+            if (reader.Read<uint8_t>() != 0) {
+                server.document_ordinals_.emplace(document_id, static_cast<DocumentOrdinal>(ordinal));
+                server.document_ids_.insert(server.document_ids_.end(), document_id);
+                server.status_documents_[status].Set(ordinal);
+            }
+            map<string_view, double>& word_freqs = server.ordinal_word_freqs_.emplace_back();
+            const uint64_t word_count = reader.Read<uint64_t>();
+            for (uint64_t j = 0; j < word_count; ++j) {
+                const TermId term_id = reader.Read<uint32_t>();
+                if (term_id >= term_count) {
+                    throw runtime_error(path + " is corrupted"s);
+                }
+                word_freqs.emplace_hint(word_freqs.end(), server.term_pool_.GetTerm(term_id), reader.Read<double>());
+            }
+        }
+        server.snapshot_ = move(snapshot);
+        server.UpdateInverseDocumentFreqs();
+        return server;
+    }
 
-            ASSERT_EQUAL_HINT(server.GetDocumentCount(), 2, "AddDocument doesn't add documents properly");
+    // Costs O(W log P) for a document of W words, whatever the vocabulary size
+    void RemoveDocument(int document_id) {
+        RemoveDocument(execution::seq, document_id);
+    }
 
-            {
-                const std::vector<Document>& result = server.FindTopDocuments(content1);
+    // Every word of the document has its own posting list, so the lists are updated independently
+    template <typename ExecutionPolicy>
+    void RemoveDocument(ExecutionPolicy&& policy, int document_id) {
+        const auto ordinal_it = document_ordinals_.find(document_id);
+        if (ordinal_it == document_ordinals_.end()) {
+            return;
+        }
+        const DocumentOrdinal ordinal = ordinal_it->second;
+        map<string_view, double>& word_freqs = ordinal_word_freqs_[ordinal];
+        vector<PostingList*> postings(word_freqs.size());
+        transform(word_freqs.begin(), word_freqs.end(), postings.begin(),
+            [this](const auto& word_freq) {
+                return &terms_[term_pool_.Find(word_freq.first)].postings;
+            });
+        for_each(policy, postings.begin(), postings.end(),
+            [ordinal](PostingList* word_postings) {
+                RemovePosting(*word_postings, ordinal);
+            });
+        // The ordinal is not reused, its postings are gone
+        word_freqs.clear();
+        status_documents_[static_cast<size_t>(ordinal_statuses_[ordinal])].Reset(ordinal);
+        document_ordinals_.erase(ordinal_it);
+        document_ids_.erase(document_id);
+        ++generation_;
+    }
 
-                ASSERT_EQUAL_HINT(result.size(), 1, "Document doesn't match itself");
-                ASSERT_EQUAL_HINT(result[0].id, document_id, "Document content matches content of other document");
-            }
+    // Words of an unknown document are empty
+    const map<string_view, double>& GetWordFrequencies(int document_id) const {
+        static const map<string_view, double> empty_word_freqs;
+        const auto it = document_ordinals_.find(document_id);
+        return it == document_ordinals_.end() ? empty_word_freqs : ordinal_word_freqs_[it->second];
+    }
 
-            {
-                const std::vector<Document>& result = server.FindTopDocuments(content2);
 
-                ASSERT_EQUAL_HINT(result.size(), 1, "Document doesn't match itself");
-                ASSERT_EQUAL_HINT(result[0].id, (document_id + 1),
-                    "Document content matches content of other document");
+    // Served from the query cache when it is enabled. Documents are filtered by status with
+    // a bitmap, so those of other statuses are never scored.
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentStatus given_status = DocumentStatus::ACTUAL,
+                                      size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        QueryContext& context = GetThreadQueryContext();
+        if (!query_cache_) {
+            return FindTopDocuments(context, raw_query, given_status, top_count);
+        }
+        const ScopedLatency latency(metrics_.get(), SearchMetrics::Operation::FIND_TOP_DOCUMENTS);
+        ParseQuery(raw_query, context.query);
+        string key = GetQueryCacheKey(context.query, given_status, top_count);
+        if (optional<vector<Document>> cached_documents = query_cache_->Find(key, generation_)) {
+            CountMetric(SearchMetrics::Counter::RESULTS_RETURNED, cached_documents->size());
+            return move(*cached_documents);
+        }
+        FindParsedTopDocuments(context, given_status, top_count);
+        query_cache_->Insert(move(key), generation_, context.documents);
+        return context.documents;
+    }
 
-            }
 
-            ASSERT_HINT(server.FindTopDocuments("nothing here").empty(),
-                "FindTopDocuments matches documents it must not match");
-        
-    
-}
 
-//Поддержка минус-слов. Документы, содержащие минус-слова из поискового запроса, не должны включаться в результаты поиска.
-void TestMinusWords() {
-    const int document_id = 42;
-    const std::vector<int> ratings = { 1 };
+template <typename DocumentPredicate>
+    vector<Document> FindTopDocuments(string_view raw_query,DocumentPredicate document_predicate,
+                                      size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(GetThreadQueryContext(), raw_query, document_predicate, top_count);
+    }
 
-    {
-        SearchServer server;
+    // Results stay in the context until its next query. The query cache is not consulted,
+    // so that a warmed-up context answers without heap allocations.
+    template <typename DocumentPredicate>
+    const vector<Document>& FindTopDocuments(QueryContext& context, string_view raw_query, DocumentPredicate document_predicate,
+                                             size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        const ScopedLatency latency(metrics_.get(), SearchMetrics::Operation::FIND_TOP_DOCUMENTS);
+        ParseQuery(raw_query, context.query);
+        GetQueryPostings(context.query, context.query_postings);
+        FindTopDocuments(context, context.query_postings, document_predicate, top_count);
+        return context.documents;
+    }
 
-        server.AddDocument(document_id, "cat in the city", DocumentStatus::ACTUAL, ratings);
-        server.AddDocument(document_id + 1, "dog in the park", DocumentStatus::ACTUAL, ratings);
+    const vector<Document>& FindTopDocuments(QueryContext& context, string_view raw_query,
+                                             DocumentStatus given_status = DocumentStatus::ACTUAL,
+                                             size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        const ScopedLatency latency(metrics_.get(), SearchMetrics::Operation::FIND_TOP_DOCUMENTS);
+        ParseQuery(raw_query, context.query);
+        FindParsedTopDocuments(context, given_status, top_count);
+        return context.documents;
+    }
 
-        {
-            const auto& result = server.FindTopDocuments("in the -dog");
+    // Caches results of status queries, keyed by the parsed query, until the index changes.
+    // Uses up to max_bytes for cached results.
+    void EnableQueryCache(size_t max_bytes) {
+        query_cache_ = make_unique<QueryResultCache>(max_bytes);
+    }
 
-            ASSERT_EQUAL_HINT(result.size(), 1, "Minus words are not ignored");
-            ASSERT_EQUAL_HINT(result[0].id, document_id, "Minus words are not ignored, query returned wrong document");
+    void DisableQueryCache() {
+        query_cache_.reset();
+    }
+
+    QueryResultCache::Stats GetQueryCacheStats() const {
+        return query_cache_ ? query_cache_->GetStats() : QueryResultCache::Stats{};
+    }
+
+    // The predicate of a parallel search is called from several threads at once
+    template <typename ExecutionPolicy, typename DocumentPredicate,
+              enable_if_t<is_execution_policy_v<decay_t<ExecutionPolicy>>, int> = 0>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query,
+                                      DocumentPredicate document_predicate,
+                                      size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        if constexpr (is_same_v<decay_t<ExecutionPolicy>, execution::sequenced_policy>) {
+            return FindTopDocuments(raw_query, document_predicate, top_count);
+        } else {
+            return FindTopDocumentsParallel(policy, raw_query, document_predicate, top_count);
         }
+    }
 
-        {
-            ASSERT_HINT(server.FindTopDocuments("the -cat -dog").empty(), "Minus words are not ignored");
+    template <typename ExecutionPolicy,
+              enable_if_t<is_execution_policy_v<decay_t<ExecutionPolicy>>, int> = 0>
+    vector<Document> FindTopDocuments(ExecutionPolicy&& policy, string_view raw_query,
+                                      DocumentStatus given_status = DocumentStatus::ACTUAL,
+                                      size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        if constexpr (is_same_v<decay_t<ExecutionPolicy>, execution::sequenced_policy>) {
+            return FindTopDocuments(raw_query, given_status, top_count);
+        } else {
+            return FindTopDocumentsParallel(policy, raw_query, [](int, DocumentStatus, int) { return true; },
+                top_count, &status_documents_[static_cast<size_t>(given_status)]);
         }
     }
-}
 
-//Соответствие документов поисковому запросу. При этом должны быть возвращены все слова из поискового запроса, присутствующие в документе. Если есть соответствие хотя бы по одному минус-слову, должен возвращаться пустой список слов.
-void TestMatchDocToRequest(){
 
-    const int document_id = 42;
-	SearchServer server;
-	server.AddDocument(document_id, "cat in the city", DocumentStatus::ACTUAL, { 1 });
-	{
-    const auto& [matched_words, document_status] = server.MatchDocument("cat city", document_id);
-    ASSERT_EQUAL_HINT(matched_words.size(), 2, "MatchDocument doesn't match all words in the document");
-    ASSERT_EQUAL_HINT(matched_words[0], "cat", "MatchDocument doesn't match some words");
-    ASSERT_EQUAL_HINT(matched_words[1], "city", "MatchDocument doesn't match some words");
-	}
-	{
-    const auto& [matched_words, unused] = server.MatchDocument("cat -city", document_id);
-    ASSERT_HINT(matched_words.empty(), "Minus words are not ignored in MatchDocument");
-	}
-}
 
-//Сортировка найденных документов по релевантности. Возвращаемые при поиске документов результаты должны быть отсортированы в порядке убывания релевантности.
-void TestSortByRelevance(){
 
-    const int document_id = 42;
-    const std::vector<int> ratings = { 1 };
+    int GetDocumentCount() const {
+        return document_ordinals_.size();
+    }
 
-    {
-        SearchServer server;
+    // Document ids in ascending order
+    set<int>::const_iterator begin() const {
+        return document_ids_.begin();
+    }
 
-        server.AddDocument(document_id, "The cat in the city", DocumentStatus::ACTUAL, ratings);
-        server.AddDocument(document_id + 1, "The cat in the", DocumentStatus::ACTUAL, ratings);
-        server.AddDocument(document_id + 2, "The cat in", DocumentStatus::ACTUAL, ratings);
-        server.AddDocument(document_id + 3, "The", DocumentStatus::ACTUAL, ratings);
+    set<int>::const_iterator end() const {
+        return document_ids_.end();
+    }
 
-        int id = 0;
-        const std::vector<std::string> words = {
-            "generation", "bake", "quarrel", "ferry", "biscuit",
-            "table", "bother", "guideline", "duty", "first",
-        };
+    TermPool::MemoryStats GetTermMemoryStats() const {
+        return term_pool_.GetMemoryStats();
+    }
 
-        for (auto word : words) {
-            server.AddDocument(++id, word, DocumentStatus::ACTUAL, ratings);
+    struct PostingMemoryStats {
+        size_t posting_count = 0;
+        size_t byte_count = 0;
+    };
+
+    PostingMemoryStats GetPostingMemoryStats() const {
+        PostingMemoryStats stats;
+        for (const Term& term : terms_) {
+            stats.posting_count += term.postings.size();
+            stats.byte_count += term.postings.GetByteCount();
         }
+        return stats;
+    }
 
-        {
-            const auto& result = server.FindTopDocuments("cat");
+    // Compresses posting lists in place, search results stay the same. A list that is changed
+    // later is decompressed again, so this pays off once ingest is over.
+    void CompressPostings() {
+        for_each(execution::par, terms_.begin(), terms_.end(), [](Term& term) {
+            term.postings.Compress();
+        });
+    }
 
-            ASSERT_EQUAL_HINT(result.size(), 3, "FindTopDocument incorrect amount of documents");
-            constexpr double document_relevance_inaccuracy = 1e-6;
+    static bool IsScoringKernelSupported(ScoringKernel kernel) {
+#ifdef SEARCH_SERVER_HAS_X86_SIMD
+        switch (kernel) {
+        case ScoringKernel::SSE2:
+            return __builtin_cpu_supports("sse2");
+        case ScoringKernel::AVX2:
+            return __builtin_cpu_supports("avx2");
+        default:
+            return true;
+        }
+#else
+        return kernel == ScoringKernel::SCALAR;
+#endif
+    }
 
-            auto sort_by_relevance = [document_relevance_inaccuracy](const Document& left, const Document& right) {
-                return std::abs(left.relevance - right.relevance) < document_relevance_inaccuracy;
-            };
+    static ScoringKernel GetBestScoringKernel() {
+        static const ScoringKernel best_kernel = IsScoringKernelSupported(ScoringKernel::AVX2) ? ScoringKernel::AVX2
+            : IsScoringKernelSupported(ScoringKernel::SSE2) ? ScoringKernel::SSE2 : ScoringKernel::SCALAR;
+        return best_kernel;
+    }
 
-            ASSERT_HINT(std::is_sorted(std::begin(result), std::end(result), sort_by_relevance),
-                "Documents are not sorted correctly");
+    // The best kernel of the CPU is chosen by default
+    void SetScoringKernel(ScoringKernel kernel) {
+        if (!IsScoringKernelSupported(kernel)) {
+            throw invalid_argument("Scoring kernel "s + string(GetScoringKernelName(kernel)) + " is not supported by the CPU"s);
         }
+        scoring_kernel_ = kernel;
     }
 
-}
+    ScoringKernel GetScoringKernel() const {
+        return scoring_kernel_;
+    }
 
-//Вычисление рейтинга документов. Рейтинг добавленного документа равен среднему арифметическому оценок документа.
-void TestCalcRating(){
+    // Sequential top queries with several plus words skip documents that can't enter the top.
+    // Results are the same either way.
+    void SetDynamicPruning(bool enabled) {
+        dynamic_pruning_ = enabled;
+    }
 
-	auto calculate_average_rating = [](const std::vector<int>& input) {
-	        int correct = 0;
-	        for (auto number : input) {
-	            correct += number;
-	        }
-	        correct /= static_cast<int>(input.size());
-	        return correct;
-	    };
+    // Scored documents are the ones whose full relevance was computed. Minus words and the status
+    // are applied before scoring, so documents they exclude are never scored; a predicate is
+    // applied to scored documents.
+    struct ScoringStats {
+        uint64_t query_count = 0;
+        uint64_t scored_document_count = 0;
+    };
 
-	    {
-	        const std::vector<int> ratings = { 1, 10, 28, 60, 11, 11, 12321 };
+    ScoringStats GetScoringStats() const {
+        return {scoring_counters_->query_count.load(memory_order_relaxed),
+                scoring_counters_->scored_document_count.load(memory_order_relaxed)};
+    }
 
-	        SearchServer server;
+    // Latency histograms and work counters are collected from this call on. Costs about 150 KB.
+    // Must not be called while queries run.
+    void EnableMetrics() {
+        if (!metrics_) {
+            metrics_ = make_unique<SearchMetrics>();
+        }
+    }
 
-	        server.AddDocument(42, "cat in the city", DocumentStatus::ACTUAL, ratings);
+    void DisableMetrics() {
+        metrics_.reset();
+    }
 
-	        {
-	            const auto& result = server.FindTopDocuments("cat");
+    // Empty while metrics are disabled
+    SearchMetrics::Snapshot GetMetricsSnapshot() const {
+        return metrics_ ? metrics_->GetSnapshot() : SearchMetrics::Snapshot{};
+    }
 
-	            ASSERT_EQUAL_HINT(result[0].rating, calculate_average_rating(ratings), "Incorrect rating calculation");
-	        }
-	    }
+    // Computed on request, whether metrics are enabled or not
+    struct IndexGauges {
+        // Words with documents
+        size_t term_count = 0;
+        size_t posting_count = 0;
+        // Indexed by DocumentStatus
+        array<size_t, DOCUMENT_STATUS_COUNT> document_counts = {};
+        // Estimated from container capacities and the libstdc++ node layout
+        size_t byte_count = 0;
+    };
 
-	    {
-	        const std::vector<int> ratings = { 545, 136, 548, 508, 797, 21005, 245 };
+    IndexGauges GetIndexGauges() const {
+        IndexGauges gauges;
+        for (const Term& term : terms_) {
+            if (!term.postings.empty()) {
+                ++gauges.term_count;
+                gauges.posting_count += term.postings.size();
+            }
+            gauges.byte_count += term.postings.GetByteCount();
+        }
+        for (size_t status = 0; status < DOCUMENT_STATUS_COUNT; ++status) {
+            gauges.document_counts[status] = status_documents_[status].Count();
+            gauges.byte_count += status_documents_[status].GetByteCount();
+        }
+        const TermPool::MemoryStats term_stats = term_pool_.GetMemoryStats();
+        gauges.byte_count += term_stats.arena_bytes + term_stats.dictionary_bytes + terms_.capacity() * sizeof(Term);
+        const size_t word_freq_node_bytes = 4 * sizeof(void*) + sizeof(pair<const string_view, double>);
+        for (const map<string_view, double>& word_freqs : ordinal_word_freqs_) {
+            gauges.byte_count += word_freqs.size() * word_freq_node_bytes;
+        }
+        gauges.byte_count += ordinal_word_freqs_.capacity() * sizeof(map<string_view, double>)
+            + ordinal_document_ids_.capacity() * sizeof(int) + ordinal_statuses_.capacity() * sizeof(DocumentStatus)
+            + ordinal_ratings_.capacity() * sizeof(int)
+            + document_ordinals_.bucket_count() * sizeof(void*) + document_ordinals_.size() * (2 * sizeof(void*) + sizeof(pair<int, DocumentOrdinal>))
+            + document_ids_.size() * (4 * sizeof(void*) + sizeof(int));
+        return gauges;
+    }
 
-	        SearchServer server;
+    // Index gauges and, while metrics are enabled, counters and latency histograms in the
+    // Prometheus text exposition format. Histogram buckets are the powers of two of nanoseconds.
+    void WriteMetrics(ostream& output) const {
+        const IndexGauges gauges = GetIndexGauges();
+        output << "# HELP search_server_terms Words with documents in the index.\n"s
+               << "# TYPE search_server_terms gauge\n"s
+               << "search_server_terms "s << gauges.term_count << '\n'
+               << "# HELP search_server_postings Posting entries in the index.\n"s
+               << "# TYPE search_server_postings gauge\n"s
+               << "search_server_postings "s << gauges.posting_count << '\n'
+               << "# HELP search_server_documents Documents in the index by status.\n"s
+               << "# TYPE search_server_documents gauge\n"s;
+        for (size_t status = 0; status < DOCUMENT_STATUS_COUNT; ++status) {
+            output << "search_server_documents{status=\""s << GetDocumentStatusName(static_cast<DocumentStatus>(status))
+                   << "\"} "s << gauges.document_counts[status] << '\n';
+        }
+        output << "# HELP search_server_memory_bytes Approximate memory held by the index.\n"s
+               << "# TYPE search_server_memory_bytes gauge\n"s
+               << "search_server_memory_bytes "s << gauges.byte_count << '\n';
+        if (!metrics_) {
+            return;
+        }
 
-	        server.AddDocument(42, "cat in the city", DocumentStatus::ACTUAL, ratings);
+        const SearchMetrics::Snapshot snapshot = metrics_->GetSnapshot();
+        const tuple<SearchMetrics::Counter, string_view, string_view> counters[] = {
+            {SearchMetrics::Counter::POSTINGS_SCANNED, "postings_scanned"sv, "Posting entries read by searches."sv},
+            {SearchMetrics::Counter::CANDIDATES_SCORED, "candidates_scored"sv, "Documents scored by searches."sv},
+            {SearchMetrics::Counter::RESULTS_RETURNED, "results_returned"sv, "Documents returned by searches."sv},
+        };
+        for (const auto& [counter, name, help] : counters) {
+            output << "# HELP search_server_"s << name << "_total "s << help << '\n'
+                   << "# TYPE search_server_"s << name << "_total counter\n"s
+                   << "search_server_"s << name << "_total "s << snapshot.GetCounter(counter) << '\n';
+        }
+        output << "# HELP search_server_operation_duration_seconds Latency of server operations.\n"s
+               << "# TYPE search_server_operation_duration_seconds histogram\n"s;
+        for (size_t operation = 0; operation < SearchMetrics::OPERATION_COUNT; ++operation) {
+            const string_view name = SearchMetrics::GetOperationName(static_cast<SearchMetrics::Operation>(operation));
+            const SearchMetrics::Histogram& histogram = snapshot.latencies[operation];
+            uint64_t cumulative_count = 0;
+            for (size_t i = 0; i < SearchMetrics::BUCKET_COUNT; ++i) {
+                cumulative_count += histogram.bucket_counts[i];
+                const uint64_t bucket_end = SearchMetrics::GetBucketEnd(i);
+                // Microsecond and longer powers of two
+                if (bucket_end >= 1024 && (bucket_end & (bucket_end - 1)) == 0) {
+                    output << "search_server_operation_duration_seconds_bucket{operation=\""s << name << "\",le=\""s
+                           << bucket_end * 1e-9 << "\"} "s << cumulative_count << '\n';
+                }
+            }
+            output << "search_server_operation_duration_seconds_bucket{operation=\""s << name << "\",le=\"+Inf\"} "s
+                   << histogram.count << '\n'
+                   << "search_server_operation_duration_seconds_sum{operation=\""s << name << "\"} "s
+                   << histogram.total_nanoseconds * 1e-9 << '\n'
+                   << "search_server_operation_duration_seconds_count{operation=\""s << name << "\"} "s
+                   << histogram.count << '\n';
+        }
+    }
 
-	        {
-	            const auto& result = server.FindTopDocuments("cat");
+    // Written to a temporary file that then replaces path, so that a collector never reads
+    // a partly written file
+    void WriteMetrics(const string& path) const {
+        const string temporary_path = path + ".tmp"s;
+        {
+            ofstream output(temporary_path);
+            if (!output) {
+                throw runtime_error("Can't create "s + temporary_path);
+            }
+            WriteMetrics(output);
+            if (!output.flush()) {
+                throw runtime_error("Can't write "s + temporary_path);
+            }
+        }
+        filesystem::rename(temporary_path, path);
+    }
 
-	            ASSERT_EQUAL_HINT(result[0].rating, calculate_average_rating(ratings), "Incorrect rating calculation");
-	        }
-	    }
+    // Matched words are views into the index and stay valid while the server lives.
+    // Minus words are checked first, so a document they exclude costs no plus word lookups.
+    tuple<vector<string_view>, DocumentStatus> MatchDocument(string_view raw_query, int document_id) const {
+        const ScopedLatency latency(metrics_.get(), SearchMetrics::Operation::MATCH_DOCUMENT);
+        const DocumentOrdinal ordinal = document_ordinals_.at(document_id);
+        const DocumentStatus status = ordinal_statuses_[ordinal];
+        const Query query = ParseQuery(raw_query);
+        for (const string_view word : query.minus_words) {
+            const PostingList* postings = FindPostings(word);
+            if (postings != nullptr && ContainsDocument(*postings, ordinal)) {
+                return {vector<string_view>(), status};
+            }
+        }
+        vector<string_view> matched_words;
+        matched_words.reserve(query.plus_words.size());
+        for (const string_view word : query.plus_words) {
+            const TermId term_id = term_pool_.Find(word);
+            if (term_id != TermPool::NO_TERM && ContainsDocument(terms_[term_id].postings, ordinal)) {
+                matched_words.push_back(term_pool_.GetTerm(term_id));
+            }
+        }
+        return {move(matched_words), status};
+    }
 
-}
+    // Looks query words up in the words of the document, which is cheaper than posting lists
+    // when each of many threads checks a part of a long query
+    template <typename ExecutionPolicy,
+              enable_if_t<is_execution_policy_v<decay_t<ExecutionPolicy>>, int> = 0>
+    tuple<vector<string_view>, DocumentStatus> MatchDocument(ExecutionPolicy&& policy, string_view raw_query, int document_id) const {
+        if constexpr (is_same_v<decay_t<ExecutionPolicy>, execution::sequenced_policy>) {
+            return MatchDocument(raw_query, document_id);
+        } else {
+            const ScopedLatency latency(metrics_.get(), SearchMetrics::Operation::MATCH_DOCUMENT);
+            const DocumentOrdinal ordinal = document_ordinals_.at(document_id);
+            const DocumentStatus status = ordinal_statuses_[ordinal];
+            const map<string_view, double>& word_freqs = ordinal_word_freqs_[ordinal];
+            const Query query = ParseQuery(raw_query, false);
+            if (any_of(policy, query.minus_words.begin(), query.minus_words.end(),
+                       [&word_freqs](string_view word) { return word_freqs.count(word) > 0; })) {
+                return {vector<string_view>(), status};
+            }
+            vector<string_view> matched_words(query.plus_words.size());
+            transform(policy, query.plus_words.begin(), query.plus_words.end(), matched_words.begin(),
+                      [&word_freqs](string_view word) {
+                          const auto it = word_freqs.find(word);
+                          return it == word_freqs.end() ? string_view() : it->first;
+                      });
+            sort(matched_words.begin(), matched_words.end());
+            matched_words.erase(unique(matched_words.begin(), matched_words.end()), matched_words.end());
+            if (!matched_words.empty() && matched_words.front().empty()) {
+                matched_words.erase(matched_words.begin());
+            }
+            return {move(matched_words), status};
+        }
+    }
 
+private:
+    // Score their segments and shards with IDF of the whole index
+    friend class ConcurrentSearchServer;
+    friend class ShardedSearchServer;
 
-//Фильтрация результатов поиска с использованием предиката, задаваемого пользователем.
-void TestFiltrationByUserDefinedPredicate(){
+    struct DocumentData {
+        int rating;
+        DocumentStatus status;
+    };
+
+
+
+    // Documents are numbered densely in the order they are added, so that per-document data
+    // lives in plain vectors. Ordinals of removed documents are not reused.
+    using DocumentOrdinal = uint32_t;
+
+    // Posting lists are contiguous and sorted by document ordinal
+    struct Posting {
+        DocumentOrdinal document_ordinal;
+        double term_freq;
+    };
+    // SIMD kernels load two postings per 128 bits
+    static_assert(sizeof(Posting) == 16 && offsetof(Posting, term_freq) == 8, "Unexpected posting layout");
+
+    // Either owns its postings, views the postings of a loaded snapshot or keeps them compressed.
+    // The first change of a view or of a compressed list turns it into owned storage.
+    class PostingList {
+    public:
+        PostingList() = default;
+
+        PostingList(const Posting* data, size_t size)
+            : view_data_(data)
+            , view_size_(size)
+            , is_view_(true) {
+        }
+
+        PostingList(PostingList&& other) noexcept
+            : owned_(move(other.owned_))
+            , view_data_(other.view_data_)
+            , view_size_(other.view_size_)
+            , is_view_(other.is_view_)
+            , compressed_(move(other.compressed_))
+            , max_term_freq_(other.max_term_freq_.load(memory_order_relaxed)) {
+        }
+
+        PostingList& operator=(PostingList&& other) noexcept {
+            owned_ = move(other.owned_);
+            view_data_ = other.view_data_;
+            view_size_ = other.view_size_;
+            is_view_ = other.is_view_;
+            compressed_ = move(other.compressed_);
+            max_term_freq_.store(other.max_term_freq_.load(memory_order_relaxed), memory_order_relaxed);
+            return *this;
+        }
+
+        // Walks postings in ordinal order, a compressed list is decoded one block at a time into
+        // block, which must hold POSTING_BLOCK_SIZE postings and outlive the cursor
+        class Cursor {
+        public:
+            Cursor(const PostingList& list, Posting* block)
+                : list_(&list) {
+                if (list.compressed_) {
+                    block_ = block;
+                    LoadBlock(0);
+                } else {
+                    current_ = list.is_view_ ? list.view_data_ : list.owned_.data();
+                    end_ = current_ + list.size();
+                }
+            }
+
+            bool IsEnd() const {
+                return current_ == end_;
+            }
+
+            const Posting& operator*() const {
+                return *current_;
+            }
+
+            const Posting* operator->() const {
+                return current_;
+            }
+
+            void Next() {
+                if (++current_ == end_ && block_) {
+                    LoadBlock(block_index_ + 1);
+                }
+            }
+
+            // Moves to the first posting with an ordinal not less than the given one
+            void SeekTo(DocumentOrdinal ordinal) {
+                if (IsEnd() || current_->document_ordinal >= ordinal) {
+                    return;
+                }
+                if (block_) {
+                    const vector<Skip>& skips = list_->compressed_->skips;
+                    if (skips[block_index_].last_ordinal < ordinal) {
+                        const auto skip = lower_bound(skips.begin() + block_index_ + 1, skips.end(), ordinal,
+                            [](const Skip& skip, DocumentOrdinal ordinal) { return skip.last_ordinal < ordinal; });
+                        LoadBlock(skip - skips.begin());
+                    }
+                }
+                current_ = LowerBound(current_, end_, ordinal);
+            }
+
+        private:
+            void LoadBlock(size_t block_index) {
+                block_index_ = block_index;
+                const size_t block_size = block_index < list_->compressed_->skips.size()
+                    ? list_->DecodeBlock(block_index, block_) : 0;
+                current_ = block_;
+                end_ = current_ + block_size;
+            }
+
+            const PostingList* list_;
+            const Posting* current_ = nullptr;
+            const Posting* end_ = nullptr;
+            // Null for an uncompressed list
+            Posting* block_ = nullptr;
+            size_t block_index_ = 0;
+        };
+
+        size_t size() const {
+            if (compressed_) {
+                return compressed_->posting_count;
+            }
+            return is_view_ ? view_size_ : owned_.size();
+        }
+
+        bool empty() const {
+            return size() == 0;
+        }
+
+        // Calls function(begin, end) for consecutive runs of postings with ordinals in
+        // [first_ordinal, last_ordinal). Compressed blocks outside the range are skipped undecoded.
+        template <typename Function>
+        void ForEachBlock(DocumentOrdinal first_ordinal, DocumentOrdinal last_ordinal, Function function) const {
+            if (!compressed_) {
+                const Posting* data = is_view_ ? view_data_ : owned_.data();
+                const Posting* begin = LowerBound(data, data + size(), first_ordinal);
+                const Posting* end = LowerBound(begin, data + size(), last_ordinal);
+                if (begin != end) {
+                    function(begin, end);
+                }
+                return;
+            }
+            const vector<Skip>& skips = compressed_->skips;
+            auto skip = lower_bound(skips.begin(), skips.end(), first_ordinal,
+                [](const Skip& skip, DocumentOrdinal ordinal) { return skip.last_ordinal < ordinal; });
+            Posting block[POSTING_BLOCK_SIZE];
+            for (; skip != skips.end() && skip->first_ordinal < last_ordinal; ++skip) {
+                const size_t block_size = DecodeBlock(skip - skips.begin(), block);
+                const Posting* begin = LowerBound(block, block + block_size, first_ordinal);
+                const Posting* end = LowerBound(begin, block + block_size, last_ordinal);
+                if (begin != end) {
+                    function(begin, end);
+                }
+            }
+        }
+
+        bool Contains(DocumentOrdinal ordinal) const {
+            if (!compressed_) {
+                const Posting* data = is_view_ ? view_data_ : owned_.data();
+                const Posting* it = LowerBound(data, data + size(), ordinal);
+                return it != data + size() && it->document_ordinal == ordinal;
+            }
+            const vector<Skip>& skips = compressed_->skips;
+            const auto skip = lower_bound(skips.begin(), skips.end(), ordinal,
+                [](const Skip& skip, DocumentOrdinal ordinal) { return skip.last_ordinal < ordinal; });
+            if (skip == skips.end() || skip->first_ordinal > ordinal) {
+                return false;
+            }
+            // Only ordinals are decoded, up to the one looked for
+            const uint8_t* bytes = compressed_->bytes.data() + skip->offset;
+            DocumentOrdinal current = skip->first_ordinal;
+            while (current < ordinal) {
+                current += ReadVarint(bytes);
+                ReadVarint(bytes);
+            }
+            return current == ordinal;
+        }
+
+        // Upper bound of the term frequencies of the list, computed on first use
+        double GetMaxTermFreq() const {
+            double max_term_freq = max_term_freq_.load(memory_order_relaxed);
+            if (max_term_freq < 0.0) {
+                max_term_freq = 0.0;
+                ForEachBlock(0, numeric_limits<DocumentOrdinal>::max(), [&max_term_freq](const Posting* begin, const Posting* end) {
+                    for (const Posting* it = begin; it != end; ++it) {
+                        max_term_freq = max(max_term_freq, it->term_freq);
+                    }
+                });
+                max_term_freq_.store(max_term_freq, memory_order_relaxed);
+            }
+            return max_term_freq;
+        }
+
+        vector<Posting>& GetMutable() {
+            max_term_freq_.store(-1.0, memory_order_relaxed);
+            if (compressed_) {
+                owned_.reserve(compressed_->posting_count);
+                ForEachBlock(0, numeric_limits<DocumentOrdinal>::max(), [this](const Posting* begin, const Posting* end) {
+                    owned_.insert(owned_.end(), begin, end);
+                });
+                compressed_.reset();
+            } else if (is_view_) {
+                owned_.assign(view_data_, view_data_ + view_size_);
+            }
+            is_view_ = false;
+            return owned_;
+        }
+
+        // Blocks of POSTING_BLOCK_SIZE postings store ordinal deltas as varints and term frequencies
+        // as varint indexes into a table of the distinct frequencies of the list. A frequency is
+        // a word count divided by a document length, so the table is short and the codes are exact.
+        void Compress() {
+            if (compressed_ || size() < MIN_COMPRESSED_POSTING_COUNT) {
+                return;
+            }
+            const Posting* data = is_view_ ? view_data_ : owned_.data();
+            auto compressed = make_unique<CompressedPostings>();
+            compressed->posting_count = size();
+            for (const Posting* it = data; it != data + size(); ++it) {
+                compressed->term_freqs.push_back(it->term_freq);
+            }
+            sort(compressed->term_freqs.begin(), compressed->term_freqs.end());
+            compressed->term_freqs.erase(unique(compressed->term_freqs.begin(), compressed->term_freqs.end()),
+                                         compressed->term_freqs.end());
+            compressed->term_freqs.shrink_to_fit();
+
+            for (size_t block_begin = 0; block_begin < size(); block_begin += POSTING_BLOCK_SIZE) {
+                const size_t block_end = min(size(), block_begin + POSTING_BLOCK_SIZE);
+                compressed->skips.push_back({data[block_begin].document_ordinal, data[block_end - 1].document_ordinal,
+                                             static_cast<uint32_t>(compressed->bytes.size())});
+                DocumentOrdinal previous = data[block_begin].document_ordinal;
+                for (size_t i = block_begin; i < block_end; ++i) {
+                    WriteVarint(compressed->bytes, data[i].document_ordinal - previous);
+                    previous = data[i].document_ordinal;
+                    const auto code = lower_bound(compressed->term_freqs.begin(), compressed->term_freqs.end(), data[i].term_freq);
+                    WriteVarint(compressed->bytes, static_cast<uint32_t>(code - compressed->term_freqs.begin()));
+                }
+            }
+            compressed->skips.shrink_to_fit();
+            compressed->bytes.shrink_to_fit();
+            compressed_ = move(compressed);
+            vector<Posting>().swap(owned_);
+            view_data_ = nullptr;
+            view_size_ = 0;
+            is_view_ = false;
+        }
+
+        // Postings of a view live in the snapshot mapping and are counted too
+        size_t GetByteCount() const {
+            if (compressed_) {
+                return sizeof(CompressedPostings) + compressed_->skips.capacity() * sizeof(Skip)
+                    + compressed_->bytes.capacity() + compressed_->term_freqs.capacity() * sizeof(double);
+            }
+            return is_view_ ? view_size_ * sizeof(Posting) : owned_.capacity() * sizeof(Posting);
+        }
+
+    private:
+        struct Skip {
+            DocumentOrdinal first_ordinal;
+            DocumentOrdinal last_ordinal;
+            uint32_t offset;
+        };
+
+        struct CompressedPostings {
+            size_t posting_count = 0;
+            vector<Skip> skips;
+            vector<uint8_t> bytes;
+            vector<double> term_freqs;
+        };
+
+        static const Posting* LowerBound(const Posting* begin, const Posting* end, DocumentOrdinal ordinal) {
+            return lower_bound(begin, end, ordinal,
+                [](const Posting& posting, DocumentOrdinal value) { return posting.document_ordinal < value; });
+        }
+
+        static void WriteVarint(vector<uint8_t>& bytes, uint32_t value) {
+            while (value >= 0x80) {
+                bytes.push_back(static_cast<uint8_t>(value | 0x80));
+                value >>= 7;
+            }
+            bytes.push_back(static_cast<uint8_t>(value));
+        }
+
+        static uint32_t ReadVarint(const uint8_t*& bytes) {
+            uint32_t value = *bytes & 0x7F;
+            for (int shift = 7; *bytes++ & 0x80; shift += 7) {
+                value |= static_cast<uint32_t>(*bytes & 0x7F) << shift;
+            }
+            return value;
+        }
+
+        size_t DecodeBlock(size_t block_index, Posting* block) const {
+            const Skip& skip = compressed_->skips[block_index];
+            const size_t block_size = min(POSTING_BLOCK_SIZE, compressed_->posting_count - block_index * POSTING_BLOCK_SIZE);
+            const uint8_t* bytes = compressed_->bytes.data() + skip.offset;
+            DocumentOrdinal ordinal = skip.first_ordinal;
+            for (size_t i = 0; i < block_size; ++i) {
+                ordinal += ReadVarint(bytes);
+                block[i].document_ordinal = ordinal;
+                block[i].term_freq = compressed_->term_freqs[ReadVarint(bytes)];
+            }
+            return block_size;
+        }
+
+        vector<Posting> owned_;
+        const Posting* view_data_ = nullptr;
+        size_t view_size_ = 0;
+        bool is_view_ = false;
+        unique_ptr<CompressedPostings> compressed_;
+        // Negative until computed, concurrent queries may compute it
+        mutable atomic<double> max_term_freq_{-1.0};
+    };
+
+    // Dense bitset, a bit per document ordinal
+    class DocumentBitmap {
+    public:
+        // New bits are clear
+        void Resize(size_t size) {
+            words_.resize((size + 63) / 64);
+        }
+
+        void Set(size_t index) {
+            words_[index / 64] |= uint64_t{1} << (index % 64);
+        }
+
+        void Reset(size_t index) {
+            words_[index / 64] &= ~(uint64_t{1} << (index % 64));
+        }
+
+        bool Test(size_t index) const {
+            return (words_[index / 64] >> (index % 64)) & 1;
+        }
+
+        size_t Count() const {
+            size_t count = 0;
+            for (const uint64_t word : words_) {
+                count += bitset<64>(word).count();
+            }
+            return count;
+        }
+
+        size_t GetByteCount() const {
+            return words_.capacity() * sizeof(uint64_t);
+        }
+
+    private:
+        vector<uint64_t> words_;
+    };
+
+    // Queries update them concurrently
+    struct ScoringCounters {
+        atomic<uint64_t> query_count{0};
+        atomic<uint64_t> scored_document_count{0};
+    };
+
+    static constexpr uint64_t NO_IDF_KEY = numeric_limits<uint64_t>::max();
+
+    struct Term {
+        PostingList postings;
+        bool is_stop_word = false;
+        // IDF is stored next to the postings together with the document count and document
+        // frequency it was computed for. Concurrent queries may refresh it, hence the atomics.
+        mutable atomic<uint64_t> idf_key{NO_IDF_KEY};
+        mutable atomic<double> inverse_document_freq{0.0};
+
+        Term() = default;
+
+        Term(Term&& other) noexcept
+            : postings(move(other.postings))
+            , is_stop_word(other.is_stop_word)
+            , idf_key(other.idf_key.load())
+            , inverse_document_freq(other.inverse_document_freq.load()) {
+        }
+    };
+
+    // Stop words and index words share one pool; terms_ is indexed by TermId
+    TermPool term_pool_;
+    vector<Term> terms_;
+    unordered_map<int, DocumentOrdinal> document_ordinals_;
+    set<int> document_ids_;
+    // Indexed by DocumentOrdinal
+    vector<int> ordinal_document_ids_;
+    vector<DocumentStatus> ordinal_statuses_;
+    vector<int> ordinal_ratings_;
+    // Documents of each status, removed documents are in none
+    array<DocumentBitmap, DOCUMENT_STATUS_COUNT> status_documents_;
+    // Forward index, keys point into term_pool_
+    vector<map<string_view, double>> ordinal_word_freqs_;
+    // Keeps the snapshot that loaded posting lists point into
+    unique_ptr<MappedFile> snapshot_;
+    // Changes on every modification of the index
+    uint64_t generation_ = 0;
+    unique_ptr<QueryResultCache> query_cache_;
+    ScoringKernel scoring_kernel_ = GetBestScoringKernel();
+    bool dynamic_pruning_ = true;
+    unique_ptr<ScoringCounters> scoring_counters_ = make_unique<ScoringCounters>();
+    // Null while metrics are disabled
+    unique_ptr<SearchMetrics> metrics_;
+
+    template <typename Postings>
+    static auto LowerBound(Postings& postings, DocumentOrdinal ordinal) {
+        return lower_bound(postings.begin(), postings.end(), ordinal,
+            [](const Posting& posting, DocumentOrdinal value) { return posting.document_ordinal < value; });
+    }
+
+    static void AddPosting(PostingList& posting_list, DocumentOrdinal ordinal, double term_freq) {
+        vector<Posting>& postings = posting_list.GetMutable();
+        // A new document always has the largest ordinal, so this is a plain append
+        if (postings.empty() || postings.back().document_ordinal < ordinal) {
+            postings.push_back({ordinal, term_freq});
+            return;
+        }
+        const auto it = LowerBound(postings, ordinal);
+        if (it != postings.end() && it->document_ordinal == ordinal) {
+            it->term_freq += term_freq;
+        } else {
+            postings.insert(it, {ordinal, term_freq});
+        }
+    }
+
+    static void RemovePosting(PostingList& posting_list, DocumentOrdinal ordinal) {
+        vector<Posting>& postings = posting_list.GetMutable();
+        const auto it = LowerBound(postings, ordinal);
+        if (it != postings.end() && it->document_ordinal == ordinal) {
+            postings.erase(it);
+        }
+    }
+
+    static bool ContainsDocument(const PostingList& postings, DocumentOrdinal ordinal) {
+        return postings.Contains(ordinal);
+    }
+
+    // Adds a document of another index, its words are copied into this one
+    void AddIndexedDocument(int document_id, DocumentStatus status, int rating, const map<string_view, double>& word_freqs) {
+        const DocumentOrdinal ordinal = AddDocumentOrdinal(document_id, DocumentData{rating, status});
+        map<string_view, double>& document_word_freqs = ordinal_word_freqs_[ordinal];
+        for (const auto& [word, term_freq] : word_freqs) {
+            const TermId term_id = AddTerm(word);
+            AddPosting(terms_[term_id].postings, ordinal, term_freq);
+            document_word_freqs.emplace_hint(document_word_freqs.end(), term_pool_.GetTerm(term_id), term_freq);
+        }
+        ++generation_;
+    }
+
+    // A document added again under the same id keeps its ordinal, rating and status
+    DocumentOrdinal AddDocumentOrdinal(int document_id, const DocumentData& data) {
+        const auto [it, inserted] = document_ordinals_.emplace(document_id, static_cast<DocumentOrdinal>(ordinal_document_ids_.size()));
+        if (inserted) {
+            ordinal_document_ids_.push_back(document_id);
+            ordinal_statuses_.push_back(data.status);
+            ordinal_ratings_.push_back(data.rating);
+            ordinal_word_freqs_.emplace_back();
+            document_ids_.insert(document_id);
+            for (DocumentBitmap& documents : status_documents_) {
+                documents.Resize(ordinal_document_ids_.size());
+            }
+            status_documents_[static_cast<size_t>(data.status)].Set(it->second);
+        }
+        return it->second;
+    }
+
+    // Returns nullptr for unknown words and words without documents
+    const Term* FindTerm(string_view word) const {
+        const TermId term_id = term_pool_.Find(word);
+        if (term_id == TermPool::NO_TERM || terms_[term_id].postings.empty()) {
+            return nullptr;
+        }
+        return &terms_[term_id];
+    }
+
+    const PostingList* FindPostings(string_view word) const {
+        const Term* term = FindTerm(word);
+        return term == nullptr ? nullptr : &term->postings;
+    }
+
+    // The only place where a term is copied: when it first enters the pool
+    TermId AddTerm(string_view word) {
+        const TermId term_id = term_pool_.Intern(word);
+        if (term_id >= terms_.size()) {
+            terms_.resize(term_id + 1);
+        }
+        return term_id;
+    }
+
+    bool IsStopWord(string_view word) const {
+        const TermId term_id = term_pool_.Find(word);
+        return term_id != TermPool::NO_TERM && terms_[term_id].is_stop_word;
+    }
+
+    vector<string_view> SplitIntoWordsNoStop(string_view text) const {
+        vector<string_view> words;
+        for (const string_view word : SplitIntoWords(text)) {
+            if (!IsStopWord(word)) {
+                words.push_back(word);
+            }
+        }
+        return words;
+    }
+
+    // Index of a run of records built without touching the server
+    struct PartialIndex {
+        vector<pair<int, DocumentData>> documents;
+        // Words point into the batch text, in the order of documents
+        vector<map<string_view, double>> document_word_freqs;
+        // Postings refer to documents by their index in documents
+        map<string_view, vector<pair<size_t, double>>> word_to_postings;
+    };
+
+    struct IngestBatch {
+        string text;
+        vector<string_view> lines;
+        vector<PartialIndex> partial_indexes;
+    };
+
+    template <typename LineIterator>
+    static PartialIndex BuildPartialIndex(LineIterator first, LineIterator last, const unordered_set<string_view>& stop_words) {
+        PartialIndex partial_index;
+        for (; first != last; ++first) {
+            const DocumentRecord record = ParseDocumentRecord(*first);
+            vector<string_view> words = SplitIntoWords(record.text);
+            words.erase(remove_if(words.begin(), words.end(),
+                [&stop_words](string_view word) { return stop_words.count(word) > 0; }), words.end());
+            map<string_view, double> word_freqs = ComputeWordFreqs(words);
+            for (const auto& [word, term_freq] : word_freqs) {
+                partial_index.word_to_postings[word].push_back({partial_index.documents.size(), term_freq});
+            }
+            partial_index.documents.push_back({record.id, {ComputeAverageRating(record.ratings), record.status}});
+            partial_index.document_word_freqs.push_back(move(word_freqs));
+        }
+        return partial_index;
+    }
+
+    // Partial indexes are merged in record order, each of them word by word in sorted order
+    void MergeBatch(const IngestBatch& batch) {
+        for (const PartialIndex& partial_index : batch.partial_indexes) {
+            vector<DocumentOrdinal> ordinals;
+            for (const auto& [document_id, data] : partial_index.documents) {
+                ordinals.push_back(AddDocumentOrdinal(document_id, data));
+            }
+            for (const auto& [word, postings] : partial_index.word_to_postings) {
+                PostingList& term_postings = terms_[AddTerm(word)].postings;
+                for (const auto& [document_index, term_freq] : postings) {
+                    AddPosting(term_postings, ordinals[document_index], term_freq);
+                }
+            }
+            for (size_t i = 0; i < partial_index.documents.size(); ++i) {
+                map<string_view, double>& document_word_freqs = ordinal_word_freqs_[ordinals[i]];
+                for (const auto& [word, term_freq] : partial_index.document_word_freqs[i]) {
+                    document_word_freqs[term_pool_.GetTerm(term_pool_.Find(word))] += term_freq;
+                }
+            }
+        }
+        ++generation_;
+    }
+
+    static map<string_view, double> ComputeWordFreqs(const vector<string_view>& words) {
+        const double inv_word_count = 1.0 / words.size();
+        map<string_view, double> word_freqs;
+        for (const string_view word : words) {
+            word_freqs[word] += inv_word_count;
+        }
+        return word_freqs;
+    }
+
+    static int ComputeAverageRating(const vector<int>& ratings) {
+        if (ratings.empty()) {
+            return 0;
+        }
+        int rating_sum = 0;
+        for (const int rating : ratings) {
+            rating_sum += rating;
+        }
+        return rating_sum / static_cast<int>(ratings.size());
+    }
+
+    struct QueryWord {
+        string_view data;
+        bool is_minus;
+        bool is_stop;
+    };
+
+    QueryWord ParseQueryWord(string_view text) const {
+        bool is_minus = false;
+        // Word shouldn't be empty
+        if (text[0] == '-') {
+            is_minus = true;
+            text.remove_prefix(1);
+        }
+        return {
+            text,
+            is_minus,
+            IsStopWord(text)
+        };
+    }
+
+    // Query words are views into the raw query
+    // Words are sorted and unique unless the query was parsed without deduplication
+    struct Query {
+        vector<string_view> plus_words;
+        vector<string_view> minus_words;
+    };
+
+    struct QueryPostings {
+        vector<pair<const PostingList*, double>> plus_postings;
+        // Words of plus_postings
+        vector<string_view> plus_words;
+        vector<const PostingList*> minus_postings;
+
+        void clear() {
+            plus_postings.clear();
+            plus_words.clear();
+            minus_postings.clear();
+        }
+    };
+
+public:
+    // Scratch memory of a query: the parsed query, its posting lists, pruning state and the
+    // results. Buffers are cleared, not freed, between queries, so once a context has served
+    // a few queries a sequential query through it makes no heap allocations.
+    // A context must not be used by two queries at once.
+    class QueryContext {
+    private:
+        friend class SearchServer;
+
+        Query query;
+        QueryPostings query_postings;
+        // Dynamic pruning
+        vector<double> upper_bounds;
+        vector<size_t> term_order;
+        vector<double> bound_sums;
+        vector<PostingList::Cursor> cursors;
+        vector<PostingList::Cursor> minus_cursors;
+        vector<Posting> cursor_blocks;
+        vector<double> contributions;
+        // Min-heap of the top relevances found so far
+        vector<double> top_relevances;
+        // Parallel search
+        vector<vector<Document>> shard_documents;
+        vector<Document> documents;
+    };
+
+private:
+    // Serves the queries that are not given a context
+    static QueryContext& GetThreadQueryContext() {
+        static thread_local QueryContext context;
+        return context;
+    }
+
+    // A parallel caller that deduplicates its results skips the sort
+    Query ParseQuery(string_view text, bool deduplicate = true) const {
+        Query query;
+        ParseQuery(text, query, deduplicate);
+        return query;
+    }
+
+    void ParseQuery(string_view text, Query& query, bool deduplicate = true) const {
+        LOG_DURATION("parse"sv);
+        const ScopedLatency latency(metrics_.get(), SearchMetrics::Operation::PARSE_QUERY);
+        query.plus_words.clear();
+        query.minus_words.clear();
+        ForEachWord(text, [this, &query](string_view word) {
+            const QueryWord query_word = ParseQueryWord(word);
+            if (!query_word.is_stop) {
+                if (query_word.is_minus) {
+                    query.minus_words.push_back(query_word.data);
+                } else {
+                    query.plus_words.push_back(query_word.data);
+                }
+            }
+        });
+        if (deduplicate) {
+            for (vector<string_view>* words : {&query.plus_words, &query.minus_words}) {
+                sort(words->begin(), words->end());
+                words->erase(unique(words->begin(), words->end()), words->end());
+            }
+        }
+    }
+
+    template <typename DocumentPredicate>
+    vector<Document> FindTopDocuments(const Query& query, DocumentPredicate document_predicate, size_t top_count) const {
+        QueryContext& context = GetThreadQueryContext();
+        GetQueryPostings(query, context.query_postings);
+        FindTopDocuments(context, context.query_postings, document_predicate, top_count);
+        return context.documents;
+    }
+
+    // query_postings may belong to another server, so they are not taken from the context
+    template <typename DocumentPredicate>
+    vector<Document> FindTopDocuments(const QueryPostings& query_postings, DocumentPredicate document_predicate, size_t top_count) const {
+        QueryContext& context = GetThreadQueryContext();
+        FindTopDocuments(context, query_postings, document_predicate, top_count);
+        return context.documents;
+    }
+
+    // Leaves the results in context.documents. Documents outside status_documents, when it is
+    // given, are skipped with a bit test before they are scored.
+    template <typename DocumentPredicate>
+    void FindTopDocuments(QueryContext& context, const QueryPostings& query_postings, DocumentPredicate document_predicate,
+                          size_t top_count, const DocumentBitmap* status_documents = nullptr) const {
+        scoring_counters_->query_count.fetch_add(1, memory_order_relaxed);
+        vector<Document>& matched_documents = context.documents;
+        matched_documents.clear();
+        // The pruned path needs a non-empty top to take its threshold from
+        if (top_count == 0) {
+            return;
+        }
+        {
+            LOG_DURATION("retrieve"sv);
+            if (dynamic_pruning_ && query_postings.plus_postings.size() > 1 && top_count < document_ordinals_.size()) {
+                FindTopDocumentsPruned(context, query_postings, document_predicate, top_count, status_documents);
+            } else {
+                FindDocumentsInRange(query_postings, 0, static_cast<DocumentOrdinal>(ordinal_document_ids_.size()),
+                    document_predicate, status_documents, matched_documents);
+            }
+        }
+
+        {
+            LOG_DURATION("sort"sv);
+            SelectTopDocuments(matched_documents, top_count);
+        }
+        CountMetric(SearchMetrics::Counter::RESULTS_RETURNED, matched_documents.size());
+    }
+
+    // Scores context.query, filtering documents by the status bitmap alone
+    void FindParsedTopDocuments(QueryContext& context, DocumentStatus given_status, size_t top_count) const {
+        GetQueryPostings(context.query, context.query_postings);
+        FindTopDocuments(context, context.query_postings, [](int, DocumentStatus, int) { return true; },
+            top_count, &status_documents_[static_cast<size_t>(given_status)]);
+    }
+
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    vector<Document> FindTopDocumentsParallel(ExecutionPolicy&& policy, string_view raw_query, DocumentPredicate document_predicate,
+                                              size_t top_count, const DocumentBitmap* status_documents = nullptr) const {
+        const ScopedLatency latency(metrics_.get(), SearchMetrics::Operation::FIND_TOP_DOCUMENTS);
+        QueryContext& context = GetThreadQueryContext();
+        ParseQuery(raw_query, context.query);
+
+        scoring_counters_->query_count.fetch_add(1, memory_order_relaxed);
+        vector<Document>& matched_documents = context.documents;
+        {
+            LOG_DURATION("retrieve"sv);
+            FindAllDocuments(policy, context, document_predicate, status_documents);
+        }
+
+        {
+            LOG_DURATION("sort"sv);
+            SelectTopDocuments(matched_documents, top_count);
+        }
+        CountMetric(SearchMetrics::Counter::RESULTS_RETURNED, matched_documents.size());
+        return matched_documents;
+    }
+
+    void CountScoredDocuments(size_t document_count) const {
+        scoring_counters_->scored_document_count.fetch_add(document_count, memory_order_relaxed);
+        CountMetric(SearchMetrics::Counter::CANDIDATES_SCORED, document_count);
+    }
+
+    void CountScannedPostings(size_t posting_count) const {
+        CountMetric(SearchMetrics::Counter::POSTINGS_SCANNED, posting_count);
+    }
+
+    void CountMetric(SearchMetrics::Counter counter, uint64_t value) const {
+        if (metrics_) {
+            metrics_->Add(counter, value);
+        }
+    }
+
+    // Word order and repeated words don't change the key: "cat city" and "city  cat city" share it
+    static string GetQueryCacheKey(const Query& query, DocumentStatus status, size_t top_count) {
+        string key = to_string(static_cast<int>(status)) + ' ' + to_string(top_count);
+        for (const string_view word : query.plus_words) {
+            key += ' ';
+            key += word;
+        }
+        for (const string_view word : query.minus_words) {
+            key += " -"s;
+            key += word;
+        }
+        return key;
+    }
+
+    // Posting list must be non-empty. log() is called only when the document count or the
+    // document frequency of the word has changed since the previous query with this word.
+    double GetInverseDocumentFreq(const Term& term) const {
+        const uint64_t idf_key = (static_cast<uint64_t>(document_ordinals_.size()) << 32) | term.postings.size();
+        if (term.idf_key.load(memory_order_acquire) == idf_key) {
+            return term.inverse_document_freq.load(memory_order_relaxed);
+        }
+        const double inverse_document_freq = log(GetDocumentCount() * 1.0 / term.postings.size());
+        term.inverse_document_freq.store(inverse_document_freq, memory_order_relaxed);
+        term.idf_key.store(idf_key, memory_order_release);
+        return inverse_document_freq;
+    }
+
+    // Refreshes IDF of every word in one pass, so that the following queries don't compute it
+    void UpdateInverseDocumentFreqs() {
+        for_each(execution::par, terms_.begin(), terms_.end(), [this](const Term& term) {
+            if (!term.postings.empty()) {
+                GetInverseDocumentFreq(term);
+            }
+        });
+    }
+
+
+
+    // Dense scoring keeps a relevance and a state byte per document of the scored range.
+    // Buffers are zero between queries: collecting the candidates clears what was touched.
+    // Documents of minus words are marked excluded before scoring, and the kernels skip them
+    // together with documents outside the status bitmap.
+    static constexpr uint8_t SCORE_TOUCHED = 1;
+    static constexpr uint8_t SCORE_EXCLUDED = 2;
+
+    // Contribution of a plus word to the relevance of a document of a narrow query
+    struct ScoredPosting {
+        DocumentOrdinal document_ordinal;
+        double relevance;
+    };
+
+    struct ScoreBuffer {
+        // Dense scoring only, sized on the first broad query
+        vector<double> scores;
+        vector<uint8_t> states;
+        vector<pair<DocumentOrdinal, double>> candidates;
+        // Narrow scoring only: contributions in document order and the buffer they are merged in
+        vector<ScoredPosting> scored_postings;
+        vector<ScoredPosting> merged_postings;
+        // Documents of the minus words of a narrow query, sorted
+        vector<DocumentOrdinal> excluded_ordinals;
+    };
+
+    static ScoreBuffer& GetScoreBuffer() {
+        static thread_local ScoreBuffer buffer;
+        return buffer;
+    }
+
+    static bool IsScoreMasked(const uint8_t* states, size_t index, DocumentOrdinal ordinal, const DocumentBitmap* status_documents) {
+        return (states[index] & SCORE_EXCLUDED) != 0 || (status_documents != nullptr && !status_documents->Test(ordinal));
+    }
+
+    static void AccumulateScoresScalar(const Posting* first, const Posting* last, double inverse_document_freq,
+                                       DocumentOrdinal base, const DocumentBitmap* status_documents, double* scores, uint8_t* states) {
+        for (; first != last; ++first) {
+            const size_t index = first->document_ordinal - base;
+            if (IsScoreMasked(states, index, first->document_ordinal, status_documents)) {
+                continue;
+            }
+            scores[index] += first->term_freq * inverse_document_freq;
+            states[index] |= SCORE_TOUCHED;
+        }
+    }
+
+    // Candidates are documents touched by a plus word and not excluded by a minus word
+    static void CollectScoresScalar(double* scores, uint8_t* states, size_t size, DocumentOrdinal base,
+                                    vector<pair<DocumentOrdinal, double>>& candidates) {
+        for (size_t i = 0; i < size; ++i) {
+            if (states[i] == 0) {
+                continue;
+            }
+            if (states[i] == SCORE_TOUCHED) {
+                candidates.push_back({base + static_cast<DocumentOrdinal>(i), scores[i]});
+            }
+            scores[i] = 0.0;
+            states[i] = 0;
+        }
+    }
+
+#ifdef SEARCH_SERVER_HAS_X86_SIMD
+    // Multiplication and addition stay separate instead of FMA, so that relevances are
+    // bit-identical to the scalar kernel
+    __attribute__((target("sse2")))
+    static void AccumulateScoresSse2(const Posting* first, const Posting* last, double inverse_document_freq,
+                                     DocumentOrdinal base, const DocumentBitmap* status_documents, double* scores, uint8_t* states) {
+        const __m128d idf = _mm_set1_pd(inverse_document_freq);
+        for (; last - first >= 2; first += 2) {
+            // Postings of one word have distinct ordinals, so lanes never collide
+            const size_t i0 = first[0].document_ordinal - base;
+            const size_t i1 = first[1].document_ordinal - base;
+            const __m128d term_freqs = _mm_unpackhi_pd(_mm_loadu_pd(reinterpret_cast<const double*>(first)),
+                                                       _mm_loadu_pd(reinterpret_cast<const double*>(first + 1)));
+            const __m128d sums = _mm_add_pd(_mm_set_pd(scores[i1], scores[i0]), _mm_mul_pd(term_freqs, idf));
+            if (!IsScoreMasked(states, i0, first[0].document_ordinal, status_documents)) {
+                _mm_storel_pd(scores + i0, sums);
+                states[i0] |= SCORE_TOUCHED;
+            }
+            if (!IsScoreMasked(states, i1, first[1].document_ordinal, status_documents)) {
+                _mm_storeh_pd(scores + i1, sums);
+                states[i1] |= SCORE_TOUCHED;
+            }
+        }
+        AccumulateScoresScalar(first, last, inverse_document_freq, base, status_documents, scores, states);
+    }
+
+    __attribute__((target("sse2")))
+    static void CollectScoresSse2(double* scores, uint8_t* states, size_t size, DocumentOrdinal base,
+                                  vector<pair<DocumentOrdinal, double>>& candidates) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i touched = _mm_set1_epi8(SCORE_TOUCHED);
+        size_t i = 0;
+        for (; i + 16 <= size; i += 16) {
+            const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(states + i));
+            unsigned used = ~_mm_movemask_epi8(_mm_cmpeq_epi8(block, zero)) & 0xFFFFu;
+            if (used == 0) {
+                continue;
+            }
+            const unsigned matched = _mm_movemask_epi8(_mm_cmpeq_epi8(block, touched));
+            for (; used != 0; used &= used - 1) {
+                const int lane = __builtin_ctz(used);
+                if (matched & (1u << lane)) {
+                    candidates.push_back({base + static_cast<DocumentOrdinal>(i + lane), scores[i + lane]});
+                }
+                scores[i + lane] = 0.0;
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(states + i), zero);
+        }
+        CollectScoresScalar(scores + i, states + i, size - i, base + static_cast<DocumentOrdinal>(i), candidates);
+    }
+
+    __attribute__((target("avx2")))
+    static void AccumulateScoresAvx2(const Posting* first, const Posting* last, double inverse_document_freq,
+                                     DocumentOrdinal base, const DocumentBitmap* status_documents, double* scores, uint8_t* states) {
+        const __m256d idf = _mm256_set1_pd(inverse_document_freq);
+        const __m128i bases = _mm_set1_epi32(static_cast<int>(base));
+        // Picks the ordinal out of each 64-bit lane, skipping the padding after it
+        const __m256i ordinal_lanes = _mm256_setr_epi32(0, 4, 2, 6, 0, 4, 2, 6);
+        const __m256d all_lanes = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        for (; last - first >= 4; first += 4) {
+            // Lanes hold postings 0, 2 | 1, 3 after unpacking
+            const __m256d low = _mm256_loadu_pd(reinterpret_cast<const double*>(first));
+            const __m256d high = _mm256_loadu_pd(reinterpret_cast<const double*>(first + 2));
+            const __m256d term_freqs = _mm256_permute4x64_pd(_mm256_unpackhi_pd(low, high), _MM_SHUFFLE(3, 1, 2, 0));
+            const __m128i indexes = _mm_sub_epi32(_mm256_castsi256_si128(_mm256_permutevar8x32_epi32(
+                _mm256_castpd_si256(_mm256_unpacklo_pd(low, high)), ordinal_lanes)), bases);
+            const __m256d old_scores = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), scores, indexes, all_lanes, 8);
+            const __m256d sums = _mm256_add_pd(old_scores, _mm256_mul_pd(term_freqs, idf));
+            // AVX2 has no scatter
+            alignas(32) double lanes[4];
+            _mm256_store_pd(lanes, sums);
+            for (int lane = 0; lane < 4; ++lane) {
+                const size_t index = first[lane].document_ordinal - base;
+                if (IsScoreMasked(states, index, first[lane].document_ordinal, status_documents)) {
+                    continue;
+                }
+                scores[index] = lanes[lane];
+                states[index] |= SCORE_TOUCHED;
+            }
+        }
+        AccumulateScoresScalar(first, last, inverse_document_freq, base, status_documents, scores, states);
+    }
+
+    __attribute__((target("avx2")))
+    static void CollectScoresAvx2(double* scores, uint8_t* states, size_t size, DocumentOrdinal base,
+                                  vector<pair<DocumentOrdinal, double>>& candidates) {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i touched = _mm256_set1_epi8(SCORE_TOUCHED);
+        size_t i = 0;
+        for (; i + 32 <= size; i += 32) {
+            const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(states + i));
+            uint32_t used = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero)));
+            if (used == 0) {
+                continue;
+            }
+            const uint32_t matched = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, touched));
+            for (; used != 0; used &= used - 1) {
+                const int lane = __builtin_ctz(used);
+                if (matched & (1u << lane)) {
+                    candidates.push_back({base + static_cast<DocumentOrdinal>(i + lane), scores[i + lane]});
+                }
+                scores[i + lane] = 0.0;
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(states + i), zero);
+        }
+        CollectScoresScalar(scores + i, states + i, size - i, base + static_cast<DocumentOrdinal>(i), candidates);
+    }
+#endif
+
+    void AccumulateScores(const Posting* first, const Posting* last, double inverse_document_freq,
+                          DocumentOrdinal base, const DocumentBitmap* status_documents, double* scores, uint8_t* states) const {
+#ifdef SEARCH_SERVER_HAS_X86_SIMD
+        switch (scoring_kernel_) {
+        case ScoringKernel::AVX2:
+            return AccumulateScoresAvx2(first, last, inverse_document_freq, base, status_documents, scores, states);
+        case ScoringKernel::SSE2:
+            return AccumulateScoresSse2(first, last, inverse_document_freq, base, status_documents, scores, states);
+        default:
+            break;
+        }
+#endif
+        AccumulateScoresScalar(first, last, inverse_document_freq, base, status_documents, scores, states);
+    }
+
+    void CollectScores(double* scores, uint8_t* states, size_t size, DocumentOrdinal base,
+                       vector<pair<DocumentOrdinal, double>>& candidates) const {
+#ifdef SEARCH_SERVER_HAS_X86_SIMD
+        switch (scoring_kernel_) {
+        case ScoringKernel::AVX2:
+            return CollectScoresAvx2(scores, states, size, base, candidates);
+        case ScoringKernel::SSE2:
+            return CollectScoresSse2(scores, states, size, base, candidates);
+        default:
+            break;
+        }
+#endif
+        CollectScoresScalar(scores, states, size, base, candidates);
+    }
+
+    QueryPostings GetQueryPostings(const Query& query) const {
+        QueryPostings query_postings;
+        GetQueryPostings(query, query_postings);
+        return query_postings;
+    }
+
+    // Plus postings keep the order of query words and carry their IDF
+    void GetQueryPostings(const Query& query, QueryPostings& query_postings) const {
+        query_postings.clear();
+        for (const string_view word : query.plus_words) {
+            if (const Term* term = FindTerm(word)) {
+                query_postings.plus_postings.push_back({&term->postings, GetInverseDocumentFreq(*term)});
+                query_postings.plus_words.push_back(word);
+            }
+        }
+        for (const string_view word : query.minus_words) {
+            if (const PostingList* postings = FindPostings(word)) {
+                query_postings.minus_postings.push_back(postings);
+            }
+        }
+    }
+
+    // Appends documents with ordinals in [first_ordinal, last_ordinal) in ordinal order.
+    // Broad queries are scored into a dense buffer by the SIMD kernel. Narrow ones collect the
+    // contributions of their postings and sort them by document, so their scratch doesn't grow
+    // with the index. Both ways add relevance in the order of query words, so the results are
+    // bit-identical.
+    template <typename DocumentPredicate>
+    void FindDocumentsInRange(const QueryPostings& query_postings, DocumentOrdinal first_ordinal,
+                              DocumentOrdinal last_ordinal, DocumentPredicate document_predicate,
+                              const DocumentBitmap* status_documents, vector<Document>& matched_documents) const {
+        size_t posting_count = 0;
+        for (const auto& [postings, _] : query_postings.plus_postings) {
+            posting_count += postings->size();
+        }
+        ScoreBuffer& buffer = GetScoreBuffer();
+        // Postings of the range, for the metrics
+        size_t scanned_posting_count = 0;
+        if (posting_count * DENSE_SCORING_DOCUMENTS_PER_POSTING >= ordinal_document_ids_.size()) {
+            const size_t size = last_ordinal - first_ordinal;
+            if (buffer.scores.size() < size) {
+                buffer.scores.resize(size);
+                buffer.states.resize(size);
+            }
+            double* scores = buffer.scores.data();
+            uint8_t* states = buffer.states.data();
+            // Minus words are marked first, so that the kernels never score excluded documents
+            for (const PostingList* postings : query_postings.minus_postings) {
+                postings->ForEachBlock(first_ordinal, last_ordinal, [&](const Posting* begin, const Posting* end) {
+                    scanned_posting_count += end - begin;
+                    for (const Posting* it = begin; it != end; ++it) {
+                        states[it->document_ordinal - first_ordinal] |= SCORE_EXCLUDED;
+                    }
+                });
+            }
+            for (const auto& [postings, inverse_document_freq] : query_postings.plus_postings) {
+                postings->ForEachBlock(first_ordinal, last_ordinal, [&, idf = inverse_document_freq](const Posting* begin, const Posting* end) {
+                    AccumulateScores(begin, end, idf, first_ordinal, status_documents, scores, states);
+                    scanned_posting_count += end - begin;
+                });
+            }
+            buffer.candidates.clear();
+            CollectScores(scores, states, size, first_ordinal, buffer.candidates);
+            for (const auto& [ordinal, relevance] : buffer.candidates) {
+                if (document_predicate(ordinal_document_ids_[ordinal], ordinal_statuses_[ordinal], ordinal_ratings_[ordinal])) {
+                    matched_documents.push_back({ordinal_document_ids_[ordinal], relevance, ordinal_ratings_[ordinal]});
+                }
+            }
+            CountScannedPostings(scanned_posting_count);
+            CountScoredDocuments(buffer.candidates.size());
+            return;
+        }
+
+        // Minus words are applied first, so that excluded documents are never scored
+        vector<DocumentOrdinal>& excluded_ordinals = buffer.excluded_ordinals;
+        excluded_ordinals.clear();
+        for (const PostingList* postings : query_postings.minus_postings) {
+            postings->ForEachBlock(first_ordinal, last_ordinal, [&](const Posting* begin, const Posting* end) {
+                scanned_posting_count += end - begin;
+                for (const Posting* it = begin; it != end; ++it) {
+                    excluded_ordinals.push_back(it->document_ordinal);
+                }
+            });
+        }
+        sort(excluded_ordinals.begin(), excluded_ordinals.end());
+        vector<ScoredPosting>& scored_postings = buffer.scored_postings;
+        scored_postings.clear();
+        for (const auto& [postings, inverse_document_freq] : query_postings.plus_postings) {
+            const size_t word_begin = scored_postings.size();
+            postings->ForEachBlock(first_ordinal, last_ordinal, [&, idf = inverse_document_freq](const Posting* begin, const Posting* end) {
+                scanned_posting_count += end - begin;
+                for (const Posting* it = begin; it != end; ++it) {
+                    if ((status_documents != nullptr && !status_documents->Test(it->document_ordinal))
+                        || binary_search(excluded_ordinals.begin(), excluded_ordinals.end(), it->document_ordinal)) {
+                        continue;
+                    }
+                    scored_postings.push_back({it->document_ordinal, it->term_freq * idf});
+                }
+            });
+            // Postings of a word come in document order. Merging is stable, so contributions of
+            // a document stay in the order of query words.
+            if (word_begin != 0 && word_begin != scored_postings.size()) {
+                buffer.merged_postings.clear();
+                merge(scored_postings.begin(), scored_postings.begin() + word_begin, scored_postings.begin() + word_begin, scored_postings.end(),
+                      back_inserter(buffer.merged_postings), [](const ScoredPosting& lhs, const ScoredPosting& rhs) {
+                          return lhs.document_ordinal < rhs.document_ordinal;
+                      });
+                scored_postings.swap(buffer.merged_postings);
+            }
+        }
+        // Scores are summed before the predicate runs, so that a throwing predicate leaves nothing behind
+        vector<pair<DocumentOrdinal, double>>& candidates = buffer.candidates;
+        candidates.clear();
+        for (const ScoredPosting& scored_posting : scored_postings) {
+            if (candidates.empty() || candidates.back().first != scored_posting.document_ordinal) {
+                candidates.push_back({scored_posting.document_ordinal, 0.0});
+            }
+            candidates.back().second += scored_posting.relevance;
+        }
+        for (const auto& [ordinal, relevance] : candidates) {
+            if (document_predicate(ordinal_document_ids_[ordinal], ordinal_statuses_[ordinal], ordinal_ratings_[ordinal])) {
+                matched_documents.push_back({ordinal_document_ids_[ordinal], relevance, ordinal_ratings_[ordinal]});
+            }
+        }
+        CountScannedPostings(scanned_posting_count);
+        CountScoredDocuments(candidates.size());
+    }
+
+    // MaxScore dynamic pruning. A term contributes at most its largest term frequency times its
+    // IDF. Once top_count documents are found, a document whose terms can't reach the smallest
+    // of their relevances within RELEVANCE_EPSILON can't enter the top, so it is skipped.
+    // Terms too weak to lift a document there on their own are only probed for documents found
+    // by the other terms. Relevance is summed in the order of query words, as in exhaustive
+    // scoring, so the surviving documents have bit-identical relevance.
+    // Appends the surviving documents to context.documents. Documents outside status_documents
+    // are stepped over before any term is scored for them. Minus words are probed with cursors
+    // only for documents that can enter the top, which beats walking their whole lists here.
+    template <typename DocumentPredicate>
+    void FindTopDocumentsPruned(QueryContext& context, const QueryPostings& query_postings, DocumentPredicate document_predicate,
+                                size_t top_count, const DocumentBitmap* status_documents) const {
+        const size_t term_count = query_postings.plus_postings.size();
+        vector<double>& upper_bounds = context.upper_bounds;
+        upper_bounds.resize(term_count);
+        for (size_t i = 0; i < term_count; ++i) {
+            const auto& [postings, inverse_document_freq] = query_postings.plus_postings[i];
+            upper_bounds[i] = postings->GetMaxTermFreq() * inverse_document_freq;
+        }
+        // Terms ordered by upper bound; bound_sums[k] is the sum of the k weakest bounds
+        vector<size_t>& order = context.term_order;
+        order.resize(term_count);
+        iota(order.begin(), order.end(), 0);
+        sort(order.begin(), order.end(), [&upper_bounds](size_t lhs, size_t rhs) { return upper_bounds[lhs] < upper_bounds[rhs]; });
+        vector<double>& bound_sums = context.bound_sums;
+        bound_sums.assign(term_count + 1, 0.0);
+        // Every cursor gets its own block to decode a compressed list into
+        context.cursor_blocks.resize((term_count + query_postings.minus_postings.size()) * POSTING_BLOCK_SIZE);
+        Posting* cursor_block = context.cursor_blocks.data();
+        vector<PostingList::Cursor>& cursors = context.cursors;
+        cursors.clear();
+        for (size_t k = 0; k < term_count; ++k, cursor_block += POSTING_BLOCK_SIZE) {
+            bound_sums[k + 1] = bound_sums[k] + upper_bounds[order[k]];
+            cursors.emplace_back(*query_postings.plus_postings[order[k]].first, cursor_block);
+        }
+        vector<PostingList::Cursor>& minus_cursors = context.minus_cursors;
+        minus_cursors.clear();
+        for (const PostingList* postings : query_postings.minus_postings) {
+            minus_cursors.emplace_back(*postings, cursor_block);
+            cursor_block += POSTING_BLOCK_SIZE;
+        }
+
+        vector<double>& top_relevances = context.top_relevances;
+        top_relevances.clear();
+        double threshold = -numeric_limits<double>::infinity();
+        // Terms before first_essential can't reach the threshold together
+        size_t first_essential = 0;
+        vector<double>& contributions = context.contributions;
+        contributions.resize(term_count);
+        vector<Document>& matched_documents = context.documents;
+        // Postings read and probed and documents that passed pruning and minus words, for the metrics
+        size_t scanned_posting_count = 0;
+        size_t scored_document_count = 0;
+        while (first_essential < term_count) {
+            DocumentOrdinal ordinal = numeric_limits<DocumentOrdinal>::max();
+            for (size_t k = first_essential; k < term_count; ++k) {
+                if (!cursors[k].IsEnd()) {
+                    ordinal = min(ordinal, cursors[k]->document_ordinal);
+                }
+            }
+            if (ordinal == numeric_limits<DocumentOrdinal>::max()) {
+                break;
+            }
+            if (status_documents != nullptr && !status_documents->Test(ordinal)) {
+                for (size_t k = first_essential; k < term_count; ++k) {
+                    if (!cursors[k].IsEnd() && cursors[k]->document_ordinal == ordinal) {
+                        cursors[k].Next();
+                        ++scanned_posting_count;
+                    }
+                }
+                continue;
+            }
+
+            fill(contributions.begin(), contributions.end(), 0.0);
+            double partial_relevance = 0.0;
+            for (size_t k = first_essential; k < term_count; ++k) {
+                if (!cursors[k].IsEnd() && cursors[k]->document_ordinal == ordinal) {
+                    const size_t word_index = order[k];
+                    contributions[word_index] = cursors[k]->term_freq * query_postings.plus_postings[word_index].second;
+                    partial_relevance += contributions[word_index];
+                    cursors[k].Next();
+                    ++scanned_posting_count;
+                }
+            }
+            bool is_pruned = false;
+            for (size_t k = first_essential; k-- > 0;) {
+                if (partial_relevance + bound_sums[k + 1] < threshold - RELEVANCE_EPSILON) {
+                    is_pruned = true;
+                    break;
+                }
+                cursors[k].SeekTo(ordinal);
+                ++scanned_posting_count;
+                if (!cursors[k].IsEnd() && cursors[k]->document_ordinal == ordinal) {
+                    const size_t word_index = order[k];
+                    contributions[word_index] = cursors[k]->term_freq * query_postings.plus_postings[word_index].second;
+                    partial_relevance += contributions[word_index];
+                }
+            }
+            if (is_pruned || partial_relevance < threshold - RELEVANCE_EPSILON) {
+                continue;
+            }
+            const bool is_excluded = any_of(minus_cursors.begin(), minus_cursors.end(), [&](PostingList::Cursor& cursor) {
+                cursor.SeekTo(ordinal);
+                ++scanned_posting_count;
+                return !cursor.IsEnd() && cursor->document_ordinal == ordinal;
+            });
+            if (is_excluded) {
+                continue;
+            }
+            ++scored_document_count;
+            if (!document_predicate(ordinal_document_ids_[ordinal], ordinal_statuses_[ordinal], ordinal_ratings_[ordinal])) {
+                continue;
+            }
+
+            double relevance = 0.0;
+            for (const double contribution : contributions) {
+                relevance += contribution;
+            }
+            matched_documents.push_back({ordinal_document_ids_[ordinal], relevance, ordinal_ratings_[ordinal]});
+            top_relevances.push_back(relevance);
+            push_heap(top_relevances.begin(), top_relevances.end(), greater<double>());
+            if (top_relevances.size() > top_count) {
+                pop_heap(top_relevances.begin(), top_relevances.end(), greater<double>());
+                top_relevances.pop_back();
+            }
+            if (top_relevances.size() == top_count && top_relevances.front() > threshold) {
+                threshold = top_relevances.front();
+                while (first_essential < term_count && bound_sums[first_essential + 1] < threshold - RELEVANCE_EPSILON) {
+                    ++first_essential;
+                }
+            }
+        }
+        CountScannedPostings(scanned_posting_count);
+        CountScoredDocuments(scored_document_count);
+    }
+
+    // Splits the document ordinal range into shards, each owned by one task. A task walks every
+    // query word in the same order as the sequential version, so relevances are bit-identical
+    // and shards need no locking. Shards are concatenated in ordinal order into context.documents.
+    template <typename ExecutionPolicy, typename DocumentPredicate>
+    void FindAllDocuments(ExecutionPolicy&& policy, QueryContext& context, DocumentPredicate document_predicate,
+                          const DocumentBitmap* status_documents) const {
+        context.documents.clear();
+        if (document_ordinals_.empty()) {
+            return;
+        }
+        GetQueryPostings(context.query, context.query_postings);
+        const int64_t ordinal_span = ordinal_document_ids_.size();
+        const int shard_count = static_cast<int>(min<int64_t>(ordinal_span, PARALLEL_SHARD_COUNT));
+        vector<vector<Document>>& shard_documents = context.shard_documents;
+        shard_documents.resize(shard_count);
+
+        for_each(policy, shard_documents.begin(), shard_documents.end(), [&](vector<Document>& documents) {
+            const int shard = static_cast<int>(&documents - shard_documents.data());
+            const auto first_ordinal = static_cast<DocumentOrdinal>(ordinal_span * shard / shard_count);
+            const auto last_ordinal = static_cast<DocumentOrdinal>(ordinal_span * (shard + 1) / shard_count);
+            documents.clear();
+            FindDocumentsInRange(context.query_postings, first_ordinal, last_ordinal, document_predicate, status_documents, documents);
+        });
+
+        for (const vector<Document>& documents : shard_documents) {
+            context.documents.insert(context.documents.end(), documents.begin(), documents.end());
+        }
+    }
+};
+
+// Publishes immutable objects to readers that never block. A reader announces the epoch it
+// started in before loading the pointer; a replaced object is deleted once no reader that
+// could have loaded it is still active, by the writer or by the last such reader to unpin.
+// Writers must be serialized by the caller.
+template <typename T>
+class EpochPointer {
+public:
+    static constexpr size_t READER_SLOT_COUNT = 128;
+
+    // Keeps the object current at the moment of pinning alive until destroyed
+    class Guard {
+    public:
+        Guard(Guard&& other) noexcept
+            : owner_(other.owner_)
+            , slot_(exchange(other.slot_, nullptr))
+            , object_(other.object_) {
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+        Guard& operator=(Guard&&) = delete;
+
+        ~Guard() {
+            if (slot_ != nullptr) {
+                owner_->Unpin(*slot_);
+            }
+        }
+
+        const T* get() const {
+            return object_;
+        }
+
+        const T* operator->() const {
+            return object_;
+        }
+
+        const T& operator*() const {
+            return *object_;
+        }
+
+    private:
+        friend class EpochPointer;
+
+        Guard(const EpochPointer* owner, atomic<uint64_t>* slot, const T* object)
+            : owner_(owner)
+            , slot_(slot)
+            , object_(object) {
+        }
+
+        const EpochPointer* owner_;
+        atomic<uint64_t>* slot_;
+        const T* object_;
+    };
+
+    explicit EpochPointer(unique_ptr<const T> object)
+        : current_(object.release()) {
+    }
+
+    EpochPointer(const EpochPointer&) = delete;
+    EpochPointer& operator=(const EpochPointer&) = delete;
+
+    ~EpochPointer() {
+        delete current_.load();
+        for (const auto& [object, epoch] : retired_) {
+            delete object;
+        }
+        for (SlotTable* table = slots_.next.load(); table != nullptr;) {
+            delete exchange(table, table->next.load());
+        }
+    }
+
+    // Never waits. A reader claims a free slot, starting from its own one; when every slot is
+    // taken, it moves on to the next table of slots, adding one if there is none yet.
+    Guard Pin() const {
+        static atomic<size_t> next_thread_index{0};
+        thread_local const size_t thread_index = next_thread_index++;
+        const uint64_t epoch = epoch_.load();
+        for (SlotTable* table = &slots_;; table = GetNextTable(*table)) {
+            for (size_t i = 0; i < READER_SLOT_COUNT; ++i) {
+                atomic<uint64_t>& slot = table->slots[(thread_index + i) % READER_SLOT_COUNT].epoch;
+                uint64_t free_slot = 0;
+                if (slot.compare_exchange_strong(free_slot, epoch)) {
+                    return Guard(this, &slot, current_.load());
+                }
+            }
+        }
+    }
+
+    // For the writer, who is the only one to replace the object
+    const T& GetCurrent() const {
+        return *current_.load();
+    }
+
+    // The previous object is deleted when the last reader that may see it unpins
+    void Publish(unique_ptr<const T> object) {
+        const T* previous = current_.exchange(object.release());
+        {
+            lock_guard guard(retired_mutex_);
+            const uint64_t epoch = epoch_.fetch_add(1);
+            retired_.push_back({previous, epoch});
+            newest_retired_epoch_.store(epoch);
+        }
+        Reclaim();
+    }
+
+    // Deletes retired objects no reader can see any more, returns how many are still kept.
+    // Safe to call from any thread.
+    size_t Reclaim() {
+        size_t retired_count = 0;
+        {
+            lock_guard guard(retired_mutex_);
+            is_reclaim_requested_.store(false);
+            retired_count = ReclaimRetired();
+        }
+        ReclaimRequested();
+        return retired_count;
+    }
+
+private:
+    struct alignas(64) ReaderSlot {
+        atomic<uint64_t> epoch{0};
+    };
+
+    struct SlotTable {
+        array<ReaderSlot, READER_SLOT_COUNT> slots;
+        atomic<SlotTable*> next{nullptr};
+    };
+
+    // Epochs start from 1, a zero slot is free
+    atomic<uint64_t> epoch_{1};
+    atomic<const T*> current_;
+    // Tables are added by readers and kept until destruction
+    mutable SlotTable slots_;
+    // Objects with the epoch they were replaced in
+    mutable mutex retired_mutex_;
+    mutable vector<pair<const T*, uint64_t>> retired_;
+    // Readers that pinned later than this epoch can't hold a retired object
+    mutable atomic<uint64_t> newest_retired_epoch_{0};
+    mutable atomic<bool> is_reclaim_requested_{false};
+
+    static SlotTable* GetNextTable(SlotTable& table) {
+        SlotTable* next = table.next.load();
+        if (next == nullptr) {
+            auto added = make_unique<SlotTable>();
+            if (table.next.compare_exchange_strong(next, added.get())) {
+                next = added.release();
+            }
+        }
+        return next;
+    }
+
+    // Only a reader that pinned before the latest replacement may have kept a retired object alive
+    void Unpin(atomic<uint64_t>& slot) const {
+        if (slot.exchange(0) <= newest_retired_epoch_.load()) {
+            is_reclaim_requested_.store(true);
+            ReclaimRequested();
+        }
+    }
+
+    // Readers never wait for the lock: a reader that can't take it leaves its request to the
+    // thread holding the lock, which checks for requests after releasing it
+    void ReclaimRequested() const {
+        while (is_reclaim_requested_.load()) {
+            unique_lock lock(retired_mutex_, try_to_lock);
+            if (!lock.owns_lock()) {
+                return;
+            }
+            is_reclaim_requested_.store(false);
+            ReclaimRetired();
+        }
+    }
+
+    size_t ReclaimRetired() const {
+        uint64_t oldest_epoch = numeric_limits<uint64_t>::max();
+        for (const SlotTable* table = &slots_; table != nullptr; table = table->next.load()) {
+            for (const ReaderSlot& slot : table->slots) {
+                const uint64_t epoch = slot.epoch.load();
+                if (epoch != 0) {
+                    oldest_epoch = min(oldest_epoch, epoch);
+                }
+            }
+        }
+        const auto is_unreachable = [oldest_epoch](const pair<const T*, uint64_t>& retired) {
+            return retired.second < oldest_epoch;
+        };
+        for (const auto& retired : retired_) {
+            if (is_unreachable(retired)) {
+                delete retired.first;
+            }
+        }
+        retired_.erase(remove_if(retired_.begin(), retired_.end(), is_unreachable), retired_.end());
+        return retired_.size();
+    }
+};
+
+// Search server that answers queries while documents are added and removed, LSM style.
+// Added documents are indexed into a small pending segment that readers don't see; Publish(),
+// or the segment reaching CONCURRENT_SEGMENT_SIZE documents, seals it into an immutable
+// compressed segment and atomically replaces the list of segments. Queries pin the current
+// list and never wait for writers. A background thread merges SEGMENT_MERGE_FACTOR segments
+// of the same size tier into one. Removed documents of sealed segments are kept as tombstones
+// until their segment is merged. Relevance is computed with document frequencies of all live
+// documents, so it is the same as in one SearchServer.
+class ConcurrentSearchServer {
+public:
+    explicit ConcurrentSearchServer(string_view stop_words_text = {})
+        : stop_words_text_(stop_words_text)
+        , snapshot_(make_unique<const Snapshot>()) {
+        ResetPendingSegment();
+        merge_thread_ = thread([this] {
+            MergeSegmentsInBackground();
+        });
+    }
+
+    ConcurrentSearchServer(const ConcurrentSearchServer&) = delete;
+    ConcurrentSearchServer& operator=(const ConcurrentSearchServer&) = delete;
+
+    ~ConcurrentSearchServer() {
+        {
+            lock_guard guard(merge_mutex_);
+            is_stopping_ = true;
+        }
+        merge_condition_.notify_all();
+        merge_thread_.join();
+    }
+
+    // A document id may be added once until removed; writers are serialized, readers are not blocked
+    void AddDocument(int document_id, string_view document, DocumentStatus status, const vector<int>& ratings) {
+        lock_guard guard(writer_mutex_);
+        if (document_ids_.count(document_id) > 0) {
+            throw invalid_argument("Document id "s + to_string(document_id) + " is already added"s);
+        }
+        pending_segment_->AddDocument(document_id, document, status, ratings);
+        document_ids_.insert(document_id);
+        if (static_cast<size_t>(pending_segment_->GetDocumentCount()) >= CONCURRENT_SEGMENT_SIZE) {
+            PublishPendingSegment();
+        }
+    }
+
+    // A published document is hidden by a tombstone at once and dropped by the next merge of its segment
+    void RemoveDocument(int document_id) {
+        lock_guard guard(writer_mutex_);
+        if (document_ids_.erase(document_id) == 0) {
+            return;
+        }
+        if (pending_segment_->document_ordinals_.count(document_id) > 0) {
+            pending_segment_->RemoveDocument(document_id);
+            return;
+        }
+        auto snapshot = make_unique<Snapshot>(snapshot_.GetCurrent());
+        for (Segment& segment : snapshot->segments) {
+            if (segment.index->document_ordinals_.count(document_id) > 0 && segment.tombstones->document_ids.count(document_id) == 0) {
+                auto tombstones = make_shared<Tombstones>(*segment.tombstones);
+                AddTombstone(*segment.index, document_id, *tombstones);
+                segment.tombstones = move(tombstones);
+                --snapshot->document_count;
+                break;
+            }
+        }
+        snapshot_.Publish(move(snapshot));
+    }
+
+    // Makes all added documents visible to queries
+    void Publish() {
+        lock_guard guard(writer_mutex_);
+        PublishPendingSegment();
+    }
+
+    // Returns once no segments are waiting to be merged. Frees the replaced segment lists no
+    // reader holds any more.
+    void WaitForMerges() {
+        {
+            unique_lock lock(merge_mutex_);
+            merge_condition_.wait(lock, [this] {
+                return !is_merge_requested_ && !is_merging_;
+            });
+        }
+        snapshot_.Reclaim();
+    }
+
+    // Counts published live documents only
+    int GetDocumentCount() const {
+        const auto snapshot = snapshot_.Pin();
+        return static_cast<int>(snapshot->document_count);
+    }
+
+    size_t GetSegmentCount() const {
+        const auto snapshot = snapshot_.Pin();
+        return snapshot->segments.size();
+    }
+
+    template <typename DocumentPredicate>
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentPredicate document_predicate,
+                                      size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        const auto snapshot = snapshot_.Pin();
+        if (snapshot->segments.empty()) {
+            return {};
+        }
+        const SearchServer::Query query = snapshot->segments.front().index->ParseQuery(raw_query);
+        map<string_view, size_t> document_freqs;
+        for (const string_view word : query.plus_words) {
+            for (const Segment& segment : snapshot->segments) {
+                if (const SearchServer::PostingList* postings = segment.index->FindPostings(word)) {
+                    const auto removed_it = segment.tombstones->document_freqs.find(word);
+                    document_freqs[word] += postings->size()
+                        - (removed_it == segment.tombstones->document_freqs.end() ? 0 : removed_it->second);
+                }
+            }
+        }
+
+        vector<Document> matched_documents;
+        for (const Segment& segment : snapshot->segments) {
+            SearchServer::QueryPostings query_postings = segment.index->GetQueryPostings(query);
+            for (size_t i = 0; i < query_postings.plus_words.size(); ++i) {
+                query_postings.plus_postings[i].second
+                    = log(snapshot->document_count * 1.0 / document_freqs.at(query_postings.plus_words[i]));
+            }
+            const set<int>& removed_ids = segment.tombstones->document_ids;
+            const vector<Document> segment_documents = removed_ids.empty()
+                ? segment.index->FindTopDocuments(query_postings, document_predicate, top_count)
+                : segment.index->FindTopDocuments(query_postings, [&](int document_id, DocumentStatus status, int rating) {
+                      return removed_ids.count(document_id) == 0 && document_predicate(document_id, status, rating);
+                  }, top_count);
+            matched_documents.insert(matched_documents.end(), segment_documents.begin(), segment_documents.end());
+        }
+        SelectTopDocuments(matched_documents, top_count);
+        return matched_documents;
+    }
+
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentStatus given_status = DocumentStatus::ACTUAL,
+                                      size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        return FindTopDocuments(raw_query, [given_status](int, DocumentStatus status, int) { return status == given_status; }, top_count);
+    }
+
+    // Words are copied, since a merge may destroy the segment they come from.
+    // Throws out_of_range for a document that is not published.
+    tuple<vector<string>, DocumentStatus> MatchDocument(string_view raw_query, int document_id) const {
+        const auto snapshot = snapshot_.Pin();
+        for (const Segment& segment : snapshot->segments) {
+            if (segment.index->document_ordinals_.count(document_id) > 0 && segment.tombstones->document_ids.count(document_id) == 0) {
+                const auto [matched_words, status] = segment.index->MatchDocument(raw_query, document_id);
+                return {vector<string>(matched_words.begin(), matched_words.end()), status};
+            }
+        }
+        throw out_of_range("Document id "s + to_string(document_id) + " is not published"s);
+    }
+
+private:
+    struct Tombstones {
+        set<int> document_ids;
+        // Postings of removed documents per word, subtracted from document frequencies
+        map<string, size_t, less<>> document_freqs;
+    };
+
+    struct Segment {
+        shared_ptr<const SearchServer> index;
+        shared_ptr<const Tombstones> tombstones;
+    };
+
+    struct Snapshot {
+        vector<Segment> segments;
+        size_t document_count = 0;
+    };
+
+    static void AddTombstone(const SearchServer& index, int document_id, Tombstones& tombstones) {
+        tombstones.document_ids.insert(document_id);
+        for (const auto& [word, _] : index.GetWordFrequencies(document_id)) {
+            ++tombstones.document_freqs[string(word)];
+        }
+    }
+
+    // Segments below CONCURRENT_SEGMENT_SIZE * SEGMENT_MERGE_FACTOR documents are tier 0, and so on
+    static int GetSizeTier(const SearchServer& index) {
+        int tier = 0;
+        for (size_t size = CONCURRENT_SEGMENT_SIZE * SEGMENT_MERGE_FACTOR;
+             static_cast<size_t>(index.GetDocumentCount()) >= size; size *= SEGMENT_MERGE_FACTOR) {
+            ++tier;
+        }
+        return tier;
+    }
+
+    void ResetPendingSegment() {
+        pending_segment_ = make_unique<SearchServer>();
+        pending_segment_->SetStopWords(stop_words_text_);
+    }
+
+    void PublishPendingSegment() {
+        if (pending_segment_->GetDocumentCount() == 0) {
+            return;
+        }
+        pending_segment_->CompressPostings();
+        auto snapshot = make_unique<Snapshot>(snapshot_.GetCurrent());
+        snapshot->document_count += pending_segment_->GetDocumentCount();
+        snapshot->segments.push_back({move(pending_segment_), make_shared<const Tombstones>()});
+        snapshot_.Publish(move(snapshot));
+        ResetPendingSegment();
+        {
+            lock_guard guard(merge_mutex_);
+            is_merge_requested_ = true;
+        }
+        merge_condition_.notify_all();
+    }
+
+    // The oldest SEGMENT_MERGE_FACTOR segments of the lowest tier that has that many
+    vector<Segment> SelectSegmentsToMerge() const {
+        map<int, vector<Segment>> tiers;
+        for (const Segment& segment : snapshot_.GetCurrent().segments) {
+            vector<Segment>& tier = tiers[GetSizeTier(*segment.index)];
+            tier.push_back(segment);
+            if (tier.size() == SEGMENT_MERGE_FACTOR) {
+                return tier;
+            }
+        }
+        return {};
+    }
+
+    // Live documents of the segments in their order, with postings compressed
+    unique_ptr<SearchServer> BuildMergedSegment(const vector<Segment>& segments) const {
+        auto merged = make_unique<SearchServer>();
+        merged->SetStopWords(stop_words_text_);
+        for (const Segment& segment : segments) {
+            const SearchServer& index = *segment.index;
+            for (SearchServer::DocumentOrdinal ordinal = 0; ordinal < index.ordinal_document_ids_.size(); ++ordinal) {
+                const int document_id = index.ordinal_document_ids_[ordinal];
+                const auto id_it = index.document_ordinals_.find(document_id);
+                if (id_it == index.document_ordinals_.end() || id_it->second != ordinal
+                    || segment.tombstones->document_ids.count(document_id) > 0) {
+                    continue;
+                }
+                merged->AddIndexedDocument(document_id, index.ordinal_statuses_[ordinal], index.ordinal_ratings_[ordinal],
+                                           index.ordinal_word_freqs_[ordinal]);
+            }
+        }
+        merged->CompressPostings();
+        return merged;
+    }
+
+    // The merge is built without the writer lock; tombstones added to the merged segments
+    // meanwhile are carried over to the result
+    bool MergeOnce() {
+        vector<Segment> segments;
+        {
+            lock_guard guard(writer_mutex_);
+            segments = SelectSegmentsToMerge();
+        }
+        if (segments.empty()) {
+            return false;
+        }
+        shared_ptr<const SearchServer> merged = BuildMergedSegment(segments);
+
+        lock_guard guard(writer_mutex_);
+        auto snapshot = make_unique<Snapshot>();
+        auto tombstones = make_shared<Tombstones>();
+        snapshot->document_count = snapshot_.GetCurrent().document_count;
+        for (const Segment& segment : snapshot_.GetCurrent().segments) {
+            const auto merged_it = find_if(segments.begin(), segments.end(),
+                [&segment](const Segment& merged_segment) { return merged_segment.index == segment.index; });
+            if (merged_it == segments.end()) {
+                snapshot->segments.push_back(segment);
+                continue;
+            }
+            for (const int document_id : segment.tombstones->document_ids) {
+                if (merged_it->tombstones->document_ids.count(document_id) == 0) {
+                    AddTombstone(*merged, document_id, *tombstones);
+                }
+            }
+            if (merged_it == segments.begin()) {
+                // Keeps the merged documents at the place of the oldest merged segment
+                snapshot->segments.push_back({merged, tombstones});
+            }
+        }
+        snapshot_.Publish(move(snapshot));
+        return true;
+    }
+
+    void MergeSegmentsInBackground() {
+        unique_lock lock(merge_mutex_);
+        while (true) {
+            merge_condition_.wait(lock, [this] {
+                return is_stopping_ || is_merge_requested_;
+            });
+            if (is_stopping_) {
+                return;
+            }
+            is_merge_requested_ = false;
+            is_merging_ = true;
+            lock.unlock();
+            while (MergeOnce()) {
+            }
+            lock.lock();
+            is_merging_ = false;
+            merge_condition_.notify_all();
+        }
+    }
+
+    const string stop_words_text_;
+    EpochPointer<Snapshot> snapshot_;
+    // Serializes changes of the segment list
+    mutex writer_mutex_;
+    unique_ptr<SearchServer> pending_segment_;
+    set<int> document_ids_;
+
+    mutex merge_mutex_;
+    condition_variable merge_condition_;
+    bool is_merge_requested_ = false;
+    bool is_merging_ = false;
+    bool is_stopping_ = false;
+    // Started last and joined first, it uses all the members above
+    thread merge_thread_;
+};
+
+#ifdef SEARCH_SERVER_HAS_SOCKETS
+
+// Documents are split by id over shard processes, each with its own SearchServer, which talk to
+// the coordinator over Unix domain sockets. A query first gathers document frequencies of its words
+// from every shard, so that shards score with IDF of the whole index, then scatters the search and
+// merges the top documents of the shards. Not thread-safe, like SearchServer.
+// A shard that fails leaves the others out of step, so the server then stops all shards and every
+// later call throws runtime_error.
+// Shards are forked by the constructor, and a forked process gets only the forking thread: locks
+// held by other threads at that moment are never released in a shard. So the server must be built
+// before the process starts any threads, including the TBB pool behind execution::par.
+class ShardedSearchServer {
+public:
+    // Time from sending a request to a shard to receiving its response
+    struct ShardLatency {
+        uint64_t request_count = 0;
+        double total_seconds = 0.0;
+        double max_seconds = 0.0;
+    };
+
+    // Must run while the process has no other threads
+    explicit ShardedSearchServer(size_t shard_count, string_view stop_words_text = {}) {
+        if (shard_count == 0) {
+            throw invalid_argument("Sharded server needs at least one shard"s);
+        }
+        try {
+            for (size_t i = 0; i < shard_count; ++i) {
+                StartShard(stop_words_text);
+            }
+        } catch (...) {
+            StopShards();
+            throw;
+        }
+        shard_latencies_.resize(shard_count);
+    }
+
+    ShardedSearchServer(const ShardedSearchServer&) = delete;
+    ShardedSearchServer& operator=(const ShardedSearchServer&) = delete;
+
+    ~ShardedSearchServer() {
+        StopShards();
+    }
+
+    void AddDocument(int document_id, string_view document, DocumentStatus status, const vector<int>& ratings) {
+        MessageWriter request(RequestType::ADD_DOCUMENT);
+        request.Write<int32_t>(document_id);
+        request.Write<uint8_t>(static_cast<uint8_t>(status));
+        request.Write<uint32_t>(static_cast<uint32_t>(ratings.size()));
+        for (const int rating : ratings) {
+            request.Write<int32_t>(rating);
+        }
+        request.WriteString(document);
+        Call(GetShardIndex(document_id), request.GetMessage());
+    }
+
+    void RemoveDocument(int document_id) {
+        MessageWriter request(RequestType::REMOVE_DOCUMENT);
+        request.Write<int32_t>(document_id);
+        Call(GetShardIndex(document_id), request.GetMessage());
+    }
+
+    int GetDocumentCount() const {
+        return static_cast<int>(GatherDocumentFreqs({}).first);
+    }
+
+    size_t GetShardCount() const {
+        return shards_.size();
+    }
+
+    vector<Document> FindTopDocuments(string_view raw_query, DocumentStatus status = DocumentStatus::ACTUAL,
+                                      size_t top_count = MAX_RESULT_DOCUMENT_COUNT) const {
+        const auto [document_count, document_freqs] = GatherDocumentFreqs(raw_query);
+
+        MessageWriter request(RequestType::FIND_TOP_DOCUMENTS);
+        request.WriteString(raw_query);
+        request.Write<uint8_t>(static_cast<uint8_t>(status));
+        request.Write<uint64_t>(top_count);
+        request.Write<uint64_t>(document_count);
+        request.Write<uint32_t>(static_cast<uint32_t>(document_freqs.size()));
+        for (const uint64_t document_freq : document_freqs) {
+            request.Write<uint64_t>(document_freq);
+        }
+
+        vector<Document> matched_documents;
+        for (const string& response : Broadcast(request.GetMessage())) {
+            MessageReader reader(response);
+            const uint32_t shard_document_count = reader.Read<uint32_t>();
+            for (uint32_t i = 0; i < shard_document_count; ++i) {
+                Document document;
+                document.id = reader.Read<int32_t>();
+                document.relevance = reader.Read<double>();
+                document.rating = reader.Read<int32_t>();
+                matched_documents.push_back(document);
+            }
+        }
+        SelectTopDocuments(matched_documents, top_count);
+        return matched_documents;
+    }
+
+    // Words are copied out of the shard. Throws out_of_range for an unknown document.
+    tuple<vector<string>, DocumentStatus> MatchDocument(string_view raw_query, int document_id) const {
+        MessageWriter request(RequestType::MATCH_DOCUMENT);
+        request.WriteString(raw_query);
+        request.Write<int32_t>(document_id);
+        const string response = Call(GetShardIndex(document_id), request.GetMessage());
+
+        MessageReader reader(response);
+        vector<string> matched_words(reader.Read<uint32_t>());
+        for (string& word : matched_words) {
+            word = string(reader.ReadString());
+        }
+        return {matched_words, static_cast<DocumentStatus>(reader.Read<uint8_t>())};
+    }
+
+    // Every shard takes part in every query, so the slowest shard sets the query latency
+    const vector<ShardLatency>& GetShardLatencies() const {
+        return shard_latencies_;
+    }
+
+    // In shard order, for monitoring the shard processes
+    vector<pid_t> GetShardProcessIds() const {
+        vector<pid_t> process_ids;
+        for (const Shard& shard : shards_) {
+            process_ids.push_back(shard.process_id);
+        }
+        return process_ids;
+    }
+
+private:
+    enum class RequestType : uint8_t {
+        ADD_DOCUMENT,
+        REMOVE_DOCUMENT,
+        GET_DOCUMENT_FREQS,
+        FIND_TOP_DOCUMENTS,
+        MATCH_DOCUMENT,
+    };
+
+    // The first byte of a response; exceptions of a shard are rethrown by the coordinator
+    enum class ResponseStatus : uint8_t {
+        OK,
+        INVALID_ARGUMENT,
+        OUT_OF_RANGE,
+        ERROR,
+    };
+
+    // Values are written in the byte order of the machine, as both ends run on it
+    class MessageWriter {
+    public:
+        template <typename Type>
+        explicit MessageWriter(Type type) {
+            Write(type);
+        }
+
+        template <typename Value>
+        void Write(const Value& value) {
+            static_assert(is_trivially_copyable_v<Value>);
+            message_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        void WriteString(string_view text) {
+            Write<uint32_t>(static_cast<uint32_t>(text.size()));
+            message_.append(text);
+        }
+
+        const string& GetMessage() const {
+            return message_;
+        }
+
+    private:
+        string message_;
+    };
+
+    class MessageReader {
+    public:
+        explicit MessageReader(string_view message)
+            : message_(message) {
+        }
+
+        template <typename Value>
+        Value Read() {
+            static_assert(is_trivially_copyable_v<Value>);
+            Value value;
+            memcpy(&value, Take(sizeof(value)), sizeof(value));
+            return value;
+        }
+
+        // Views into the message
+        string_view ReadString() {
+            const uint32_t size = Read<uint32_t>();
+            return {Take(size), size};
+        }
+
+    private:
+        string_view message_;
+
+        const char* Take(size_t size) {
+            if (size > message_.size()) {
+                throw runtime_error("Shard message is truncated"s);
+            }
+            const char* data = message_.data();
+            message_.remove_prefix(size);
+            return data;
+        }
+    };
+
+    struct Shard {
+        pid_t process_id;
+        int socket;
+    };
+
+    vector<Shard> shards_;
+    mutable vector<ShardLatency> shard_latencies_;
+    // Set once a shard fails to take a request or to respond
+    mutable bool is_broken_ = false;
+
+    size_t GetShardIndex(int document_id) const {
+        return static_cast<unsigned>(document_id) % shards_.size();
+    }
+
+    void StartShard(string_view stop_words_text) {
+        int sockets[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0) {
+            throw runtime_error("Can't create a shard socket"s);
+        }
+        const pid_t process_id = fork();
+        if (process_id < 0) {
+            close(sockets[0]);
+            close(sockets[1]);
+            throw runtime_error("Can't start a shard process"s);
+        }
+        if (process_id == 0) {
+            // Sockets of earlier shards are closed here, so that they see the coordinator go away
+            close(sockets[0]);
+            for (const Shard& shard : shards_) {
+                close(shard.socket);
+            }
+            int exit_code = 0;
+            try {
+                ServeShard(sockets[1], stop_words_text);
+            } catch (...) {
+                exit_code = 1;
+            }
+            // Skips destructors and the output buffered by the coordinator before the fork
+            _exit(exit_code);
+        }
+        close(sockets[1]);
+        shards_.push_back({process_id, sockets[0]});
+    }
+
+    // A shard exits once its socket is closed
+    void StopShards() {
+        for (const Shard& shard : shards_) {
+            close(shard.socket);
+        }
+        for (const Shard& shard : shards_) {
+            waitpid(shard.process_id, nullptr, 0);
+        }
+        shards_.clear();
+    }
+
+    // Messages are framed by a 32-bit length
+    static bool SendMessage(int socket, string_view message) {
+        const uint32_t size = static_cast<uint32_t>(message.size());
+        string frame(reinterpret_cast<const char*>(&size), sizeof(size));
+        frame.append(message);
+        for (size_t sent = 0; sent < frame.size();) {
+            const ssize_t result = send(socket, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                return false;
+            }
+            sent += result;
+        }
+        return true;
+    }
+
+    static bool ReceiveBytes(int socket, char* data, size_t size) {
+        for (size_t received = 0; received < size;) {
+            const ssize_t result = recv(socket, data + received, size - received, 0);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                return false;
+            }
+            received += result;
+        }
+        return true;
+    }
+
+    // Returns nullopt once the other end has closed the socket
+    static optional<string> ReceiveMessage(int socket) {
+        uint32_t size = 0;
+        if (!ReceiveBytes(socket, reinterpret_cast<char*>(&size), sizeof(size))) {
+            return nullopt;
+        }
+        string message(size, '\0');
+        if (!ReceiveBytes(socket, message.data(), size)) {
+            return nullopt;
+        }
+        return message;
+    }
+
+    static void ServeShard(int socket, string_view stop_words_text) {
+        SearchServer server;
+        server.SetStopWords(stop_words_text);
+        while (const optional<string> request = ReceiveMessage(socket)) {
+            string response;
+            try {
+                response = HandleRequest(server, *request);
+            } catch (const invalid_argument& e) {
+                response = MakeErrorResponse(ResponseStatus::INVALID_ARGUMENT, e.what());
+            } catch (const out_of_range& e) {
+                response = MakeErrorResponse(ResponseStatus::OUT_OF_RANGE, e.what());
+            } catch (const exception& e) {
+                response = MakeErrorResponse(ResponseStatus::ERROR, e.what());
+            }
+            if (!SendMessage(socket, response)) {
+                return;
+            }
+        }
+    }
+
+    static string MakeErrorResponse(ResponseStatus status, string_view what) {
+        MessageWriter response(status);
+        response.WriteString(what);
+        return response.GetMessage();
+    }
+
+    static string HandleRequest(SearchServer& server, string_view request) {
+        MessageReader reader(request);
+        MessageWriter response(ResponseStatus::OK);
+        switch (reader.Read<RequestType>()) {
+        case RequestType::ADD_DOCUMENT: {
+            const int document_id = reader.Read<int32_t>();
+            const auto status = static_cast<DocumentStatus>(reader.Read<uint8_t>());
+            vector<int> ratings(reader.Read<uint32_t>());
+            for (int& rating : ratings) {
+                rating = reader.Read<int32_t>();
+            }
+            server.AddDocument(document_id, reader.ReadString(), status, ratings);
+            break;
+        }
+        case RequestType::REMOVE_DOCUMENT:
+            server.RemoveDocument(reader.Read<int32_t>());
+            break;
+        case RequestType::GET_DOCUMENT_FREQS: {
+            // Every shard parses the query alike, so frequencies come in the same word order
+            const SearchServer::Query query = server.ParseQuery(reader.ReadString());
+            response.Write<uint64_t>(server.GetDocumentCount());
+            response.Write<uint32_t>(static_cast<uint32_t>(query.plus_words.size()));
+            for (const string_view word : query.plus_words) {
+                const SearchServer::PostingList* postings = server.FindPostings(word);
+                response.Write<uint64_t>(postings == nullptr ? 0 : postings->size());
+            }
+            break;
+        }
+        case RequestType::FIND_TOP_DOCUMENTS: {
+            const SearchServer::Query query = server.ParseQuery(reader.ReadString());
+            const auto given_status = static_cast<DocumentStatus>(reader.Read<uint8_t>());
+            const size_t top_count = reader.Read<uint64_t>();
+            const uint64_t document_count = reader.Read<uint64_t>();
+            vector<uint64_t> document_freqs(reader.Read<uint32_t>());
+            for (uint64_t& document_freq : document_freqs) {
+                document_freq = reader.Read<uint64_t>();
+            }
+            if (document_freqs.size() != query.plus_words.size()) {
+                throw runtime_error("Shards parse the query differently"s);
+            }
+            // Words with postings in this shard are a subsequence of the query words
+            SearchServer::QueryPostings query_postings = server.GetQueryPostings(query);
+            for (size_t i = 0, j = 0; i < query_postings.plus_words.size(); ++i, ++j) {
+                while (query.plus_words[j] != query_postings.plus_words[i]) {
+                    ++j;
+                }
+                query_postings.plus_postings[i].second = log(document_count * 1.0 / document_freqs[j]);
+            }
+            const vector<Document> documents = server.FindTopDocuments(query_postings,
+                [given_status](int, DocumentStatus status, int) { return status == given_status; }, top_count);
+            response.Write<uint32_t>(static_cast<uint32_t>(documents.size()));
+            for (const Document& document : documents) {
+                response.Write<int32_t>(document.id);
+                response.Write<double>(document.relevance);
+                response.Write<int32_t>(document.rating);
+            }
+            break;
+        }
+        case RequestType::MATCH_DOCUMENT: {
+            const string_view raw_query = reader.ReadString();
+            const auto [matched_words, status] = server.MatchDocument(raw_query, reader.Read<int32_t>());
+            response.Write<uint32_t>(static_cast<uint32_t>(matched_words.size()));
+            for (const string_view word : matched_words) {
+                response.WriteString(word);
+            }
+            response.Write<uint8_t>(static_cast<uint8_t>(status));
+            break;
+        }
+        default:
+            throw runtime_error("Unknown shard request"s);
+        }
+        return response.GetMessage();
+    }
+
+    // Returns the payload of a successful response
+    static string CheckResponse(const string& response) {
+        MessageReader reader(response);
+        const auto status = reader.Read<ResponseStatus>();
+        if (status == ResponseStatus::OK) {
+            return response.substr(sizeof(ResponseStatus));
+        }
+        const string what(reader.ReadString());
+        if (status == ResponseStatus::INVALID_ARGUMENT) {
+            throw invalid_argument(what);
+        }
+        if (status == ResponseStatus::OUT_OF_RANGE) {
+            throw out_of_range(what);
+        }
+        throw runtime_error(what);
+    }
+
+    void RecordLatency(size_t shard_index, chrono::steady_clock::time_point start_time) const {
+        const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+        ShardLatency& latency = shard_latencies_[shard_index];
+        ++latency.request_count;
+        latency.total_seconds += seconds;
+        latency.max_seconds = max(latency.max_seconds, seconds);
+    }
+
+    void CheckNotBroken() const {
+        if (is_broken_) {
+            throw runtime_error("Sharded server is stopped after a shard failure"s);
+        }
+    }
+
+    // Other shards may be left with a request or a response in their sockets, so no shard can
+    // be used any more. Shutting the sockets down lets the shards exit now; the descriptors are
+    // closed and the processes waited for by StopShards().
+    [[noreturn]] void FailShards(const string& message) const {
+        is_broken_ = true;
+        for (const Shard& shard : shards_) {
+            shutdown(shard.socket, SHUT_RDWR);
+        }
+        throw runtime_error(message);
+    }
+
+    string Call(size_t shard_index, const string& request) const {
+        CheckNotBroken();
+        const auto start_time = chrono::steady_clock::now();
+        optional<string> response;
+        if (SendMessage(shards_[shard_index].socket, request)) {
+            response = ReceiveMessage(shards_[shard_index].socket);
+        }
+        if (!response) {
+            FailShards("Shard "s + to_string(shard_index) + " doesn't respond"s);
+        }
+        RecordLatency(shard_index, start_time);
+        return CheckResponse(*response);
+    }
+
+    // Sends the request to all shards first and takes the responses in the order they come.
+    // Errors of the shards are thrown only after every shard has responded, which keeps the
+    // sockets in step.
+    vector<string> Broadcast(const string& request) const {
+        CheckNotBroken();
+        const auto start_time = chrono::steady_clock::now();
+        vector<pollfd> poll_fds;
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            if (!SendMessage(shards_[i].socket, request)) {
+                FailShards("Shard "s + to_string(i) + " doesn't respond"s);
+            }
+            poll_fds.push_back({shards_[i].socket, POLLIN, 0});
+        }
+        vector<string> responses(shards_.size());
+        for (size_t pending_count = shards_.size(); pending_count > 0;) {
+            if (poll(poll_fds.data(), poll_fds.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                FailShards("Can't wait for shards"s);
+            }
+            for (size_t i = 0; i < poll_fds.size(); ++i) {
+                if (poll_fds[i].fd < 0 || poll_fds[i].revents == 0) {
+                    continue;
+                }
+                optional<string> response = ReceiveMessage(poll_fds[i].fd);
+                if (!response) {
+                    FailShards("Shard "s + to_string(i) + " doesn't respond"s);
+                }
+                RecordLatency(i, start_time);
+                responses[i] = move(*response);
+                // poll skips negative descriptors
+                poll_fds[i].fd = -1;
+                --pending_count;
+            }
+        }
+        for (string& response : responses) {
+            response = CheckResponse(response);
+        }
+        return responses;
+    }
+
+    // Document count of the whole index and document frequencies of the plus words of the query
+    pair<uint64_t, vector<uint64_t>> GatherDocumentFreqs(string_view raw_query) const {
+        MessageWriter request(RequestType::GET_DOCUMENT_FREQS);
+        request.WriteString(raw_query);
+        uint64_t document_count = 0;
+        vector<uint64_t> document_freqs;
+        for (const string& response : Broadcast(request.GetMessage())) {
+            MessageReader reader(response);
+            document_count += reader.Read<uint64_t>();
+            document_freqs.resize(reader.Read<uint32_t>());
+            for (uint64_t& document_freq : document_freqs) {
+                document_freq += reader.Read<uint64_t>();
+            }
+        }
+        return {document_count, document_freqs};
+    }
+};
+
+#endif
+
+// Queries are spread over the execution::par thread pool; the server is only read, so no locking is needed
+vector<vector<Document>> ProcessQueries(const SearchServer& search_server, const vector<string>& queries) {
+    vector<vector<Document>> documents_lists(queries.size());
+    transform(execution::par, queries.begin(), queries.end(), documents_lists.begin(),
+        [&search_server](const string& query) {
+            return search_server.FindTopDocuments(query);
+        });
+    return documents_lists;
+}
+
+// Results of all queries in one vector, in the order of queries
+vector<Document> ProcessQueriesJoined(const SearchServer& search_server, const vector<string>& queries) {
+    vector<vector<Document>> documents_lists = ProcessQueries(search_server, queries);
+    const size_t document_count = transform_reduce(documents_lists.begin(), documents_lists.end(), size_t{0}, plus<>{},
+        [](const vector<Document>& documents) { return documents.size(); });
+    vector<Document> joined_documents;
+    joined_documents.reserve(document_count);
+    for (const vector<Document>& documents : documents_lists) {
+        joined_documents.insert(joined_documents.end(), documents.begin(), documents.end());
+    }
+    return joined_documents;
+}
+
+// Finds documents with the same set of words and keeps the one with the lowest id.
+// Every pass checks only documents it hasn't seen before.
+class DuplicateDetector {
+public:
+    // Returns ids of the removed documents in ascending order
+    vector<int> RemoveNewDuplicates(SearchServer& search_server) {
+        const vector<int> document_ids(search_server.begin(), search_server.end());
+        vector<int> duplicate_ids;
+        for (const int document_id : document_ids) {
+            if (!checked_document_ids_.insert(document_id).second) {
+                continue;
+            }
+            const auto [it, inserted] = word_set_to_document_.emplace(GetWordSet(search_server, document_id), document_id);
+            if (inserted) {
+                continue;
+            }
+            int& original_id = it->second;
+            if (!binary_search(document_ids.begin(), document_ids.end(), original_id)) {
+                // The original was removed from the server since the previous pass
+                checked_document_ids_.erase(original_id);
+                original_id = document_id;
+            } else if (document_id < original_id) {
+                duplicate_ids.push_back(original_id);
+                original_id = document_id;
+            } else {
+                duplicate_ids.push_back(document_id);
+            }
+        }
+        sort(duplicate_ids.begin(), duplicate_ids.end());
+        for (const int document_id : duplicate_ids) {
+            search_server.RemoveDocument(document_id);
+            checked_document_ids_.erase(document_id);
+        }
+        return duplicate_ids;
+    }
+
+private:
+    // Words of the server share one pool, so equal words have equal addresses
+    using WordSet = vector<const char*>;
+
+    struct WordSetHasher {
+        size_t operator()(const WordSet& words) const {
+            size_t hash = words.size();
+            for (const char* word : words) {
+                hash = hash * 37 + hasher(word);
+            }
+            return hash;
+        }
+
+        std::hash<const char*> hasher;
+    };
+
+    unordered_map<WordSet, int, WordSetHasher> word_set_to_document_;
+    set<int> checked_document_ids_;
+
+    static WordSet GetWordSet(const SearchServer& search_server, int document_id) {
+        WordSet words;
+        for (const auto& [word, _] : search_server.GetWordFrequencies(document_id)) {
+            words.push_back(word.data());
+        }
+        return words;
+    }
+};
+
+// Checks every document of the server. Returns ids of the removed documents in ascending order.
+vector<int> RemoveDuplicates(SearchServer& search_server) {
+    return DuplicateDetector().RemoveNewDuplicates(search_server);
+}
+
+// Checks only documents added since the previous pass with the same detector
+vector<int> RemoveDuplicates(SearchServer& search_server, DuplicateDetector& detector) {
+    return detector.RemoveNewDuplicates(search_server);
+}
+
+// Non-owning view of [begin, end)
+template <typename Iterator>
+class IteratorRange {
+public:
+    IteratorRange(Iterator begin, Iterator end)
+        : begin_(begin)
+        , end_(end) {
+    }
+
+    Iterator begin() const {
+        return begin_;
+    }
+
+    Iterator end() const {
+        return end_;
+    }
+
+    size_t size() const {
+        return distance(begin_, end_);
+    }
+
+private:
+    Iterator begin_;
+    Iterator end_;
+};
+
+// Splits a range into pages of page_size elements, the last page may be shorter.
+// Pages refer to the original range, nothing is copied.
+template <typename Iterator>
+class Paginator {
+public:
+    Paginator(Iterator begin, Iterator end, size_t page_size) {
+        if (page_size == 0) {
+            throw invalid_argument("Page size must be positive"s);
+        }
+        for (size_t left = distance(begin, end); left > 0;) {
+            const size_t current_page_size = min(page_size, left);
+            const Iterator page_end = next(begin, current_page_size);
+            pages_.push_back({begin, page_end});
+            left -= current_page_size;
+            begin = page_end;
+        }
+    }
+
+    auto begin() const {
+        return pages_.begin();
+    }
+
+    auto end() const {
+        return pages_.end();
+    }
+
+    size_t size() const {
+        return pages_.size();
+    }
+
+private:
+    vector<IteratorRange<Iterator>> pages_;
+};
+
+template <typename Container>
+auto Paginate(const Container& container, size_t page_size) {
+    return Paginator(begin(container), end(container), page_size);
+}
+
+ostream& operator<<(ostream& output, const Document& document) {
+    return output << "{ "s
+                  << "document_id = "s << document.id << ", "s
+                  << "relevance = "s << document.relevance << ", "s
+                  << "rating = "s << document.rating
+                  << " }"s;
+}
+
+template <typename Iterator>
+ostream& operator<<(ostream& output, const IteratorRange<Iterator>& range) {
+    for (const auto& value : range) {
+        output << value;
+    }
+    return output;
+}
+
+// Forwards search requests to the server and keeps statistics over the last MINUTES_IN_DAY
+// requests, one request per minute. The window is a ring buffer, so a request costs O(1).
+class RequestQueue {
+public:
+    explicit RequestQueue(const SearchServer& search_server)
+        : search_server_(search_server) {
+    }
+
+    template <typename DocumentPredicate>
+    vector<Document> AddFindRequest(string_view raw_query, DocumentPredicate document_predicate) {
+        vector<Document> documents = search_server_.FindTopDocuments(raw_query, document_predicate);
+        AddRequest(documents.empty());
+        return documents;
+    }
+
+    vector<Document> AddFindRequest(string_view raw_query, DocumentStatus status = DocumentStatus::ACTUAL) {
+        vector<Document> documents = search_server_.FindTopDocuments(raw_query, status);
+        AddRequest(documents.empty());
+        return documents;
+    }
+
+    int GetNoResultRequests() const {
+        return no_result_request_count_;
+    }
+
+private:
+    const SearchServer& search_server_;
+    array<bool, MINUTES_IN_DAY> is_no_result_request_ = {};
+    int next_request_ = 0;
+    int request_count_ = 0;
+    int no_result_request_count_ = 0;
+
+    void AddRequest(bool is_no_result) {
+        // The oldest request leaves the window
+        if (request_count_ == MINUTES_IN_DAY) {
+            no_result_request_count_ -= is_no_result_request_[next_request_];
+        } else {
+            ++request_count_;
+        }
+        is_no_result_request_[next_request_] = is_no_result;
+        no_result_request_count_ += is_no_result;
+        next_request_ = (next_request_ + 1) % MINUTES_IN_DAY;
+    }
+};
+
+// ==================== для примера =========================
+
+
+void PrintDocument(const Document& document) {
+    cout << document << endl;
+}
+/* Подставьте вашу реализацию класса SearchServer сюда */
+
+
+
+
+template <typename LeftValue, typename RightValue>
+void AssertEqualImpl(const LeftValue& left, const RightValue& right,
+    const std::string& left_expression, const std::string& right_expression,
+    const std::string& file, const std::string& function_name,
+    unsigned line, const std::string& hint) {
+    if (left != right) {
+        std::cerr << std::boolalpha;
+        std::cerr << file << "(" << line << "): " << function_name << ": ";
+        std::cerr << "ASSERT_EQUAL(" << left_expression << ", " << right_expression << ") failed: ";
+        std::cerr << left << " != " << right << ".";
+
+        if (!hint.empty()) {
+            std::cerr << " Hint: " << hint;
+        }
+
+        std::cerr << std::endl;
+        std::cerr << std::noboolalpha;
+
+        abort();
+    }
+}
+
+void AssertImpl(bool value, const std::string& expression,
+    const std::string& file, const std::string& function_name,
+    unsigned line, const std::string& hint) {
+    if (!value) {
+        std::cerr << file << "(" << line << "): " << function_name << ": ";
+        std::cerr << "ASSERT(" << expression << ") failed.";
+        if (!hint.empty()) {
+            std::cerr << " Hint: " << hint;
+        }
+        std::cerr << std::endl;
+        abort();
+    }
+}
+
+#define ASSERT_EQUAL(a, b) AssertEqualImpl((a), (b), #a, #b, __FILE__, __FUNCTION__, __LINE__, "")
+
+#define ASSERT_EQUAL_HINT(a, b, hint) AssertEqualImpl((a), (b), #a, #b, __FILE__, __FUNCTION__, __LINE__, (hint))
+
+#define ASSERT(expr) AssertImpl(!!(expr), #expr, __FILE__, __FUNCTION__, __LINE__, "")
+
+#define ASSERT_HINT(expr, hint) AssertImpl(!!(expr), #expr, __FILE__, __FUNCTION__, __LINE__, (hint))
+
+#define RUN_TEST(function) function(); std::cerr << #function " OK\n"
+
+/*
+   Подставьте сюда вашу реализацию макросов
+   ASSERT, ASSERT_EQUAL, ASSERT_EQUAL_HINT, ASSERT_HINT и RUN_TEST
+*/
+
+void AssertSameDocumentsImpl(const vector<Document>& actual, const vector<Document>& expected,
+    const std::string& actual_expression, const std::string& expected_expression,
+    const std::string& file, const std::string& function_name,
+    unsigned line, const std::string& hint) {
+    AssertEqualImpl(actual.size(), expected.size(), actual_expression + ".size()"s, expected_expression + ".size()"s,
+        file, function_name, line, hint);
+    const std::string actual_id = actual_expression + "[i].id"s;
+    const std::string expected_id = expected_expression + "[i].id"s;
+    const std::string actual_relevance = actual_expression + "[i].relevance"s;
+    const std::string expected_relevance = expected_expression + "[i].relevance"s;
+    const std::string actual_rating = actual_expression + "[i].rating"s;
+    const std::string expected_rating = expected_expression + "[i].rating"s;
+    for (size_t i = 0; i < expected.size(); ++i) {
+        AssertEqualImpl(actual[i].id, expected[i].id, actual_id, expected_id, file, function_name, line, hint);
+        AssertEqualImpl(actual[i].relevance, expected[i].relevance, actual_relevance, expected_relevance, file, function_name, line, hint);
+        AssertEqualImpl(actual[i].rating, expected[i].rating, actual_rating, expected_rating, file, function_name, line, hint);
+    }
+}
+
+// Документы совпадают по порядку, id, рейтингу и побитово по релевантности
+#define ASSERT_SAME_DOCUMENTS(actual, expected, hint) AssertSameDocumentsImpl((actual), (expected), #actual, #expected, __FILE__, __FUNCTION__, __LINE__, (hint))
+
+// Случайные документы из слов w0, w1, ... Номер слова - произведение двух равномерных чисел из
+// [0, max_word_index], делённое на max_word_index, поэтому слова с малыми номерами часты, а с большими
+// редки. В документе с номером i min_word_count + i % word_count_spread слов.
+vector<string> GenerateTestDocuments(uint32_t seed, int document_count, int max_word_index, int min_word_count, int word_count_spread = 1) {
+    mt19937 generator(seed);
+    uniform_int_distribution<int> word_distribution(0, max_word_index);
+    vector<string> documents(document_count);
+    for (int document_id = 0; document_id < document_count; ++document_id) {
+        for (int i = 0; i < min_word_count + document_id % word_count_spread; ++i) {
+            documents[document_id] += "w"s + to_string(word_distribution(generator) * word_distribution(generator) / max_word_index) + " "s;
+        }
+    }
+    return documents;
+}
+
+
+
+
+// Счётчик выделений памяти текущего потока, чтобы тесты и бенчмарки могли проверить путь без
+// выделений. Глобальный operator new заменяется только в сборке с SEARCH_SERVER_COUNT_ALLOCATIONS.
+#ifdef SEARCH_SERVER_COUNT_ALLOCATIONS
+thread_local uint64_t thread_allocation_count = 0;
+
+// Операторы не встраиваются, иначе GCC видит malloc() в паре с delete и предупреждает о несоответствии
+__attribute__((noinline)) void* operator new(size_t size) {
+    ++thread_allocation_count;
+    if (void* data = malloc(size == 0 ? 1 : size)) {
+        return data;
+    }
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* data) noexcept {
+    free(data);
+}
+
+__attribute__((noinline)) void operator delete(void* data, size_t) noexcept {
+    free(data);
+}
+#endif
+
+// -------- Начало модульных тестов поисковой системы ----------
+
+// Тест проверяет, что поисковая система исключает стоп-слова при добавлении документов
+void TestExcludeStopWordsFromAddedDocumentContent() {
+    const int doc_id = 42;
+    const string content = "cat in the city"s;
+    const vector<int> ratings = {1, 2, 3};
+    {
+        SearchServer server;
+        server.AddDocument(doc_id, content, DocumentStatus::ACTUAL, ratings);
+        const auto found_docs = server.FindTopDocuments("in"s);
+        ASSERT_EQUAL(found_docs.size(), 1u);
+        const Document& doc0 = found_docs[0];
+        ASSERT_EQUAL(doc0.id, doc_id);
+    }
+
+    {
+        SearchServer server;
+        server.SetStopWords("in the"s);
+        server.AddDocument(doc_id, content, DocumentStatus::ACTUAL, ratings);
+        ASSERT_HINT(server.FindTopDocuments("in"s).empty(), "Stop words must be excluded from documents"s);
+    }
+}
+
+
+
+
+//Добавление документов. Добавленный документ должен находиться по поисковому запросу, который содержит слова из документа.
+void TestAddDocument() {
+
+        const std::vector<int> ratings = { 1 };
+        const int document_id = 42;
+        const std::string content1 = "cat in the city";
+        const std::string content2 = "dog was found";
+
+        
+            SearchServer server;
+
+            server.AddDocument(document_id, content1, DocumentStatus::ACTUAL, ratings);
+            server.AddDocument(document_id + 1, content2, DocumentStatus::ACTUAL, ratings);
+
+            ASSERT_EQUAL_HINT(server.GetDocumentCount(), 2, "AddDocument doesn't add documents properly");
+
+            {
+                const std::vector<Document>& result = server.FindTopDocuments(content1);
+
+                ASSERT_EQUAL_HINT(result.size(), 1, "Document doesn't match itself");
+                ASSERT_EQUAL_HINT(result[0].id, document_id, "Document content matches content of other document");
+            }
+
+            {
+                const std::vector<Document>& result = server.FindTopDocuments(content2);
+
+                ASSERT_EQUAL_HINT(result.size(), 1, "Document doesn't match itself");
+                ASSERT_EQUAL_HINT(result[0].id, (document_id + 1),
+                    "Document content matches content of other document");
+
+            }
+
+            ASSERT_HINT(server.FindTopDocuments("nothing here").empty(),
+                "FindTopDocuments matches documents it must not match");
+        
+    
+}
+
+//Поддержка минус-слов. Документы, содержащие минус-слова из поискового запроса, не должны включаться в результаты поиска.
+void TestMinusWords() {
+    const int document_id = 42;
+    const std::vector<int> ratings = { 1 };
+
+    {
+        SearchServer server;
+
+        server.AddDocument(document_id, "cat in the city", DocumentStatus::ACTUAL, ratings);
+        server.AddDocument(document_id + 1, "dog in the park", DocumentStatus::ACTUAL, ratings);
+
+        {
+            const auto& result = server.FindTopDocuments("in the -dog");
+
+            ASSERT_EQUAL_HINT(result.size(), 1, "Minus words are not ignored");
+            ASSERT_EQUAL_HINT(result[0].id, document_id, "Minus words are not ignored, query returned wrong document");
+        }
+
+        {
+            ASSERT_HINT(server.FindTopDocuments("the -cat -dog").empty(), "Minus words are not ignored");
+        }
+    }
+}
+
+//Соответствие документов поисковому запросу. При этом должны быть возвращены все слова из поискового запроса, присутствующие в документе. Если есть соответствие хотя бы по одному минус-слову, должен возвращаться пустой список слов.
+void TestMatchDocToRequest(){
+
+    const int document_id = 42;
+	SearchServer server;
+	server.AddDocument(document_id, "cat in the city", DocumentStatus::ACTUAL, { 1 });
+	{
+    const auto& [matched_words, document_status] = server.MatchDocument("cat city", document_id);
+    ASSERT_EQUAL_HINT(matched_words.size(), 2, "MatchDocument doesn't match all words in the document");
+    ASSERT_EQUAL_HINT(matched_words[0], "cat", "MatchDocument doesn't match some words");
+    ASSERT_EQUAL_HINT(matched_words[1], "city", "MatchDocument doesn't match some words");
+	}
+	{
+    const auto& [matched_words, unused] = server.MatchDocument("cat -city", document_id);
+    ASSERT_HINT(matched_words.empty(), "Minus words are not ignored in MatchDocument");
+	}
+}
+
+//Сортировка найденных документов по релевантности. Возвращаемые при поиске документов результаты должны быть отсортированы в порядке убывания релевантности.
+void TestSortByRelevance(){
+
+    const int document_id = 42;
+    const std::vector<int> ratings = { 1 };
+
+    {
+        SearchServer server;
+
+        server.AddDocument(document_id, "The cat in the city", DocumentStatus::ACTUAL, ratings);
+        server.AddDocument(document_id + 1, "The cat in the", DocumentStatus::ACTUAL, ratings);
+        server.AddDocument(document_id + 2, "The cat in", DocumentStatus::ACTUAL, ratings);
+        server.AddDocument(document_id + 3, "The", DocumentStatus::ACTUAL, ratings);
+
+        int id = 0;
+        const std::vector<std::string> words = {
+            "generation", "bake", "quarrel", "ferry", "biscuit",
+            "table", "bother", "guideline", "duty", "first",
+        };
+
+        for (auto word : words) {
+            server.AddDocument(++id, word, DocumentStatus::ACTUAL, ratings);
+        }
+
+        {
+            const auto& result = server.FindTopDocuments("cat");
+
+            ASSERT_EQUAL_HINT(result.size(), 3, "FindTopDocument incorrect amount of documents");
+            constexpr double document_relevance_inaccuracy = 1e-6;
+
+            auto sort_by_relevance = [document_relevance_inaccuracy](const Document& left, const Document& right) {
+                return std::abs(left.relevance - right.relevance) < document_relevance_inaccuracy;
+            };
+
+            ASSERT_HINT(std::is_sorted(std::begin(result), std::end(result), sort_by_relevance),
+                "Documents are not sorted correctly");
+        }
+    }
+
+}
+
+//Вычисление рейтинга документов. Рейтинг добавленного документа равен среднему арифметическому оценок документа.
+void TestCalcRating(){
+
+	auto calculate_average_rating = [](const std::vector<int>& input) {
+	        int correct = 0;
+	        for (auto number : input) {
+	            correct += number;
+	        }
+	        correct /= static_cast<int>(input.size());
+	        return correct;
+	    };
+
+	    {
+	        const std::vector<int> ratings = { 1, 10, 28, 60, 11, 11, 12321 };
+
+	        SearchServer server;
+
+	        server.AddDocument(42, "cat in the city", DocumentStatus::ACTUAL, ratings);
+
+	        {
+	            const auto& result = server.FindTopDocuments("cat");
+
+	            ASSERT_EQUAL_HINT(result[0].rating, calculate_average_rating(ratings), "Incorrect rating calculation");
+	        }
+	    }
+
+	    {
+	        const std::vector<int> ratings = { 545, 136, 548, 508, 797, 21005, 245 };
+
+	        SearchServer server;
+
+	        server.AddDocument(42, "cat in the city", DocumentStatus::ACTUAL, ratings);
+
+	        {
+	            const auto& result = server.FindTopDocuments("cat");
+
+	            ASSERT_EQUAL_HINT(result[0].rating, calculate_average_rating(ratings), "Incorrect rating calculation");
+	        }
+	    }
+
+}
+
+
+//Фильтрация результатов поиска с использованием предиката, задаваемого пользователем.
+void TestFiltrationByUserDefinedPredicate(){
+
+	const int document_id = 42;
+	    const std::vector<int> ratings = { 1 };
+
+	    {
+	        SearchServer server;
+
+	        server.AddDocument(document_id, "The cat in the city", DocumentStatus::ACTUAL, ratings);
+	        server.AddDocument(document_id + 1, "The cat in the", DocumentStatus::ACTUAL, ratings);
+	        server.AddDocument(document_id + 2, "The cat in", DocumentStatus::ACTUAL, ratings);
+	        server.AddDocument(document_id + 3, "The", DocumentStatus::ACTUAL, ratings);
+
+	        {
+	            auto get_every_second_document = [](int document_id, DocumentStatus, int) {
+	                return document_id % 2 == 0;
+	            };
+
+	            const auto& result = server.FindTopDocuments("cat", get_every_second_document);
+
+	            ASSERT_EQUAL_HINT(result.size(), 2, "Function filter is not applied correctly");
+
+	            ASSERT_EQUAL_HINT(result[0].id, document_id + 2,
+	                "Function filter is not applied correctly, wrong document");
+
+	            ASSERT_EQUAL_HINT(result[1].id, document_id, "Fuction filter is not applied correctly, wrong document");
+	        }
+	    }
+}
+
+//Поиск документов, имеющих заданный статус.
+void FindDocumentWithStatus(){
+
+	const int document_id = 42;
+	    const std::vector<int> ratings = { 1 };
+
+
+	        SearchServer server;
+
+	        server.AddDocument(document_id, "The cat in the city", DocumentStatus::ACTUAL, ratings);
+	        server.AddDocument(document_id + 1, "The cat in the", DocumentStatus::BANNED, ratings);
+	        server.AddDocument(document_id + 2, "The cat in", DocumentStatus::IRRELEVANT, ratings);
+	        server.AddDocument(document_id + 3, "The cat", DocumentStatus::REMOVED, ratings);
+
+	        {
+	            const auto& result = server.FindTopDocuments("cat", DocumentStatus::REMOVED);
+
+	            ASSERT_EQUAL_HINT(result.size(), 1, "Status filter is not applied correctly");
+
+	            ASSERT_EQUAL_HINT(result[0].id, (document_id + 3),
+	                "Status filter is not applied correctly, wrong document");
+	        }
+
+}
+
+//Корректное вычисление релевантности найденных документов.
+void TestCalcRelevance(){
+
+	const int document_id = 42;
+	    const std::vector<int> ratings = { 1 };
+
+
+	        SearchServer server;
+
+	        server.AddDocument(document_id, "The cat in the city", DocumentStatus::ACTUAL, ratings);
+	        server.AddDocument(document_id + 1, "The cat in the", DocumentStatus::ACTUAL, ratings);
+	        server.AddDocument(document_id + 2, "The cat in", DocumentStatus::ACTUAL, ratings);
+	        server.AddDocument(document_id + 3, "The", DocumentStatus::ACTUAL, ratings);
+
+	        {
+	            const auto& result = server.FindTopDocuments("cat");
+
+	            ASSERT_EQUAL_HINT(result.size(), 3, "Incorrect amount of returned documents");
+
+	            const double idf = log(4.0 / 3.0);
+
+	            ASSERT_EQUAL_HINT(result[0].relevance, (1.0 / 3.0) * idf, "Relevance is not calculated correctly");
+
+	            ASSERT_EQUAL_HINT(result[1].relevance, (1.0 / 4.0) * idf, "Relevance is not calculated correctly");
+
+	            ASSERT_EQUAL_HINT(result[2].relevance, (1.0 / 5.0) * idf, "Relevance is not calculated correctly");
+	        }
+
+}
+
+//Документы могут добавляться в любом порядке идентификаторов, повторяющиеся слова учитываются в TF.
+void TestAddDocumentsOutOfOrder(){
+
+	SearchServer server;
+
+	server.AddDocument(50, "cat cat dog", DocumentStatus::ACTUAL, { 1 });
+	server.AddDocument(10, "cat bird", DocumentStatus::ACTUAL, { 2 });
+	server.AddDocument(30, "dog bird", DocumentStatus::ACTUAL, { 3 });
+
+	{
+	    const auto& result = server.FindTopDocuments("cat");
+
+	    ASSERT_EQUAL_HINT(result.size(), 2, "Posting list lost a document");
+	    ASSERT_EQUAL_HINT(result[0].id, 50, "Repeated words are not counted in term frequency");
+	    ASSERT_EQUAL_HINT(result[1].id, 10, "Posting list lost a document");
+
+	    const double idf = log(3.0 / 2.0);
+	    ASSERT_EQUAL_HINT(result[0].relevance, (1.0 / 3.0 + 1.0 / 3.0) * idf, "Relevance is not calculated correctly");
+	}
+	{
+	    const auto& [matched_words, unused] = server.MatchDocument("bird dog", 30);
+	    ASSERT_EQUAL_HINT(matched_words.size(), 2, "MatchDocument doesn't find document in the middle of posting list");
+	}
+	{
+	    const auto& [matched_words, unused] = server.MatchDocument("bird", 50);
+	    ASSERT_HINT(matched_words.empty(), "MatchDocument matches word missing in the document");
+	}
+}
+
+//Количество возвращаемых документов задаётся при вызове, порядок совпадает с полной сортировкой.
+void TestTopDocumentCount(){
+
+	SearchServer server;
+
+	for (int document_id = 0; document_id < 20; ++document_id) {
+	    const string content = "cat dog"s + (document_id % 3 == 0 ? " cat"s : ""s) + (document_id % 2 == 0 ? " bird"s : ""s);
+	    server.AddDocument(document_id, content, DocumentStatus::ACTUAL, { document_id });
+	}
+
+	ASSERT_EQUAL_HINT(server.FindTopDocuments("cat").size(), MAX_RESULT_DOCUMENT_COUNT, "Default result count is wrong");
+	ASSERT_EQUAL_HINT(server.FindTopDocuments("cat", DocumentStatus::ACTUAL, 3).size(), 3, "Result count is not applied");
+	ASSERT_EQUAL_HINT(server.FindTopDocuments("cat", DocumentStatus::ACTUAL, 100).size(), 20,
+	    "Result count larger than match count must return all matches");
+
+	const auto all_documents = server.FindTopDocuments("cat", DocumentStatus::ACTUAL, 100);
+	const auto top_documents = server.FindTopDocuments("cat dog", [](int, DocumentStatus, int) { return true; }, 7);
+	ASSERT_EQUAL_HINT(top_documents.size(), 7, "Result count is not applied for predicate overload");
+	ASSERT_HINT(is_sorted(top_documents.begin(), top_documents.end(), IsMoreRelevant), "Top documents are not sorted");
+	for (size_t i = 0; i < 5; ++i) {
+	    ASSERT_EQUAL_HINT(server.FindTopDocuments("cat")[i].id, all_documents[i].id,
+	        "Partial selection differs from full sort");
+	}
+}
+
+//Параллельный поиск возвращает те же документы с побитово равной релевантностью, что и последовательный.
+void TestParallelFindTopDocuments(){
+
+	SearchServer server;
+	server.SetStopWords("and in on"s);
+
+	const vector<string> words = { "cat", "dog", "bird", "city", "park", "and", "in", "on", "tail", "wing" };
+	mt19937 generator(7);
+	for (int document_id = 0; document_id < 500; ++document_id) {
+	    string content;
+	    for (int i = 0; i < 8; ++i) {
+	        content += words[generator() % words.size()] + " "s;
+	    }
+	    const DocumentStatus status = document_id % 5 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL;
+	    server.AddDocument(document_id * 3, content, status, { static_cast<int>(generator() % 10) });
+	}
+
+	for (const string& query : { "cat dog"s, "bird -city"s, "tail wing park -dog -in"s, "and"s, "unknown"s }) {
+	    ASSERT_SAME_DOCUMENTS(server.FindTopDocuments(execution::par, query), server.FindTopDocuments(query),
+	        "Parallel search differs from sequential");
+	    ASSERT_SAME_DOCUMENTS(server.FindTopDocuments(execution::par, query, DocumentStatus::BANNED, 1000),
+	        server.FindTopDocuments(query, DocumentStatus::BANNED, 1000), "Parallel search differs from sequential");
+	    ASSERT_SAME_DOCUMENTS(server.FindTopDocuments(execution::seq, query, DocumentStatus::ACTUAL),
+	        server.FindTopDocuments(query, DocumentStatus::ACTUAL), "Sequential policy differs from the plain search");
+
+	    const auto even_rating = [](int, DocumentStatus, int rating) { return rating % 2 == 0; };
+	    ASSERT_SAME_DOCUMENTS(server.FindTopDocuments(execution::par, query, even_rating, 1000),
+	        server.FindTopDocuments(query, even_rating, 1000), "Parallel search differs from sequential");
+	}
+
+	ASSERT_HINT(SearchServer().FindTopDocuments(execution::par, "cat"s).empty(), "Parallel search on empty server must find nothing");
+}
+
+//Пакетная обработка запросов возвращает те же результаты, что и последовательные вызовы FindTopDocuments.
+void TestProcessQueries(){
+
+	SearchServer server;
+	server.SetStopWords("and with"s);
+
+	const vector<string> documents = {
+	    "funny pet and nasty rat"s,
+	    "funny pet with curly hair"s,
+	    "funny pet and not very nasty rat"s,
+	    "pet with rat and rat and rat"s,
+	    "nasty rat with curly hair"s,
+	};
+	for (int document_id = 0; document_id < static_cast<int>(documents.size()); ++document_id) {
+	    server.AddDocument(document_id + 1, documents[document_id], DocumentStatus::ACTUAL, { 1, 2 });
+	}
+
+	const vector<string> queries = { "nasty rat -not"s, "not very funny nasty pet"s, "curly hair"s, "missing"s };
+
+	const auto documents_lists = ProcessQueries(server, queries);
+	ASSERT_EQUAL_HINT(documents_lists.size(), queries.size(), "ProcessQueries must return a list per query");
+
+	vector<Document> expected_joined;
+	for (size_t i = 0; i < queries.size(); ++i) {
+	    const auto expected = server.FindTopDocuments(queries[i]);
+	    ASSERT_EQUAL_HINT(documents_lists[i].size(), expected.size(), "ProcessQueries returned wrong amount of documents");
+	    for (size_t j = 0; j < expected.size(); ++j) {
+	        ASSERT_EQUAL_HINT(documents_lists[i][j].id, expected[j].id, "ProcessQueries returned wrong document");
+	    }
+	    expected_joined.insert(expected_joined.end(), expected.begin(), expected.end());
+	}
+	ASSERT_HINT(documents_lists[3].empty(), "ProcessQueries found documents for unknown word");
+
+	const auto joined = ProcessQueriesJoined(server, queries);
+	ASSERT_EQUAL_HINT(joined.size(), expected_joined.size(), "ProcessQueriesJoined lost documents");
+	for (size_t i = 0; i < joined.size(); ++i) {
+	    ASSERT_EQUAL_HINT(joined[i].id, expected_joined[i].id, "ProcessQueriesJoined breaks query order");
+	}
+}
+
+//Сервер не зависит от времени жизни строк документов и запросов, найденные слова ссылаются на индекс.
+void TestWordsOutliveSourceText(){
+
+	SearchServer server;
+	{
+	    string stop_words = "in  the "s;
+	    server.SetStopWords(stop_words);
+	    string content = "  cat in   the city  "s;
+	    server.AddDocument(42, content, DocumentStatus::ACTUAL, { 1 });
+	    content.assign(content.size(), 'x');
+	    stop_words.assign(stop_words.size(), 'x');
+	}
+
+	vector<string_view> matched_words;
+	{
+	    string query = "city -dog cat the"s;
+	    matched_words = get<0>(server.MatchDocument(query, 42));
+	    query.assign(query.size(), 'x');
+	}
+	ASSERT_EQUAL_HINT(matched_words.size(), 2, "Stop words or extra spaces are not handled");
+	ASSERT_EQUAL_HINT(matched_words[0], "cat"s, "Matched word doesn't point into the index");
+	ASSERT_EQUAL_HINT(matched_words[1], "city"s, "Matched word doesn't point into the index");
+	ASSERT_HINT(server.FindTopDocuments("the in"s).empty(), "Stop words must be excluded from documents");
+	ASSERT_EQUAL_HINT(server.FindTopDocuments("city"s).size(), 1, "Document words are lost");
+}
+
+//Пул терминов хранит каждое слово один раз, выданные представления не меняются при росте пула.
+void TestTermPool(){
+
+	TermPool pool;
+	const TermId cat_id = pool.Intern("cat"sv);
+	const string_view cat = pool.GetTerm(cat_id);
+	ASSERT_EQUAL_HINT(pool.Intern("cat"s), cat_id, "Same term interned twice");
+	ASSERT_EQUAL_HINT(pool.Find("cat"sv), cat_id, "Interned term is not found");
+	ASSERT_EQUAL_HINT(pool.Find("dog"sv), TermPool::NO_TERM, "Unknown term is found");
+
+	const string long_term(100000, 'a');
+	const TermId long_id = pool.Intern(long_term);
+	for (int i = 0; i < 20000; ++i) {
+	    pool.Intern("term"s + to_string(i));
+	}
+	ASSERT_EQUAL_HINT(pool.GetTerm(cat_id).data(), cat.data(), "Term bytes were moved");
+	ASSERT_EQUAL_HINT(pool.GetTerm(long_id), long_term, "Long term is stored incorrectly");
+	ASSERT_EQUAL_HINT(pool.GetTerm(pool.Find("term19999"sv)), "term19999"s, "Term is stored incorrectly");
+
+	const TermPool::MemoryStats stats = pool.GetMemoryStats();
+	ASSERT_EQUAL_HINT(stats.term_count, 20002, "Memory counters miss terms");
+	ASSERT_HINT(stats.term_bytes <= stats.arena_bytes, "Arena is smaller than stored terms");
+
+	SearchServer server;
+	server.SetStopWords("in the"s);
+	server.AddDocument(1, "cat in the city"s, DocumentStatus::ACTUAL, { 1 });
+	ASSERT_EQUAL_HINT(server.GetTermMemoryStats().term_count, 4, "Stop words and document words must share the pool");
+}
+
+//Удаление документа убирает его из индекса и из результатов поиска, частоты слов доступны по id документа.
+void TestRemoveDocument(){
+
+	SearchServer server;
+	server.SetStopWords("and"s);
+	server.AddDocument(1, "funny pet and nasty rat"s, DocumentStatus::ACTUAL, { 1 });
+	server.AddDocument(2, "funny pet with curly hair"s, DocumentStatus::ACTUAL, { 2 });
+	server.AddDocument(3, "nasty rat rat"s, DocumentStatus::ACTUAL, { 3 });
+
+	{
+	    const map<string_view, double>& word_freqs = server.GetWordFrequencies(3);
+	    ASSERT_EQUAL_HINT(word_freqs.size(), 2, "Forward index has wrong words");
+	    ASSERT_EQUAL_HINT(word_freqs.at("rat"sv), 2.0 / 3.0, "Forward index has wrong frequency");
+	    ASSERT_HINT(server.GetWordFrequencies(100).empty(), "Unknown document must have no words");
+	}
+
+	server.RemoveDocument(1);
+	ASSERT_EQUAL_HINT(server.GetDocumentCount(), 2, "Document is not removed");
+	ASSERT_HINT(server.GetWordFrequencies(1).empty(), "Forward index keeps removed document");
+	{
+	    const auto result = server.FindTopDocuments("funny nasty"s);
+	    ASSERT_EQUAL_HINT(result.size(), 2, "Removed document is still found");
+	    const double idf = log(2.0 / 1.0);
+	    for (const Document& document : result) {
+	        ASSERT_HINT(document.id != 1, "Removed document is still found");
+	        ASSERT_EQUAL_HINT(document.relevance, (document.id == 2 ? 1.0 / 5.0 : 1.0 / 3.0) * idf,
+	            "IDF is not updated after removal");
+	    }
+	}
+
+	server.RemoveDocument(execution::par, 3);
+	server.RemoveDocument(100);
+	ASSERT_EQUAL_HINT(server.GetDocumentCount(), 1, "Document is not removed by parallel overload");
+	ASSERT_HINT(server.FindTopDocuments("rat"s).empty(), "Removed document is still found");
+	ASSERT_HINT(server.FindTopDocuments(execution::par, "rat"s).empty(), "Removed document is still found");
+
+	server.AddDocument(1, "nasty rat"s, DocumentStatus::ACTUAL, { 1 });
+	ASSERT_EQUAL_HINT(server.FindTopDocuments("rat"s).size(), 1, "Document id can't be reused after removal");
+}
+
+//Дубликатами считаются документы с одинаковым набором слов, остаётся документ с наименьшим id.
+void TestRemoveDuplicates(){
+
+	SearchServer server;
+	server.SetStopWords("and with"s);
+
+	server.AddDocument(1, "funny pet and nasty rat"s, DocumentStatus::ACTUAL, { 7, 2, 7 });
+	server.AddDocument(2, "funny pet with curly hair"s, DocumentStatus::ACTUAL, { 1, 2 });
+	// дубликат документа 2, будет удалён
+	server.AddDocument(3, "funny pet with curly hair"s, DocumentStatus::ACTUAL, { 1, 2 });
+	// отличие только в стоп-словах, считаем дубликатом
+	server.AddDocument(4, "funny pet and curly hair"s, DocumentStatus::ACTUAL, { 1, 2 });
+	// множество слов такое же, считаем дубликатом документа 1
+	server.AddDocument(5, "funny funny pet and nasty nasty rat"s, DocumentStatus::ACTUAL, { 1, 2 });
+	// добавились новые слова, дубликатом не является
+	server.AddDocument(6, "funny pet and not very nasty rat"s, DocumentStatus::ACTUAL, { 1, 2 });
+
+	DuplicateDetector detector;
+	const vector<int> removed = RemoveDuplicates(server, detector);
+	ASSERT_EQUAL_HINT(removed.size(), 3, "Wrong amount of duplicates");
+	ASSERT_HINT(removed == vector<int>({ 3, 4, 5 }), "Wrong duplicates are removed");
+	ASSERT_EQUAL_HINT(server.GetDocumentCount(), 3, "Duplicates are not removed from the server");
+
+	// повторный проход проверяет только новые документы
+	server.AddDocument(0, "rat nasty pet funny"s, DocumentStatus::ACTUAL, { 1 });
+	server.AddDocument(9, "not very nasty rat and funny pet"s, DocumentStatus::ACTUAL, { 1 });
+	server.AddDocument(10, "curly hair"s, DocumentStatus::ACTUAL, { 1 });
+	ASSERT_HINT(RemoveDuplicates(server, detector) == vector<int>({ 1, 9 }),
+	    "Incremental pass must keep the lowest id among old and new documents");
+	ASSERT_EQUAL_HINT(server.GetDocumentCount(), 4, "Duplicates are not removed from the server");
+
+	// удалённый оригинал уступает место новому документу
+	server.RemoveDocument(10);
+	server.AddDocument(11, "hair curly"s, DocumentStatus::ACTUAL, { 1 });
+	ASSERT_HINT(detector.RemoveNewDuplicates(server).empty(), "Removed document is still treated as original");
+	server.AddDocument(12, "curly hair"s, DocumentStatus::ACTUAL, { 1 });
+	ASSERT_HINT(detector.RemoveNewDuplicates(server) == vector<int>({ 12 }), "Duplicate of new original is not found");
+
+	// полный проход без детектора ничего не печатает и возвращает удалённые id
+	ostringstream output;
+	streambuf* const cout_buffer = cout.rdbuf(output.rdbuf());
+	server.AddDocument(13, "hair curly"s, DocumentStatus::ACTUAL, { 1 });
+	const vector<int> full_pass_removed = RemoveDuplicates(server);
+	cout.rdbuf(cout_buffer);
+	ASSERT_HINT(full_pass_removed == vector<int>({ 13 }), "Full pass doesn't find the duplicate");
+	ASSERT_HINT(output.str().empty(), "Removing duplicates writes to cout");
+	ASSERT_HINT(RemoveDuplicates(server).empty(), "Full pass found duplicates in a clean server");
+}
+
+//Сервер, загруженный из снимка, ищет так же, как исходный, и продолжает принимать изменения. Повреждённый снимок не загружается.
+void TestSaveAndLoadSnapshot(){
+
+	const string path = (filesystem::temp_directory_path() / "search_server_test.snapshot"s).string();
+
+	SearchServer server;
+	server.SetStopWords("and with"s);
+	server.AddDocument(5, "funny pet and nasty rat"s, DocumentStatus::ACTUAL, { 7, 2, 7 });
+	server.AddDocument(1, "funny pet with curly hair"s, DocumentStatus::BANNED, { 1, 2 });
+	server.AddDocument(3, "nasty rat rat with curly tail"s, DocumentStatus::ACTUAL, { -3 });
+	server.Save(path);
+
+	{
+	    SearchServer loaded = SearchServer::Load(path);
+	    ASSERT_EQUAL_HINT(loaded.GetDocumentCount(), 3, "Documents are lost in snapshot");
+	    for (const string& query : { "nasty rat"s, "funny -tail"s, "curly hair and pet"s, "with"s }) {
+	        for (const DocumentStatus status : { DocumentStatus::ACTUAL, DocumentStatus::BANNED }) {
+	            const auto expected = server.FindTopDocuments(query, status);
+	            const auto actual = loaded.FindTopDocuments(query, status);
+	            ASSERT_SAME_DOCUMENTS(actual, expected, "Loaded server finds other documents");
+	        }
+	    }
+	    const auto [matched_words, status] = loaded.MatchDocument("curly hair -rat"s, 1);
+	    ASSERT_EQUAL_HINT(matched_words.size(), 2, "Loaded server matches other words");
+	    ASSERT_HINT(status == DocumentStatus::BANNED, "Status is lost in snapshot");
+	    ASSERT_HINT(loaded.GetWordFrequencies(3) == server.GetWordFrequencies(3), "Forward index is lost in snapshot");
+
+	    loaded.AddDocument(7, "rat with tail"s, DocumentStatus::ACTUAL, { 1 });
+	    loaded.RemoveDocument(5);
+	    ASSERT_EQUAL_HINT(loaded.FindTopDocuments("rat"s).size(), 2, "Loaded server can't be changed");
+	    ASSERT_HINT(loaded.FindTopDocuments("and"s).empty(), "Stop words are lost in snapshot");
+	}
+
+	{
+	    fstream file(path, ios::in | ios::out | ios::binary);
+	    file.seekp(-3, ios::end);
+	    file.put('#');
+	}
+	bool is_rejected = false;
+	try {
+	    SearchServer::Load(path);
+	} catch (const runtime_error&) {
+	    is_rejected = true;
+	}
+	ASSERT_HINT(is_rejected, "Corrupted snapshot is loaded");
+	filesystem::remove(path);
+}
+
+//Потоковая загрузка документов строит тот же индекс, что и последовательные вызовы AddDocument.
+void TestBulkIngest(){
+
+	const vector<string> texts = { "funny pet and nasty rat"s, "funny pet with curly hair"s, "nasty rat rat"s,
+	                               "curly tail"s, "pet and pet"s, "and"s };
+	const vector<DocumentStatus> statuses = { DocumentStatus::ACTUAL, DocumentStatus::BANNED, DocumentStatus::ACTUAL,
+	                                          DocumentStatus::IRRELEVANT, DocumentStatus::ACTUAL, DocumentStatus::REMOVED };
+	const vector<string> status_names = { "ACTUAL"s, "BANNED"s, "ACTUAL"s, "IRRELEVANT"s, "ACTUAL"s, "REMOVED"s };
+
+	SearchServer expected;
+	expected.SetStopWords("and with"s);
+	stringstream records;
+	for (int i = 0; i < 300; ++i) {
+	    const int document_id = (i * 37) % 300;
+	    const size_t kind = i % texts.size();
+	    const vector<int> ratings = { i % 7, -(i % 3), 5 };
+	    expected.AddDocument(document_id, texts[kind], statuses[kind], ratings);
+	    records << document_id << '\t' << status_names[kind] << '\t' << ratings[0] << ' ' << ratings[1] << ' ' << ratings[2]
+	            << '\t' << texts[kind] << '\n';
+	    if (i % 50 == 0) {
+	        records << '\n';
+	    }
+	}
+
+	SearchServer server;
+	server.SetStopWords("and with"s);
+	const IngestStats stats = server.AddDocuments(records, 16);
+	ASSERT_EQUAL_HINT(stats.document_count, 300, "Bulk ingest lost records");
+	ASSERT_EQUAL_HINT(server.GetDocumentCount(), expected.GetDocumentCount(), "Bulk ingest lost documents");
+	for (const string& query : { "nasty rat"s, "funny -curly"s, "pet tail hair"s, "and"s }) {
+	    for (const DocumentStatus status : statuses) {
+	        const auto expected_documents = expected.FindTopDocuments(query, status, 1000);
+	        const auto documents = server.FindTopDocuments(query, status, 1000);
+	        ASSERT_EQUAL_HINT(documents.size(), expected_documents.size(), "Bulk ingest built a different index");
+	        for (size_t i = 0; i < documents.size(); ++i) {
+	            ASSERT_EQUAL_HINT(documents[i].id, expected_documents[i].id, "Bulk ingest built a different index");
+	            ASSERT_EQUAL_HINT(documents[i].relevance, expected_documents[i].relevance, "Bulk ingest computes other relevance");
+	            ASSERT_EQUAL_HINT(documents[i].rating, expected_documents[i].rating, "Bulk ingest computes other rating");
+	        }
+	    }
+	}
+	ASSERT_HINT(server.GetWordFrequencies(74) == expected.GetWordFrequencies(74), "Bulk ingest built a different forward index");
+
+	stringstream malformed("1\tACTUAL\t1\tcat\n2\tFRESH\t1\tdog\n"s);
+	bool is_rejected = false;
+	try {
+	    SearchServer().AddDocuments(malformed);
+	} catch (const invalid_argument&) {
+	    is_rejected = true;
+	}
+	ASSERT_HINT(is_rejected, "Malformed record is accepted");
+}
+
+//Страницы ссылаются на исходные результаты поиска, последняя страница может быть неполной.
+void TestPaginate(){
+
+	SearchServer server;
+	for (int document_id = 1; document_id <= 7; ++document_id) {
+	    server.AddDocument(document_id, "curly dog"s + string(document_id, ' ') + "tail"s, DocumentStatus::ACTUAL, { document_id });
+	}
+	const auto search_results = server.FindTopDocuments("curly dog"s, DocumentStatus::ACTUAL, 100);
+	const auto pages = Paginate(search_results, 3);
+
+	ASSERT_EQUAL_HINT(pages.size(), 3, "Wrong amount of pages");
+	vector<size_t> page_sizes;
+	for (const auto& page : pages) {
+	    page_sizes.push_back(page.size());
+	}
+	ASSERT_HINT(page_sizes == vector<size_t>({ 3, 3, 1 }), "Wrong page sizes");
+	ASSERT_EQUAL_HINT(&*pages.begin()->begin(), &search_results[0], "Page doesn't refer to the results");
+	ASSERT_EQUAL_HINT(&*(pages.end() - 1)->begin(), &search_results[6], "Page doesn't refer to the results");
+
+	ostringstream output;
+	output << *pages.begin();
+	const string printed_page = output.str();
+	ASSERT_EQUAL_HINT(count(printed_page.begin(), printed_page.end(), '{'), 3, "Page is printed incorrectly");
+
+	ASSERT_EQUAL_HINT(Paginate(vector<Document>(), 2).size(), 0, "Empty results must have no pages");
+	ASSERT_EQUAL_HINT(Paginate(search_results, 7).size(), 1, "Full page is split");
+
+	bool is_rejected = false;
+	try {
+	    Paginate(search_results, 0);
+	} catch (const invalid_argument&) {
+	    is_rejected = true;
+	}
+	ASSERT_HINT(is_rejected, "Zero page size is accepted");
+}
+
+//Очередь запросов считает запросы без результатов среди последних MINUTES_IN_DAY запросов.
+void TestRequestQueue(){
+
+	SearchServer server;
+	server.SetStopWords("and in at"s);
+	server.AddDocument(1, "curly cat curly tail"s, DocumentStatus::ACTUAL, { 7, 2, 7 });
+	server.AddDocument(2, "curly dog and fancy collar"s, DocumentStatus::ACTUAL, { 1, 2, 3 });
+	server.AddDocument(3, "big cat fancy collar "s, DocumentStatus::ACTUAL, { 1, 2, 8 });
+	server.AddDocument(4, "big dog sparrow Eugene"s, DocumentStatus::ACTUAL, { 1, 3, 2 });
+	server.AddDocument(5, "big dog sparrow Vasiliy"s, DocumentStatus::ACTUAL, { 1, 1, 1 });
+
+	RequestQueue request_queue(server);
+	for (int i = 0; i < 1439; ++i) {
+	    request_queue.AddFindRequest("empty request"s);
+	}
+	ASSERT_EQUAL_HINT(request_queue.GetNoResultRequests(), 1439, "Empty requests are not counted");
+	request_queue.AddFindRequest("curly dog"s);
+	ASSERT_EQUAL_HINT(request_queue.GetNoResultRequests(), 1439, "Request with results is counted as empty");
+	// новые сутки, первый запрос удален, 1438 запросов с нулевым результатом
+	request_queue.AddFindRequest("big collar"s);
+	ASSERT_EQUAL_HINT(request_queue.GetNoResultRequests(), 1438, "Old requests don't leave the window");
+	// первый запрос удален, 1437 запросов с нулевым результатом
+	request_queue.AddFindRequest("sparrow"s, [](int, DocumentStatus, int rating) { return rating > 1; });
+	ASSERT_EQUAL_HINT(request_queue.GetNoResultRequests(), 1437, "Old requests don't leave the window");
+	request_queue.AddFindRequest("sparrow"s, DocumentStatus::BANNED);
+	ASSERT_EQUAL_HINT(request_queue.GetNoResultRequests(), 1437, "Status filter is not forwarded");
+}
+
+//Кэш результатов отвечает на равнозначные запросы, сбрасывается при изменении индекса и не превышает лимит памяти.
+void TestQueryResultCache(){
+
+	SearchServer server;
+	server.SetStopWords("in the"s);
+	server.AddDocument(1, "cat in the city"s, DocumentStatus::ACTUAL, { 1 });
+	server.AddDocument(2, "dog in the park"s, DocumentStatus::ACTUAL, { 2 });
+	server.AddDocument(3, "cat and dog"s, DocumentStatus::BANNED, { 3 });
+
+	const auto uncached = server.FindTopDocuments("cat city -park"s);
+	server.EnableQueryCache(1 << 20);
+	server.FindTopDocuments("cat city -park"s);
+	const auto cached = server.FindTopDocuments("city  cat the -park city"s);
+	{
+	    const auto stats = server.GetQueryCacheStats();
+	    ASSERT_EQUAL_HINT(stats.miss_count, 1, "Equivalent queries are not cached together");
+	    ASSERT_EQUAL_HINT(stats.hit_count, 1, "Equivalent queries are not cached together");
+	    ASSERT_EQUAL_HINT(cached.size(), uncached.size(), "Cached results differ");
+	    ASSERT_EQUAL_HINT(cached[0].id, uncached[0].id, "Cached results differ");
+	    ASSERT_EQUAL_HINT(cached[0].relevance, uncached[0].relevance, "Cached results differ");
+	}
+
+	server.FindTopDocuments("cat city -park"s, DocumentStatus::BANNED);
+	server.FindTopDocuments("cat city -park"s, DocumentStatus::ACTUAL, 1);
+	ASSERT_EQUAL_HINT(server.GetQueryCacheStats().miss_count, 3, "Status and result count must be part of the key");
+
+	server.AddDocument(4, "city of cats"s, DocumentStatus::ACTUAL, { 4 });
+	ASSERT_EQUAL_HINT(server.FindTopDocuments("cat city -park"s).size(), 2, "Cache is not invalidated after AddDocument");
+	server.RemoveDocument(4);
+	ASSERT_EQUAL_HINT(server.FindTopDocuments("cat city -park"s).size(), 1, "Cache is not invalidated after RemoveDocument");
+	ASSERT_EQUAL_HINT(server.GetQueryCacheStats().invalidation_count, 2, "Invalidations are not counted");
+
+	server.EnableQueryCache(1000);
+	for (int i = 0; i < 100; ++i) {
+	    server.FindTopDocuments("cat word"s + to_string(i));
+	}
+	const auto stats = server.GetQueryCacheStats();
+	ASSERT_HINT(stats.byte_count <= 1000, "Cache exceeds memory limit");
+	ASSERT_HINT(stats.eviction_count > 0 && stats.entry_count > 0, "Least recently used entries are not evicted");
+	ASSERT_EQUAL_HINT(stats.eviction_count + stats.entry_count, 100, "Evictions are not counted");
+
+	server.DisableQueryCache();
+	ASSERT_EQUAL_HINT(server.GetQueryCacheStats().hit_count, 0, "Disabled cache has statistics");
+}
+
+//Сохранённое IDF слова обновляется при изменении числа документов или документной частоты слова.
+void TestInverseDocumentFreqUpdate(){
+
+	SearchServer server;
+	server.AddDocument(1, "cat city"s, DocumentStatus::ACTUAL, { 1 });
+	server.AddDocument(2, "dog park"s, DocumentStatus::ACTUAL, { 1 });
+	ASSERT_EQUAL_HINT(server.FindTopDocuments("cat"s)[0].relevance, 0.5 * log(2.0), "IDF is computed incorrectly");
+
+	server.AddDocument(3, "dog city"s, DocumentStatus::ACTUAL, { 1 });
+	ASSERT_EQUAL_HINT(server.FindTopDocuments("cat"s)[0].relevance, 0.5 * log(3.0), "IDF is not updated on new document");
+
+	// число документов не меняется, меняется документная частота слова
+	server.RemoveDocument(3);
+	server.AddDocument(3, "cat park"s, DocumentStatus::ACTUAL, { 1 });
+	ASSERT_EQUAL_HINT(server.FindTopDocuments("cat"s)[0].relevance, 0.5 * log(3.0 / 2.0),
+	    "IDF is not updated on new document frequency");
+	ASSERT_EQUAL_HINT(server.FindTopDocuments(execution::par, "cat"s)[0].relevance, 0.5 * log(3.0 / 2.0),
+	    "Parallel search uses stale IDF");
+
+	stringstream records("4\tACTUAL\t1\tbird\n"s);
+	server.AddDocuments(records);
+	ASSERT_EQUAL_HINT(server.FindTopDocuments("cat"s)[0].relevance, 0.5 * log(4.0 / 2.0), "IDF is not updated after bulk ingest");
+}
+
+//Документ, удалённый и добавленный заново, получает новые статус и рейтинг, а предикат видит настоящий id.
+void TestDocumentMetadataAfterRemoval(){
+
+	const string path = (filesystem::temp_directory_path() / "search_server_metadata_test.snapshot"s).string();
+
+	SearchServer server;
+	server.AddDocument(7, "cat in the city"s, DocumentStatus::ACTUAL, { 1 });
+	server.AddDocument(3, "dog in the city"s, DocumentStatus::BANNED, { 2 });
+	server.AddDocument(5, "cat in the park"s, DocumentStatus::ACTUAL, { 3 });
+	server.RemoveDocument(7);
+	server.AddDocument(7, "cat on the roof"s, DocumentStatus::IRRELEVANT, { 4 });
+	server.Save(path);
+	const SearchServer loaded = SearchServer::Load(path);
+	filesystem::remove(path);
+
+	for (const SearchServer* current : { static_cast<const SearchServer*>(&server), &loaded }) {
+	    vector<int> seen_ids;
+	    const auto result = current->FindTopDocuments("cat dog"s, [&seen_ids](int document_id, DocumentStatus status, int) {
+	        seen_ids.push_back(document_id);
+	        return status != DocumentStatus::BANNED;
+	    });
+	    sort(seen_ids.begin(), seen_ids.end());
+	    ASSERT_HINT((seen_ids == vector<int>{ 3, 5, 7 }), "Predicate gets wrong document ids");
+	    ASSERT_EQUAL_HINT(result.size(), 2, "Removed document is still found");
+	    for (const Document& document : result) {
+	        ASSERT_EQUAL_HINT(document.rating, document.id == 7 ? 4 : 3, "Re-added document keeps old rating");
+	    }
+	    ASSERT_HINT(current->FindTopDocuments("cat"s, DocumentStatus::IRRELEVANT).size() == 1, "Re-added document keeps old status");
+	    ASSERT_HINT(get<1>(current->MatchDocument("roof"s, 7)) == DocumentStatus::IRRELEVANT, "Re-added document keeps old status");
+	    ASSERT_HINT(current->FindTopDocuments(execution::par, "city"s, DocumentStatus::BANNED)[0].id == 3, "Parallel search reads wrong metadata");
+	    ASSERT_EQUAL_HINT(current->GetDocumentCount(), 3, "Removed ordinals are counted");
+	}
+	ASSERT_HINT((vector<int>(loaded.begin(), loaded.end()) == vector<int>{ 3, 5, 7 }), "Document ids are lost in snapshot");
+}
+
+//Все ядра подсчёта релевантности дают одинаковый результат, совпадающий с прямым подсчётом по формуле TF-IDF.
+void TestScoringKernels(){
+
+	mt19937 generator(7);
+	uniform_int_distribution<int> word_distribution(0, 15);
+	SearchServer server;
+	for (int document_id = 0; document_id < 1000; ++document_id) {
+	    string document;
+	    for (int i = 0; i < 6; ++i) {
+	        document += "w"s + to_string(word_distribution(generator)) + " "s;
+	    }
+	    server.AddDocument(document_id * 3, document, document_id % 4 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL, { document_id % 7 });
+	}
+	server.RemoveDocument(300);
+	// редкие слова считаются без плотного буфера
+	server.AddDocument(5000, "rare w1 w2"s, DocumentStatus::ACTUAL, { 1 });
+	server.AddDocument(5002, "rare w3"s, DocumentStatus::ACTUAL, { 1 });
+
+	const vector<string> queries = { "w1 w2 w3"s, "w0 w5 -w6"s, "w7 -w8 -w9 w10 w11"s, "w12"s, "w13 -w13"s, "rare"s, "rare -w3"s };
+	const auto even_predicate = [](int document_id, DocumentStatus, int) { return document_id % 2 == 0; };
+	for (const string& query : queries) {
+	    // прямой подсчёт по прямому индексу
+	    vector<string_view> plus_words;
+	    vector<string_view> minus_words;
+	    for (const string_view word : SplitIntoWords(query)) {
+	        (word[0] == '-' ? minus_words : plus_words).push_back(word[0] == '-' ? word.substr(1) : word);
+	    }
+	    vector<Document> expected;
+	    for (const int document_id : server) {
+	        const map<string_view, double>& word_freqs = server.GetWordFrequencies(document_id);
+	        if (any_of(minus_words.begin(), minus_words.end(), [&](string_view word) { return word_freqs.count(word) > 0; })) {
+	            continue;
+	        }
+	        double relevance = 0.0;
+	        bool matched = false;
+	        for (const string_view word : plus_words) {
+	            if (word_freqs.count(word) == 0) {
+	                continue;
+	            }
+	            const auto document_freq = count_if(server.begin(), server.end(),
+	                [&](int id) { return server.GetWordFrequencies(id).count(word) > 0; });
+	            relevance += word_freqs.at(word) * log(server.GetDocumentCount() * 1.0 / document_freq);
+	            matched = true;
+	        }
+	        if (matched && document_id % 2 == 0) {
+	            expected.push_back({ document_id, relevance, 0 });
+	        }
+	    }
+	    sort(expected.begin(), expected.end(), [](const Document& lhs, const Document& rhs) { return lhs.relevance > rhs.relevance; });
+
+	    server.SetScoringKernel(ScoringKernel::SCALAR);
+	    const auto scalar_result = server.FindTopDocuments(query, even_predicate, 1000);
+	    ASSERT_EQUAL_HINT(scalar_result.size(), expected.size(), "Scalar kernel finds other documents");
+	    for (size_t i = 0; i < expected.size(); ++i) {
+	        ASSERT_HINT(abs(scalar_result[i].relevance - expected[i].relevance) < RELEVANCE_EPSILON, "Scalar kernel computes wrong relevance");
+	    }
+	    const auto scalar_top = server.FindTopDocuments(query);
+	    for (const ScoringKernel kernel : { ScoringKernel::SSE2, ScoringKernel::AVX2 }) {
+	        if (!SearchServer::IsScoringKernelSupported(kernel)) {
+	            continue;
+	        }
+	        server.SetScoringKernel(kernel);
+	        for (const auto& result : { server.FindTopDocuments(query, even_predicate, 1000), server.FindTopDocuments(execution::par, query, even_predicate, 1000) }) {
+	            ASSERT_EQUAL_HINT(result.size(), scalar_result.size(), "SIMD kernel finds other documents");
+	            for (size_t i = 0; i < result.size(); ++i) {
+	                ASSERT_EQUAL_HINT(result[i].id, scalar_result[i].id, "SIMD kernel finds other documents");
+	                ASSERT_EQUAL_HINT(result[i].relevance, scalar_result[i].relevance, "SIMD kernel computes other relevance");
+	            }
+	        }
+	        const auto top = server.FindTopDocuments(query);
+	        ASSERT_EQUAL_HINT(top.size(), scalar_top.size(), "SIMD kernel gives other top documents");
+	        for (size_t i = 0; i < top.size(); ++i) {
+	            ASSERT_EQUAL_HINT(top[i].id, scalar_top[i].id, "SIMD kernel gives other top documents");
+	        }
+	    }
+	}
+	server.SetScoringKernel(SearchServer::GetBestScoringKernel());
+}
+
+//Сжатые списки словопозиций занимают меньше памяти и дают те же результаты поиска и сопоставления.
+void TestCompressedPostings(){
+
+	const string path = (filesystem::temp_directory_path() / "search_server_compressed_test.snapshot"s).string();
+
+	const vector<string> documents = GenerateTestDocuments(11, 2000, 30, 3, 9);
+	SearchServer plain;
+	SearchServer compressed;
+	for (int document_id = 0; document_id < 2000; ++document_id) {
+	    // разрывы в номерах документов дают многобайтовые разности
+	    const int id = document_id < 1000 ? document_id : document_id * 1000;
+	    plain.AddDocument(id, documents[document_id], static_cast<DocumentStatus>(document_id % 3), { document_id % 11 });
+	    compressed.AddDocument(id, documents[document_id], static_cast<DocumentStatus>(document_id % 3), { document_id % 11 });
+	}
+	compressed.CompressPostings();
+	const auto plain_stats = plain.GetPostingMemoryStats();
+	const auto compressed_stats = compressed.GetPostingMemoryStats();
+	ASSERT_EQUAL_HINT(compressed_stats.posting_count, plain_stats.posting_count, "Postings are lost in compression");
+	ASSERT_HINT(compressed_stats.byte_count * 3 < plain_stats.byte_count, "Postings are not compressed");
+
+	const auto check_same = [&](const SearchServer& expected_server, const SearchServer& actual_server) {
+	    const auto even_predicate = [](int, DocumentStatus, int rating) { return rating % 2 == 0; };
+	    for (const string& query : { "w0 w1"s, "w2 -w3"s, "w5 w7 -w0 -w1"s, "w29 w30"s, "w13 -w0"s, "w1 w4 w9 w16"s }) {
+	        for (const auto& [expected, actual] : {
+	                pair{ expected_server.FindTopDocuments(query, DocumentStatus::ACTUAL, 10000), actual_server.FindTopDocuments(query, DocumentStatus::ACTUAL, 10000) },
+	                pair{ expected_server.FindTopDocuments(query, even_predicate, 10000), actual_server.FindTopDocuments(query, even_predicate, 10000) },
+	                pair{ expected_server.FindTopDocuments(execution::par, query, DocumentStatus::BANNED, 10000),
+	                      actual_server.FindTopDocuments(execution::par, query, DocumentStatus::BANNED, 10000) } }) {
+	            ASSERT_SAME_DOCUMENTS(actual, expected, "Compressed postings find other documents");
+	        }
+	    }
+	    for (const int document_id : expected_server) {
+	        ASSERT_HINT(get<0>(actual_server.MatchDocument("w0 w1 w2 w3 -w30"s, document_id))
+	                    == get<0>(expected_server.MatchDocument("w0 w1 w2 w3 -w30"s, document_id)),
+	            "Compressed postings match other words");
+	    }
+	};
+	check_same(plain, compressed);
+
+	compressed.Save(path);
+	check_same(plain, SearchServer::Load(path));
+	filesystem::remove(path);
+
+	// изменённые списки распаковываются
+	for (SearchServer* server : { &plain, &compressed }) {
+	    server->RemoveDocument(500);
+	    server->RemoveDocument(1500000);
+	    server->AddDocument(5000000, "w0 w1 w2 w30"s, DocumentStatus::ACTUAL, { 2 });
+	}
+	check_same(plain, compressed);
+}
+
+//Отсечение документов, не попадающих в топ, не меняет результат поиска и уменьшает число оценённых документов.
+void TestDynamicPruning(){
+
+	const vector<string> documents = GenerateTestDocuments(13, 3000, 40, 4, 7);
+	SearchServer server;
+	for (int document_id = 0; document_id < 3000; ++document_id) {
+	    // уникальный рейтинг делает порядок результатов однозначным
+	    server.AddDocument(document_id, documents[document_id], static_cast<DocumentStatus>(document_id % 3), { document_id });
+	}
+
+	const vector<string> queries = { "w0 w1"s, "w0 w30 w35"s, "w1 w2 w3 -w4"s, "w39 w38 w0 w1 w2"s, "w5 w5 w6"s, "w25 -w0 w2 w3"s, "w100 w0"s };
+	const auto odd_predicate = [](int document_id, DocumentStatus, int) { return document_id % 2 == 1; };
+	const auto check_same = [&] {
+	    for (const string& query : queries) {
+	        for (const size_t top_count : { size_t{1}, size_t{5}, size_t{50} }) {
+	            server.SetDynamicPruning(false);
+	            const auto expected_status = server.FindTopDocuments(query, DocumentStatus::IRRELEVANT, top_count);
+	            const auto expected_predicate = server.FindTopDocuments(query, odd_predicate, top_count);
+	            server.SetDynamicPruning(true);
+	            for (const auto& [expected, actual] : {
+	                    pair{ expected_status, server.FindTopDocuments(query, DocumentStatus::IRRELEVANT, top_count) },
+	                    pair{ expected_predicate, server.FindTopDocuments(query, odd_predicate, top_count) } }) {
+	                ASSERT_SAME_DOCUMENTS(actual, expected, "Pruning changes the results");
+	            }
+	        }
+	    }
+	};
+
+	const auto stats_before = server.GetScoringStats();
+	server.SetDynamicPruning(false);
+	server.FindTopDocuments("w0 w30 w35"s);
+	const auto stats_exhaustive = server.GetScoringStats();
+	server.SetDynamicPruning(true);
+	server.FindTopDocuments("w0 w30 w35"s);
+	const auto stats_pruned = server.GetScoringStats();
+	ASSERT_EQUAL_HINT(stats_pruned.query_count - stats_before.query_count, 2, "Queries are not counted");
+	ASSERT_HINT(stats_pruned.scored_document_count - stats_exhaustive.scored_document_count
+	            < stats_exhaustive.scored_document_count - stats_before.scored_document_count,
+	    "Pruning doesn't skip documents");
+
+	check_same();
+	server.CompressPostings();
+	check_same();
+	// оценки сверху пересчитываются после изменения списков
+	server.RemoveDocument(7);
+	server.AddDocument(5000, "w35 w35 w35 w0"s, DocumentStatus::ACTUAL, { 5000 });
+	check_same();
+
+	// пустой топ не запускает отсечение
+	ASSERT_HINT(server.FindTopDocuments("w0 w30 w35"s, DocumentStatus::ACTUAL, 0).empty(), "Empty top has documents");
+	ASSERT_HINT(server.FindTopDocuments("w0 w30 w35 -w1"s, odd_predicate, 0).empty(), "Empty top has documents");
+	ASSERT_HINT(server.FindTopDocuments(execution::par, "w0 w30 w35"s, DocumentStatus::ACTUAL, 0).empty(), "Empty top has documents");
+}
+//Сегментированный сервер находит то же, что и обычный, но только опубликованные документы.
+void TestConcurrentSearchServer(){
+
+	ConcurrentSearchServer concurrent("w0 w1"s);
+	SearchServer plain;
+	plain.SetStopWords("w0 w1"s);
+	const int document_count = static_cast<int>(CONCURRENT_SEGMENT_SIZE * 2 + 100);
+	const vector<string> documents = GenerateTestDocuments(17, document_count, 50, 6);
+	for (int document_id = 0; document_id < document_count; ++document_id) {
+	    concurrent.AddDocument(document_id, documents[document_id], static_cast<DocumentStatus>(document_id % 2), { document_id });
+	    plain.AddDocument(document_id, documents[document_id], static_cast<DocumentStatus>(document_id % 2), { document_id });
+	}
+	ASSERT_EQUAL_HINT(concurrent.GetSegmentCount(), 2, "Full segments are not published");
+	ASSERT_EQUAL_HINT(concurrent.GetDocumentCount(), static_cast<int>(CONCURRENT_SEGMENT_SIZE * 2), "Pending documents are visible");
+	concurrent.Publish();
+	ASSERT_EQUAL_HINT(concurrent.GetSegmentCount(), 3, "Pending segment is not published");
+	ASSERT_EQUAL_HINT(concurrent.GetDocumentCount(), document_count, "Published documents are lost");
+
+	const auto even_predicate = [](int document_id, DocumentStatus, int) { return document_id % 4 == 0; };
+	for (const string& query : { "w2 w3"s, "w0 w5 -w4"s, "w40 w2 w3 w1"s, "w7"s }) {
+	    for (const auto& [expected, actual] : {
+	            pair{ plain.FindTopDocuments(query, DocumentStatus::IRRELEVANT), concurrent.FindTopDocuments(query, DocumentStatus::IRRELEVANT) },
+	            pair{ plain.FindTopDocuments(query, even_predicate, 20), concurrent.FindTopDocuments(query, even_predicate, 20) } }) {
+	        ASSERT_SAME_DOCUMENTS(actual, expected, "Segments find other documents");
+	    }
+	}
+
+	bool is_rejected = false;
+	try {
+	    concurrent.AddDocument(5, "w2"s, DocumentStatus::ACTUAL, { 1 });
+	} catch (const invalid_argument&) {
+	    is_rejected = true;
+	}
+	ASSERT_HINT(is_rejected, "Document id is added twice");
+	ASSERT_HINT(ConcurrentSearchServer().FindTopDocuments("w2"s).empty(), "Empty server finds documents");
+}
+
+//Читатели не блокируются писателем и видят только целиком опубликованные сегменты.
+void TestConcurrentReadsDuringIngest(){
+
+	ConcurrentSearchServer server;
+	const int document_count = 20000;
+	atomic<bool> is_writing{true};
+	atomic<int> failure_count{0};
+	atomic<int> query_count{0};
+
+	thread writer([&] {
+	    for (int document_id = 0; document_id < document_count; ++document_id) {
+	        server.AddDocument(document_id, "cat w"s + to_string(document_id % 100), DocumentStatus::ACTUAL, { document_id });
+	        if (document_id % 500 == 0) {
+	            server.Publish();
+	        }
+	    }
+	    server.Publish();
+	    is_writing = false;
+	});
+	vector<thread> readers;
+	for (int reader = 0; reader < 3; ++reader) {
+	    readers.emplace_back([&, reader] {
+	        int previous_count = 0;
+	        do {
+	            const int count_before = server.GetDocumentCount();
+	            // документы добавляются по порядку id, поэтому видны ровно первые count документов
+	            const auto result = server.FindTopDocuments("cat w"s + to_string(reader), DocumentStatus::ACTUAL, 10);
+	            const int count_after = server.GetDocumentCount();
+	            if (count_before < previous_count || count_after < count_before) {
+	                ++failure_count;
+	            }
+	            for (const Document& document : result) {
+	                if (document.id >= count_after || document.rating != document.id) {
+	                    ++failure_count;
+	                }
+	            }
+	            if (count_before > reader + 1000 && result.empty()) {
+	                ++failure_count;
+	            }
+	            previous_count = count_before;
+	            ++query_count;
+	        } while (is_writing);
+	    });
+	}
+	writer.join();
+	for (thread& reader : readers) {
+	    reader.join();
+	}
+	ASSERT_EQUAL_HINT(failure_count.load(), 0, "Readers see inconsistent snapshots");
+	ASSERT_HINT(query_count > 0, "Readers didn't run");
+	ASSERT_EQUAL_HINT(server.GetDocumentCount(), document_count, "Documents are lost");
+}
+
+// Читатели не ждут, даже когда заняты все ячейки таблицы, а заменённый объект удаляется, как только
+// его отпускает последний читатель, без новой публикации
+void TestEpochPointerReclamation(){
+
+	struct Counted {
+	    explicit Counted(atomic<int>& alive_count)
+	        : alive_count(alive_count) {
+	        ++alive_count;
+	    }
+
+	    ~Counted() {
+	        --alive_count;
+	    }
+
+	    atomic<int>& alive_count;
+	};
+
+	atomic<int> alive_count{0};
+	EpochPointer<Counted> pointer(make_unique<const Counted>(alive_count));
+	const Counted* first = &pointer.GetCurrent();
+	vector<EpochPointer<Counted>::Guard> guards;
+	for (size_t i = 0; i < EpochPointer<Counted>::READER_SLOT_COUNT * 3; ++i) {
+	    guards.push_back(pointer.Pin());
+	}
+	ASSERT_HINT(all_of(guards.begin(), guards.end(), [first](const auto& guard) { return guard.get() == first; }), "Reader sees other object");
+
+	pointer.Publish(make_unique<const Counted>(alive_count));
+	ASSERT_EQUAL_HINT(alive_count.load(), 2, "Pinned object is deleted");
+	guards.pop_back();
+	ASSERT_EQUAL_HINT(alive_count.load(), 2, "Object is deleted while still pinned");
+	{
+	    const auto guard = pointer.Pin();
+	    ASSERT_HINT(guard.get() != first, "Reader sees replaced object");
+	}
+	guards.clear();
+	ASSERT_EQUAL_HINT(alive_count.load(), 1, "Replaced object outlives its last reader");
+	ASSERT_EQUAL(pointer.Reclaim(), 0u);
+}
+
+//Удалённые документы скрыты до слияния сегментов и исчезают после него, результаты совпадают с обычным сервером.
+void TestSegmentMergeAndTombstones(){
+
+	ConcurrentSearchServer concurrent("w0"s);
+	SearchServer plain;
+	plain.SetStopWords("w0"s);
+	const int document_count = static_cast<int>(CONCURRENT_SEGMENT_SIZE * SEGMENT_MERGE_FACTOR + 1000);
+	// последний документ добавляется под уже удалённым id
+	const vector<string> documents = GenerateTestDocuments(19, document_count + 1, 60, 5);
+	size_t added_count = 0;
+	const auto add_document = [&](int document_id) {
+	    const string& document = documents[added_count++];
+	    concurrent.AddDocument(document_id, document, static_cast<DocumentStatus>(document_id % 2), { document_id });
+	    plain.AddDocument(document_id, document, static_cast<DocumentStatus>(document_id % 2), { document_id });
+	};
+	const auto remove_document = [&](int document_id) {
+	    concurrent.RemoveDocument(document_id);
+	    plain.RemoveDocument(document_id);
+	};
+	const auto check_same = [&] {
+	    ASSERT_EQUAL_HINT(concurrent.GetDocumentCount(), plain.GetDocumentCount(), "Removed documents are counted");
+	    for (const string& query : { "w2 w3"s, "w1 w5 -w4"s, "w50 w2 w3 w0"s, "w7"s, "w1 w2 w3 w4 w5 w6"s }) {
+	        const auto expected = plain.FindTopDocuments(query, DocumentStatus::IRRELEVANT, 30);
+	        const auto actual = concurrent.FindTopDocuments(query, DocumentStatus::IRRELEVANT, 30);
+	        ASSERT_SAME_DOCUMENTS(actual, expected, "Segments find other documents");
+	    }
+	    for (const int document_id : { 1, 777, 5000, 9999, 17003 }) {
+	        const auto [expected_words, expected_status] = plain.MatchDocument("w1 w2 w3 w4 w5"s, document_id);
+	        const auto [actual_words, actual_status] = concurrent.MatchDocument("w1 w2 w3 w4 w5"s, document_id);
+	        ASSERT_HINT(vector<string>(expected_words.begin(), expected_words.end()) == actual_words, "Segments match other words");
+	        ASSERT_HINT(expected_status == actual_status, "Segments match other status");
+	    }
+	};
+
+	for (int document_id = 0; document_id < document_count; ++document_id) {
+	    add_document(document_id);
+	    // удаления из опубликованных сегментов и из ещё не опубликованного
+	    if (document_id % 97 == 0 && document_id > 0) {
+	        remove_document(document_id / 2);
+	        remove_document(document_id - 1);
+	    }
+	}
+	// удалённый id можно добавить снова
+	remove_document(777);
+	add_document(777);
+	concurrent.Publish();
+	check_same();
+
+	concurrent.WaitForMerges();
+	ASSERT_HINT(concurrent.GetSegmentCount() < SEGMENT_MERGE_FACTOR, "Segments of one tier are not merged");
+	check_same();
+	remove_document(5);
+	remove_document(17001);
+	check_same();
+
+	bool is_rejected = false;
+	try {
+	    concurrent.MatchDocument("w1"s, 5);
+	} catch (const out_of_range&) {
+	    is_rejected = true;
+	}
+	ASSERT_HINT(is_rejected, "Removed document is matched");
+}
+
+/*
+Разместите код остальных тестов здесь
+*/
+
+// Параллельный MatchDocument совпадает с последовательным, повторы слов запроса не повторяются в ответе,
+// а найденные слова указывают в индекс, а не в текст запроса
+void TestParallelMatchDocument(){
+
+	SearchServer server;
+	server.SetStopWords("and in"s);
+	const vector<string> words = { "cat", "dog", "bird", "city", "park", "and", "in", "tail", "wing" };
+	mt19937 generator(21);
+	for (int document_id = 0; document_id < 200; ++document_id) {
+	    string content;
+	    for (int i = 0; i < 6; ++i) {
+	        content += words[generator() % words.size()] + " "s;
+	    }
+	    server.AddDocument(document_id, content, static_cast<DocumentStatus>(document_id % 4), { 1 });
+	}
+
+	for (const string& query : { "cat dog cat"s, "bird -city"s, "tail wing park -dog -in -dog"s, "and in"s, "unknown cat"s, "-cat"s }) {
+	    for (int document_id = 0; document_id < 200; ++document_id) {
+	        const auto [expected_words, expected_status] = server.MatchDocument(query, document_id);
+	        const auto [actual_words, actual_status] = server.MatchDocument(execution::par, query, document_id);
+	        ASSERT_HINT(actual_words == expected_words, "Parallel MatchDocument matches other words");
+	        ASSERT_HINT(actual_status == expected_status, "Parallel MatchDocument returns other status");
+	        ASSERT_HINT(is_sorted(expected_words.begin(), expected_words.end())
+	                    && adjacent_find(expected_words.begin(), expected_words.end()) == expected_words.end(),
+	                    "Matched words are not sorted and unique");
+	        for (const string_view word : actual_words) {
+	            ASSERT_HINT(word.data() < query.data() || word.data() >= query.data() + query.size(),
+	                        "Matched word points into the query");
+	        }
+	    }
+	}
+
+	server.AddDocument(500, "cat dog bird"s, DocumentStatus::ACTUAL, { 1 });
+	const auto [matched_words, unused] = server.MatchDocument(execution::par, "bird cat bird -wing"s, 500);
+	ASSERT_HINT((matched_words == vector<string_view>{ "bird"sv, "cat"sv }), "Parallel MatchDocument doesn't match words");
+	ASSERT_HINT(get<0>(server.MatchDocument(execution::par, "bird -dog"s, 500)).empty(), "Parallel MatchDocument ignores minus words");
+	ASSERT_HINT(get<0>(server.MatchDocument(execution::seq, "cat"s, 500)).size() == 1, "Sequenced policy doesn't match words");
+}
+
+#ifdef SEARCH_SERVER_HAS_SOCKETS
+// Шарды в отдельных процессах находят те же документы с той же релевантностью, что и один SearchServer,
+// а их исключения доходят до координатора
+void TestShardedSearchServer(){
+
+	const vector<string> documents = GenerateTestDocuments(22, 600, 40, 6);
+	ShardedSearchServer sharded(3, "w0"s);
+	SearchServer plain;
+	plain.SetStopWords("w0"s);
+	for (int document_id = 0; document_id < 600; ++document_id) {
+	    sharded.AddDocument(document_id, documents[document_id], static_cast<DocumentStatus>(document_id % 3), { document_id });
+	    plain.AddDocument(document_id, documents[document_id], static_cast<DocumentStatus>(document_id % 3), { document_id });
+	}
+	for (int document_id = 0; document_id < 600; document_id += 11) {
+	    sharded.RemoveDocument(document_id);
+	    plain.RemoveDocument(document_id);
+	}
+	ASSERT_EQUAL_HINT(sharded.GetDocumentCount(), plain.GetDocumentCount(), "Shards count other documents");
+
+	for (const string& query : { "w1 w2"s, "w3 w5 -w4"s, "w30 w1 w0"s, "w7"s, "w1 w2 w3 w4 w5 w6 w6"s, "w100"s }) {
+	    for (const DocumentStatus status : { DocumentStatus::ACTUAL, DocumentStatus::BANNED }) {
+	        const auto expected = plain.FindTopDocuments(query, status, 40);
+	        const auto actual = sharded.FindTopDocuments(query, status, 40);
+	        ASSERT_SAME_DOCUMENTS(actual, expected, "Shards don't use IDF of the whole index");
+	    }
+	    for (const int document_id : { 1, 302, 599 }) {
+	        const auto [expected_words, expected_status] = plain.MatchDocument(query, document_id);
+	        const auto [actual_words, actual_status] = sharded.MatchDocument(query, document_id);
+	        ASSERT_HINT(vector<string>(expected_words.begin(), expected_words.end()) == actual_words, "Shard matches other words");
+	        ASSERT_HINT(actual_status == expected_status, "Shard returns other status");
+	    }
+	}
+
+	bool is_thrown = false;
+	try {
+	    sharded.MatchDocument("w1"s, 11);
+	} catch (const out_of_range&) {
+	    is_thrown = true;
+	}
+	ASSERT_HINT(is_thrown, "Removed document is matched by a shard");
+	ASSERT_EQUAL_HINT(sharded.FindTopDocuments("w1"s).size(), plain.FindTopDocuments("w1"s).size(), "Shards are out of step after an error");
+
+	ASSERT_EQUAL(sharded.GetShardLatencies().size(), 3);
+	for (const ShardedSearchServer::ShardLatency& latency : sharded.GetShardLatencies()) {
+	    ASSERT_HINT(latency.request_count > 0 && latency.max_seconds > 0.0, "Shard latency is not recorded");
+	}
+
+	// после отказа шарда остальные не читают чужих ответов, а сервер отказывается работать.
+	// Запрос уходит в шард 0, но не в завершённый шард 1.
+	const pid_t failed_process_id = sharded.GetShardProcessIds()[1];
+	kill(failed_process_id, SIGKILL);
+	waitpid(failed_process_id, nullptr, 0);
+	const auto is_failed = [](const auto& call) {
+	    try {
+	        call();
+	    } catch (const runtime_error&) {
+	        return true;
+	    }
+	    return false;
+	};
+	ASSERT_HINT(is_failed([&] { sharded.FindTopDocuments("w1 w2"s); }), "Dead shard is not noticed");
+	// ответ шарда 0 на предыдущий запрос принимался бы за ответ на удаление
+	ASSERT_HINT(is_failed([&] { sharded.RemoveDocument(3); }), "Shards are used after a failure");
+	ASSERT_HINT(is_failed([&] { sharded.MatchDocument("w1"s, 3); }), "Shards are used after a failure");
+	ASSERT_HINT(is_failed([&] { sharded.GetDocumentCount(); }), "Shards are used after a failure");
+}
+#endif
+
+// Запрос через прогретый QueryContext находит то же, что и обычный запрос, а в сборке с
+// SEARCH_SERVER_COUNT_ALLOCATIONS проверяется ещё и то, что он не выделяет память в куче
+void TestQueryContextAllocations(){
+
+	const vector<string> documents = GenerateTestDocuments(23, 3000, 40, 4, 7);
+	SearchServer server;
+	server.SetStopWords("w1"s);
+	for (int document_id = 0; document_id < 3000; ++document_id) {
+	    server.AddDocument(document_id, documents[document_id], static_cast<DocumentStatus>(document_id % 3), { document_id });
+	}
+
+	// широкие, узкие, отсекаемые запросы и запросы с минус-словами
+	const vector<string> queries = { "w0"s, "w35 w36"s, "w0 w2 w30"s, "w2 w3 -w4 -w0"s, "w1 w39 w38 -w37"s, "-w0"s, "w100"s, ""s };
+	const auto odd_predicate = [](int document_id, DocumentStatus, int) { return document_id % 2 == 1; };
+	SearchServer::QueryContext context;
+	const auto run_queries = [&] {
+	    for (const string& query : queries) {
+	        for (const size_t top_count : { size_t{5}, size_t{50} }) {
+	            server.FindTopDocuments(context, query, DocumentStatus::IRRELEVANT, top_count);
+	            server.FindTopDocuments(context, query, odd_predicate, top_count);
+	        }
+	    }
+	};
+	const auto check_same = [&] {
+	    for (const string& query : queries) {
+	        const vector<Document> expected = server.FindTopDocuments(query, odd_predicate, 50);
+	        const vector<Document>& actual = server.FindTopDocuments(context, query, odd_predicate, 50);
+	        ASSERT_SAME_DOCUMENTS(actual, expected, "Context query finds other documents");
+	    }
+	};
+
+	for (const bool compressed : { false, true }) {
+	    if (compressed) {
+	        server.CompressPostings();
+	    }
+	    check_same();
+	    run_queries();
+#ifdef SEARCH_SERVER_COUNT_ALLOCATIONS
+	    const uint64_t allocation_count = thread_allocation_count;
+	    run_queries();
+	    // разность берётся до вызова ASSERT, аргументы которого сами выделяют память
+	    const uint64_t query_allocation_count = thread_allocation_count - allocation_count;
+	    ASSERT_EQUAL_HINT(query_allocation_count, 0u, "Warmed-up query allocates");
+#endif
+	}
+	ASSERT_HINT(server.FindTopDocuments(context, "w0"s).size() == server.FindTopDocuments("w0"s).size(), "Context query finds other documents");
+}
+
+// Исключение из предиката не портит буферы оценки потока: последующие узкие и широкие
+// запросы находят те же документы, что и до него
+void TestThrowingPredicate(){
+
+	SearchServer server;
+	for (int document_id = 0; document_id < 1000; ++document_id) {
+	    server.AddDocument(document_id, document_id < 3 ? "cat dog"s : "fish "s + to_string(document_id), DocumentStatus::ACTUAL, { 1 });
+	}
+	const auto throwing_predicate = [](int, DocumentStatus, int) -> bool { throw runtime_error("predicate failed"s); };
+	for (const string& query : { "cat"s, "fish"s }) {
+	    const size_t expected_count = server.FindTopDocuments(query, DocumentStatus::ACTUAL, 1000).size();
+	    try {
+	        server.FindTopDocuments(query, throwing_predicate, 1000);
+	        ASSERT_HINT(false, "Predicate exception is lost");
+	    } catch (const runtime_error&) {
+	    }
+	    ASSERT_EQUAL_HINT(server.FindTopDocuments(query, DocumentStatus::ACTUAL, 1000).size(), expected_count, "Query after a throwing predicate finds other documents");
+	}
+	ASSERT_EQUAL_HINT(server.FindTopDocuments("cat"s).size(), 3u, "Narrow query after a throwing predicate loses documents");
+	ASSERT_EQUAL_HINT(server.FindTopDocuments("dog"s).size(), 3u, "Narrow query after a throwing predicate loses documents");
+}
+
+// Поиск по статусу через битовые карты находит то же, что и поиск с предикатом, в том числе
+// после удаления документов и загрузки снимка, а минус-слова исключают документы до оценки
+void TestStatusBitmapFiltering(){
+
+	const vector<string> documents = GenerateTestDocuments(24, 3000, 40, 4, 7);
+	SearchServer server;
+	for (int document_id = 0; document_id < 3000; ++document_id) {
+	    server.AddDocument(document_id, documents[document_id], static_cast<DocumentStatus>(document_id % 4), { document_id });
+	}
+	for (int document_id = 0; document_id < 3000; document_id += 13) {
+	    server.RemoveDocument(document_id);
+	}
+
+	// широкие, узкие и отсекаемые запросы с множеством минус-слов
+	const vector<string> queries = { "w0"s, "w35 w36"s, "w0 w2 w30"s, "w2 w3 -w4 -w0 -w5 -w6 -w7 -w8"s,
+	                                 "w30 w31 w32 -w33 -w34 -w35 -w36"s, "w0 w1 -w1"s, "-w0"s, "w100"s };
+	const auto check_same = [&](const SearchServer& checked) {
+	    for (const string& query : queries) {
+	        for (const DocumentStatus status : { DocumentStatus::ACTUAL, DocumentStatus::IRRELEVANT, DocumentStatus::BANNED, DocumentStatus::REMOVED }) {
+	            const auto status_predicate = [status](int, DocumentStatus document_status, int) { return document_status == status; };
+	            for (const size_t top_count : { size_t{5}, size_t{50} }) {
+	                const vector<Document> expected = checked.FindTopDocuments(query, status_predicate, top_count);
+	                for (const vector<Document>& actual : { checked.FindTopDocuments(query, status, top_count),
+	                                                        checked.FindTopDocuments(execution::par, query, status, top_count) }) {
+	                    ASSERT_SAME_DOCUMENTS(actual, expected, "Status bitmap finds other documents");
+	                }
+	            }
+	        }
+	    }
+	};
+
+	check_same(server);
+	ASSERT_HINT(server.FindTopDocuments("w0 -w0"s, DocumentStatus::ACTUAL, 3000).empty(), "Minus word doesn't exclude documents");
+	for (const Document& document : server.FindTopDocuments("w0 w1 w2"s, DocumentStatus::BANNED, 3000)) {
+	    ASSERT_HINT(document.id % 4 == static_cast<int>(DocumentStatus::BANNED) && document.id % 13 != 0, "Document of another status is found");
+	}
+	// документ, добавленный после удаления, попадает в карту своего статуса
+	server.AddDocument(13, "w0 w1 w2"s, DocumentStatus::BANNED, { 13 });
+	check_same(server);
+	// минус-слова и статус применяются до вычисления релевантности, поэтому исключённые
+	// документы не попадают в число оценённых ни в плотном, ни в разреженном подсчёте
+	for (const string& query : { "w0 -w0"s, "w0 -w1"s, "w0 w1 -w2"s, "w35 -w36"s }) {
+	    auto stats_before = server.GetScoringStats();
+	    const size_t found_count = server.FindTopDocuments(query, DocumentStatus::BANNED, 3000).size();
+	    ASSERT_EQUAL_HINT(server.GetScoringStats().scored_document_count - stats_before.scored_document_count, found_count,
+	        "Excluded documents are scored");
+	    stats_before = server.GetScoringStats();
+	    const size_t found_parallel_count = server.FindTopDocuments(execution::par, query, DocumentStatus::BANNED, 3000).size();
+	    ASSERT_EQUAL_HINT(server.GetScoringStats().scored_document_count - stats_before.scored_document_count, found_parallel_count,
+	        "Excluded documents are scored by the parallel search");
+	}
+
+	const string path = (filesystem::temp_directory_path() / "search_server_bitmap_test.snapshot"s).string();
+	server.Save(path);
+	const SearchServer loaded = SearchServer::Load(path);
+	check_same(loaded);
+	filesystem::remove(path);
+}
+
+// Метрики считают вызовы и проделанную работу только после включения, гистограмма
+// задержек укладывает значения в корзины с погрешностью не больше 1/8, а экспорт в формате
+// Prometheus содержит счётчики, гистограммы и показатели индекса
+void TestMetrics(){
+
+	SearchServer server;
+	server.SetStopWords("and in on"s);
+	server.AddDocument(0, "white cat and fancy collar"s, DocumentStatus::ACTUAL, { 8, -3 });
+	ASSERT_EQUAL_HINT(server.GetMetricsSnapshot().GetLatencies(SearchMetrics::Operation::ADD_DOCUMENT).count, 0u, "Metrics are collected before enabling");
+
+	server.EnableMetrics();
+	server.AddDocument(1, "fluffy cat fluffy tail"s, DocumentStatus::ACTUAL, { 7, 2, 7 });
+	server.AddDocument(2, "groomed dog expressive eyes"s, DocumentStatus::ACTUAL, { 5, -12, 2, 1 });
+	server.AddDocument(3, "groomed starling eugene"s, DocumentStatus::BANNED, { 9 });
+	size_t result_count = 0;
+	for (const string& query : { "fluffy groomed cat"s, "cat -collar"s, "starling"s }) {
+	    result_count += server.FindTopDocuments(query).size();
+	}
+	SearchServer::QueryContext context;
+	result_count += server.FindTopDocuments(context, "groomed starling"s, DocumentStatus::BANNED).size();
+	result_count += server.FindTopDocuments(execution::par, "fluffy cat"s).size();
+	server.MatchDocument("fluffy cat"s, 1);
+	server.MatchDocument(execution::par, "fluffy cat"s, 2);
+
+	const SearchMetrics::Snapshot snapshot = server.GetMetricsSnapshot();
+	ASSERT_EQUAL_HINT(snapshot.GetLatencies(SearchMetrics::Operation::ADD_DOCUMENT).count, 3u, "Added documents aren't timed");
+	ASSERT_EQUAL_HINT(snapshot.GetLatencies(SearchMetrics::Operation::FIND_TOP_DOCUMENTS).count, 5u, "Searches aren't timed");
+	ASSERT_EQUAL_HINT(snapshot.GetLatencies(SearchMetrics::Operation::MATCH_DOCUMENT).count, 2u, "Matches aren't timed");
+	ASSERT_HINT(snapshot.GetLatencies(SearchMetrics::Operation::PARSE_QUERY).count >= 5u, "Query parsing isn't timed");
+	ASSERT_HINT(snapshot.GetLatencies(SearchMetrics::Operation::FIND_TOP_DOCUMENTS).total_nanoseconds > 0, "Search latency is not summed");
+	ASSERT_HINT(snapshot.GetCounter(SearchMetrics::Counter::POSTINGS_SCANNED) > 0, "Scanned postings aren't counted");
+	ASSERT_HINT(snapshot.GetCounter(SearchMetrics::Counter::CANDIDATES_SCORED) > 0, "Scored candidates aren't counted");
+	ASSERT_EQUAL_HINT(snapshot.GetCounter(SearchMetrics::Counter::RESULTS_RETURNED), result_count, "Returned results are miscounted");
+
+	// каждое значение попадает в корзину, которая его содержит и не шире 1/8 от него
+	for (const uint64_t nanoseconds : { uint64_t{0}, uint64_t{7}, uint64_t{8}, uint64_t{15}, uint64_t{16}, uint64_t{1000}, uint64_t{123456789} }) {
+	    const size_t index = SearchMetrics::GetBucketIndex(nanoseconds);
+	    const uint64_t bucket_start = index == 0 ? 0 : SearchMetrics::GetBucketEnd(index - 1);
+	    ASSERT_HINT(bucket_start <= nanoseconds && nanoseconds < SearchMetrics::GetBucketEnd(index), "Latency falls outside of its bucket");
+	    ASSERT_HINT((SearchMetrics::GetBucketEnd(index) - bucket_start) * 8 <= max<uint64_t>(nanoseconds, 8), "Latency bucket is too wide");
+	}
+	ASSERT_EQUAL(SearchMetrics::GetBucketIndex(uint64_t{1} << 60), SearchMetrics::BUCKET_COUNT - 1);
+	SearchMetrics metrics;
+	for (uint64_t nanoseconds = 1; nanoseconds <= 1000; ++nanoseconds) {
+	    metrics.RecordLatency(SearchMetrics::Operation::PARSE_QUERY, nanoseconds * 1000);
+	}
+	const uint64_t median = metrics.GetSnapshot().GetLatencies(SearchMetrics::Operation::PARSE_QUERY).GetPercentileNanoseconds(0.5);
+	ASSERT_HINT(median >= 500000 && median <= 500000 * 9 / 8, "Median latency is inaccurate");
+
+	ostringstream output;
+	server.WriteMetrics(output);
+	const string text = output.str();
+	for (const string& line : { "search_server_documents{status=\"ACTUAL\"} 3\n"s, "search_server_documents{status=\"BANNED\"} 1\n"s,
+	                            "search_server_results_returned_total "s + to_string(result_count) + "\n"s,
+	                            "search_server_operation_duration_seconds_count{operation=\"match_document\"} 2\n"s,
+	                            "search_server_operation_duration_seconds_bucket{operation=\"add_document\",le=\"+Inf\"} 3\n"s,
+	                            "# TYPE search_server_operation_duration_seconds histogram\n"s }) {
+	    ASSERT_HINT(text.find(line) != text.npos, "Exported metrics miss "s + line);
+	}
+	ASSERT_EQUAL(server.GetIndexGauges().posting_count, 14u);
+
+	const string path = (filesystem::temp_directory_path() / "search_server_metrics_test.prom"s).string();
+	server.WriteMetrics(path);
+	ifstream input(path);
+	ASSERT_HINT(string(istreambuf_iterator<char>(input), istreambuf_iterator<char>()) == text, "Metrics file differs from the stream export");
+	filesystem::remove(path);
+
+	server.DisableMetrics();
+	ostringstream disabled_output;
+	server.WriteMetrics(disabled_output);
+	ASSERT_HINT(disabled_output.str().find("_total"s) == string::npos, "Counters are exported while metrics are disabled");
+	ASSERT_HINT(disabled_output.str().find("\nsearch_server_terms 12\n"s) != string::npos, "Index gauges aren't exported while metrics are disabled");
+}
+
+// Таймер пишет имя этапа и длительность в переданный поток при выходе из области видимости
+void TestLogDuration(){
+
+	ostringstream output;
+	{
+	    LogDuration guard("retrieve"sv, output);
+	    ASSERT_HINT(output.str().empty(), "Duration is written before the scope ends");
+	}
+	const string line = output.str();
+	ASSERT_HINT(line.rfind("retrieve: "s, 0) == 0, "Stage name is not written first");
+	ASSERT_HINT(line.size() > 14 && line.substr(line.size() - 4) == " us\n"s, "Duration is not written in microseconds");
+
+	ostringstream profile_output;
+	{
+	    LOG_DURATION_STREAM("parse"sv, profile_output);
+	}
+#ifdef SEARCH_SERVER_PROFILE
+	ASSERT_HINT(profile_output.str().rfind("parse: "s, 0) == 0, "Profiling build doesn't time stages");
+#else
+	ASSERT_HINT(profile_output.str().empty(), "Stage timers are compiled into a regular build");
+#endif
+}
+
+// Функция TestSearchServer является точкой входа для запуска тестов
+void TestSearchServer() {
+#ifdef SEARCH_SERVER_HAS_SOCKETS
+    // Шарды запускаются до того, как другие тесты создадут потоки
+    RUN_TEST(TestShardedSearchServer);
+#endif
+    RUN_TEST(TestExcludeStopWordsFromAddedDocumentContent);
+    RUN_TEST(TestAddDocument);
+    RUN_TEST(TestMatchDocToRequest);
+    RUN_TEST(TestSortByRelevance);
+    RUN_TEST(TestCalcRating);
+    RUN_TEST(TestFiltrationByUserDefinedPredicate);
+    RUN_TEST(FindDocumentWithStatus);
+    RUN_TEST(TestCalcRelevance);
+    RUN_TEST(TestAddDocumentsOutOfOrder);
+    RUN_TEST(TestTopDocumentCount);
+    RUN_TEST(TestParallelFindTopDocuments);
+    RUN_TEST(TestProcessQueries);
+    RUN_TEST(TestWordsOutliveSourceText);
+    RUN_TEST(TestTermPool);
+    RUN_TEST(TestRemoveDocument);
+    RUN_TEST(TestRemoveDuplicates);
+    RUN_TEST(TestSaveAndLoadSnapshot);
+    RUN_TEST(TestBulkIngest);
+    RUN_TEST(TestPaginate);
+    RUN_TEST(TestRequestQueue);
+    RUN_TEST(TestQueryResultCache);
+    RUN_TEST(TestInverseDocumentFreqUpdate);
+    RUN_TEST(TestDocumentMetadataAfterRemoval);
+    RUN_TEST(TestScoringKernels);
+    RUN_TEST(TestCompressedPostings);
+    RUN_TEST(TestDynamicPruning);
+    RUN_TEST(TestConcurrentSearchServer);
+    RUN_TEST(TestConcurrentReadsDuringIngest);
+    RUN_TEST(TestEpochPointerReclamation);
+    RUN_TEST(TestSegmentMergeAndTombstones);
+    RUN_TEST(TestParallelMatchDocument);
+    RUN_TEST(TestLogDuration);
+    RUN_TEST(TestQueryContextAllocations);
+    RUN_TEST(TestThrowingPredicate);
+    RUN_TEST(TestStatusBitmapFiltering);
+    RUN_TEST(TestMetrics);
 
-	const int document_id = 42;
-	    const std::vector<int> ratings = { 1 };
+    // Не забудьте вызывать остальные тесты здесь
+}
 
-	    {
-	        SearchServer server;
+// --------- Окончание модульных тестов поисковой системы -----------
 
-	        server.AddDocument(document_id, "The cat in the city", DocumentStatus::ACTUAL, ratings);
-	        server.AddDocument(document_id + 1, "The cat in the", DocumentStatus::ACTUAL, ratings);
-	        server.AddDocument(document_id + 2, "The cat in", DocumentStatus::ACTUAL, ratings);
-	        server.AddDocument(document_id + 3, "The", DocumentStatus::ACTUAL, ratings);
+// -------- Бенчмарки поисковой системы ----------
 
-	        {
-	            auto get_every_second_document = [](int document_id, DocumentStatus, int) {
-	                return document_id % 2 == 0;
-	            };
+struct BenchmarkCorpus {
+    vector<string> documents;
+    vector<string> queries;
+};
 
-	            const auto& result = server.FindTopDocuments("cat", get_every_second_document);
+// Слова документов и запросов распределены по закону Ципфа, как в реальных текстах
+BenchmarkCorpus GenerateBenchmarkCorpus(int document_count, int vocabulary_size, int words_per_document,
+                                        int query_count, unsigned seed) {
+    mt19937 generator(seed);
+    vector<double> weights(vocabulary_size);
+    for (int rank = 0; rank < vocabulary_size; ++rank) {
+        weights[rank] = 1.0 / (rank + 1);
+    }
+    discrete_distribution<int> word_distribution(weights.begin(), weights.end());
+    const auto random_word = [&] {
+        return "w"s + to_string(word_distribution(generator));
+    };
 
-	            ASSERT_EQUAL_HINT(result.size(), 2, "Function filter is not applied correctly");
+    BenchmarkCorpus corpus;
+    corpus.documents.reserve(document_count);
+    for (int i = 0; i < document_count; ++i) {
+        string document;
+        for (int j = 0; j < words_per_document; ++j) {
+            document += random_word();
+            document += ' ';
+        }
+        corpus.documents.push_back(move(document));
+    }
+    corpus.queries.reserve(query_count);
+    for (int i = 0; i < query_count; ++i) {
+        corpus.queries.push_back(random_word() + ' ' + random_word() + ' ' + random_word() + " -"s + random_word());
+    }
+    return corpus;
+}
 
-	            ASSERT_EQUAL_HINT(result[0].id, document_id + 2,
-	                "Function filter is not applied correctly, wrong document");
+template <typename Function>
+double MeasureSeconds(Function function) {
+    const auto start = chrono::steady_clock::now();
+    function();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
 
-	            ASSERT_EQUAL_HINT(result[1].id, document_id, "Fuction filter is not applied correctly, wrong document");
-	        }
-	    }
+struct LatencyStats {
+    size_t count = 0;
+    double total_seconds = 0.0;
+    double p50 = 0.0;
+    double p99 = 0.0;
+    double p999 = 0.0;
+    double max = 0.0;
+};
+
+// Перцентили берутся по ближайшему рангу; задержки в секундах
+LatencyStats ComputeLatencyStats(vector<double> latencies) {
+    LatencyStats stats;
+    if (latencies.empty()) {
+        return stats;
+    }
+    sort(latencies.begin(), latencies.end());
+    const auto percentile = [&](double fraction) {
+        return latencies[static_cast<size_t>(fraction * (latencies.size() - 1))];
+    };
+    stats.count = latencies.size();
+    stats.total_seconds = accumulate(latencies.begin(), latencies.end(), 0.0);
+    stats.p50 = percentile(0.5);
+    stats.p99 = percentile(0.99);
+    stats.p999 = percentile(0.999);
+    stats.max = latencies.back();
+    return stats;
 }
 
-//Поиск документов, имеющих заданный статус.
-void FindDocumentWithStatus(){
+ostream& operator<<(ostream& output, const LatencyStats& stats) {
+    return output << stats.count << " ops, "s << (stats.total_seconds > 0.0 ? stats.count / stats.total_seconds : 0.0)
+                  << " ops/s, p50 "s << stats.p50 * 1e6 << " us, p99 "s << stats.p99 * 1e6 << " us, p999 "s
+                  << stats.p999 * 1e6 << " us, max "s << stats.max * 1e6 << " us"s;
+}
 
-	const int document_id = 42;
-	    const std::vector<int> ratings = { 1 };
+// Возвращает 0, если ОС не позволяет узнать размер резидентной памяти
+size_t GetResidentMemoryBytes() {
+    ifstream status("/proc/self/status"s);
+    string line;
+    while (getline(status, line)) {
+        if (line.rfind("VmRSS:"s, 0) == 0) {
+            return stoull(line.substr(6)) * 1024;
+        }
+    }
+    return 0;
+}
 
+// Сравнивает плоские списки словопозиций SearchServer с прежним индексом map<string, map<int, double>>
+void BenchmarkPostingLayout(const BenchmarkCorpus& corpus) {
+    map<string, map<int, double>> legacy_index;
+    const size_t memory_before_legacy = GetResidentMemoryBytes();
+    const double legacy_build = MeasureSeconds([&] {
+        for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+            const vector<string_view> words = SplitIntoWords(corpus.documents[document_id]);
+            const double inv_word_count = 1.0 / words.size();
+            for (const string_view word : words) {
+                legacy_index[string(word)][document_id] += inv_word_count;
+            }
+        }
+    });
+    const size_t legacy_memory = GetResidentMemoryBytes() - memory_before_legacy;
+
+    SearchServer server;
+    const size_t memory_before_flat = GetResidentMemoryBytes();
+    const double flat_build = MeasureSeconds([&] {
+        for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+            server.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+        }
+    });
+    const size_t flat_memory = GetResidentMemoryBytes() - memory_before_flat;
 
-	        SearchServer server;
+    // Повторяет прежний FindTopDocuments целиком, чтобы сравнение было честным
+    map<int, DocumentStatus> legacy_statuses;
+    for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+        legacy_statuses.emplace(document_id, DocumentStatus::ACTUAL);
+    }
+    double checksum = 0.0;
+    const double legacy_queries = MeasureSeconds([&] {
+        for (const string& query : corpus.queries) {
+            map<int, double> document_to_relevance;
+            vector<string> minus_words;
+            for (const string_view word_view : SplitIntoWords(query)) {
+                const string word(word_view);
+                if (word[0] == '-') {
+                    minus_words.push_back(word.substr(1));
+                    continue;
+                }
+                if (legacy_index.count(word) == 0) {
+                    continue;
+                }
+                const double idf = log(corpus.documents.size() * 1.0 / legacy_index.at(word).size());
+                for (const auto [document_id, term_freq] : legacy_index.at(word)) {
+                    if (legacy_statuses.at(document_id) == DocumentStatus::ACTUAL) {
+                        document_to_relevance[document_id] += term_freq * idf;
+                    }
+                }
+            }
+            for (const string& word : minus_words) {
+                if (legacy_index.count(word) == 0) {
+                    continue;
+                }
+                for (const auto [document_id, _] : legacy_index.at(word)) {
+                    document_to_relevance.erase(document_id);
+                }
+            }
+            vector<Document> matched_documents;
+            for (const auto [document_id, relevance] : document_to_relevance) {
+                matched_documents.push_back({document_id, relevance, 1});
+            }
+            sort(matched_documents.begin(), matched_documents.end(),
+                 [](const Document& lhs, const Document& rhs) { return lhs.relevance > rhs.relevance; });
+            checksum += matched_documents.size();
+        }
+    });
+    const double flat_queries = MeasureSeconds([&] {
+        for (const string& query : corpus.queries) {
+            checksum += server.FindTopDocuments(query).size();
+        }
+    });
+
+    const double query_count = corpus.queries.size();
+    cout << "posting layout: legacy maps build "s << legacy_build << " s, "s << legacy_memory / 1024 << " KiB, "s
+         << legacy_queries / query_count * 1e6 << " us/query"s << endl;
+    cout << "posting layout: flat lists  build "s << flat_build << " s, "s << flat_memory / 1024 << " KiB, "s
+         << flat_queries / query_count * 1e6 << " us/query"s << endl;
+    cout << "(checksum "s << checksum << ")"s << endl;
+}
 
-	        server.AddDocument(document_id, "The cat in the city", DocumentStatus::ACTUAL, ratings);
-	        server.AddDocument(document_id + 1, "The cat in the", DocumentStatus::BANNED, ratings);
-	        server.AddDocument(document_id + 2, "The cat in", DocumentStatus::IRRELEVANT, ratings);
-	        server.AddDocument(document_id + 3, "The cat", DocumentStatus::REMOVED, ratings);
+// Полная сортировка всех найденных документов против частичного отбора первых MAX_RESULT_DOCUMENT_COUNT
+void BenchmarkTopDocumentSelection() {
+    mt19937 generator(42);
+    uniform_real_distribution<double> relevance_distribution(0.0, 1.0);
+    uniform_int_distribution<int> rating_distribution(-10, 10);
+    vector<Document> documents(500000);
+    for (int i = 0; i < static_cast<int>(documents.size()); ++i) {
+        documents[i] = {i, relevance_distribution(generator), rating_distribution(generator)};
+    }
 
-	        {
-	            const auto& result = server.FindTopDocuments("cat", DocumentStatus::REMOVED);
+    const int repeat_count = 20;
+    double checksum = 0.0;
+    const double full_sort = MeasureSeconds([&] {
+        for (int i = 0; i < repeat_count; ++i) {
+            vector<Document> matched_documents = documents;
+            sort(matched_documents.begin(), matched_documents.end(), IsMoreRelevant);
+            matched_documents.resize(MAX_RESULT_DOCUMENT_COUNT);
+            checksum += matched_documents[0].relevance;
+        }
+    });
+    const double partial_sort = MeasureSeconds([&] {
+        for (int i = 0; i < repeat_count; ++i) {
+            vector<Document> matched_documents = documents;
+            SelectTopDocuments(matched_documents, MAX_RESULT_DOCUMENT_COUNT);
+            checksum += matched_documents[0].relevance;
+        }
+    });
+    cout << "top selection of "s << documents.size() << " documents: full sort "s
+         << full_sort / repeat_count * 1e3 << " ms, partial "s << partial_sort / repeat_count * 1e3 << " ms"s
+         << " (checksum "s << checksum << ")"s << endl;
+}
 
-	            ASSERT_EQUAL_HINT(result.size(), 1, "Status filter is not applied correctly");
+// Масштабирование параллельного поиска: число потоков ограничивается через TBB, на котором работает execution::par
+void BenchmarkParallelSearch(const BenchmarkCorpus& corpus) {
+    SearchServer server;
+    for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+        server.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+    }
+    double checksum = 0.0;
+    const double sequential = MeasureSeconds([&] {
+        for (const string& query : corpus.queries) {
+            checksum += server.FindTopDocuments(query).size();
+        }
+    });
+    cout << "parallel search: sequential "s << sequential / corpus.queries.size() * 1e6 << " us/query"s << endl;
+
+    const int max_thread_count = max(1u, thread::hardware_concurrency());
+    for (int thread_count = 1; thread_count <= max_thread_count; thread_count *= 2) {
+#ifdef SEARCH_SERVER_HAS_TBB
+        tbb::global_control thread_limit(tbb::global_control::max_allowed_parallelism, thread_count);
+#endif
+        const double parallel = MeasureSeconds([&] {
+            for (const string& query : corpus.queries) {
+                checksum += server.FindTopDocuments(execution::par, query).size();
+            }
+        });
+        cout << "parallel search: "s << thread_count << " threads "s << parallel / corpus.queries.size() * 1e6
+             << " us/query, speedup "s << sequential / parallel << endl;
+    }
+    cout << "(checksum "s << checksum << ")"s << endl;
+}
 
-	            ASSERT_EQUAL_HINT(result[0].id, (document_id + 3),
-	                "Status filter is not applied correctly, wrong document");
-	        }
+// Пропускная способность пакетной обработки запросов против последовательного цикла
+void BenchmarkProcessQueries(const BenchmarkCorpus& corpus) {
+    SearchServer server;
+    for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+        server.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+    }
+    size_t checksum = 0;
+    const double sequential = MeasureSeconds([&] {
+        for (const string& query : corpus.queries) {
+            checksum += server.FindTopDocuments(query).size();
+        }
+    });
+    const double batched = MeasureSeconds([&] {
+        checksum += ProcessQueriesJoined(server, corpus.queries).size();
+    });
+    cout << "process queries: sequential loop "s << corpus.queries.size() / sequential << " queries/s, ProcessQueries "s
+         << corpus.queries.size() / batched << " queries/s"s << " (checksum "s << checksum << ")"s << endl;
+}
 
+// Память на один термин: пул против отдельной строки std::string на каждый ключ
+void BenchmarkTermPool(const BenchmarkCorpus& corpus) {
+    SearchServer server;
+    set<string_view> vocabulary;
+    for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+        server.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+        for (const string_view word : SplitIntoWords(corpus.documents[document_id])) {
+            vocabulary.insert(word);
+        }
+    }
+    // Строка длиннее буфера SSO занимает отдельный блок в куче
+    const size_t small_string_capacity = string().capacity();
+    size_t string_bytes = 0;
+    for (const string_view word : vocabulary) {
+        string_bytes += sizeof(string) + (word.size() > small_string_capacity ? word.size() + 1 : 0);
+    }
+    const TermPool::MemoryStats stats = server.GetTermMemoryStats();
+    cout << "term pool: "s << stats.term_count << " terms, std::string keys "s
+         << string_bytes * 1.0 / vocabulary.size() << " bytes/term, pool "s
+         << stats.arena_bytes * 1.0 / stats.term_count << " bytes/term in arena ("s
+         << stats.term_bytes * 1.0 / stats.term_count << " payload) + "s
+         << stats.dictionary_bytes * 1.0 / stats.term_count << " bytes/term dictionary"s << endl;
 }
 
-//Корректное вычисление релевантности найденных документов.
-void TestCalcRelevance(){
+// Время старта и резидентная память: загрузка снимка против повторного добавления всех документов
+void BenchmarkSnapshot(const BenchmarkCorpus& corpus) {
+    const string path = (filesystem::temp_directory_path() / "search_server_bench.snapshot"s).string();
+    size_t reingest_memory = 0;
+    double reingest = 0.0;
+    {
+        SearchServer server;
+        const size_t memory_before = GetResidentMemoryBytes();
+        reingest = MeasureSeconds([&] {
+            for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+                server.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+            }
+        });
+        reingest_memory = GetResidentMemoryBytes() - memory_before;
+        server.Save(path);
+    }
+    const size_t memory_before = GetResidentMemoryBytes();
+    SearchServer loaded;
+    const double load = MeasureSeconds([&] {
+        loaded = SearchServer::Load(path);
+    });
+    const size_t load_memory = GetResidentMemoryBytes() - memory_before;
+    const size_t checksum = loaded.FindTopDocuments(corpus.queries[0]).size();
+    cout << "snapshot: "s << filesystem::file_size(path) / 1024 << " KiB, re-ingest "s << reingest << " s ("s
+         << reingest_memory / 1024 << " KiB), load "s << load << " s ("s << load_memory / 1024 << " KiB)"s
+         << " (checksum "s << checksum << ")"s << endl;
+    filesystem::remove(path);
+}
 
-	const int document_id = 42;
-	    const std::vector<int> ratings = { 1 };
+// Пропускная способность потоковой загрузки против последовательных вызовов AddDocument
+void BenchmarkBulkIngest(const BenchmarkCorpus& corpus) {
+    stringstream records;
+    for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+        records << document_id << "\tACTUAL\t1\t"s << corpus.documents[document_id] << '\n';
+    }
+    const size_t byte_count = records.str().size();
+
+    SearchServer sequential_server;
+    const double sequential = MeasureSeconds([&] {
+        string line;
+        while (getline(records, line)) {
+            const DocumentRecord record = ParseDocumentRecord(line);
+            sequential_server.AddDocument(record.id, record.text, record.status, record.ratings);
+        }
+    });
+    records.clear();
+    records.seekg(0);
+
+    SearchServer server;
+    const IngestStats stats = server.AddDocuments(records);
+    cout << "bulk ingest: AddDocument loop "s << corpus.documents.size() / sequential << " docs/s, "s
+         << byte_count / sequential / (1 << 20) << " MiB/s; pipeline "s << stats.document_count / stats.seconds
+         << " docs/s, "s << stats.byte_count / stats.seconds / (1 << 20) << " MiB/s"s << endl;
+}
 
+// Запросы с распределением Ципфа: пропускная способность с кэшем результатов и без него
+void BenchmarkQueryCache(const BenchmarkCorpus& corpus) {
+    SearchServer server;
+    for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+        server.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+    }
+    mt19937 generator(42);
+    vector<double> weights(corpus.queries.size());
+    for (size_t rank = 0; rank < weights.size(); ++rank) {
+        weights[rank] = 1.0 / (rank + 1);
+    }
+    discrete_distribution<size_t> query_distribution(weights.begin(), weights.end());
+    vector<string_view> query_log(500);
+    for (string_view& query : query_log) {
+        query = corpus.queries[query_distribution(generator)];
+    }
 
-	        SearchServer server;
+    size_t checksum = 0;
+    const double uncached = MeasureSeconds([&] {
+        for (const string_view query : query_log) {
+            checksum += server.FindTopDocuments(query).size();
+        }
+    });
+    server.EnableQueryCache(16 << 20);
+    const double cached = MeasureSeconds([&] {
+        for (const string_view query : query_log) {
+            checksum += server.FindTopDocuments(query).size();
+        }
+    });
+    const auto stats = server.GetQueryCacheStats();
+    cout << "query cache: uncached "s << query_log.size() / uncached << " queries/s, cached "s
+         << query_log.size() / cached << " queries/s, hits "s << stats.hit_count << ", misses "s << stats.miss_count
+         << ", evictions "s << stats.eviction_count << ", "s << stats.byte_count / 1024 << " KiB"s
+         << " (checksum "s << checksum << ")"s << endl;
+}
 
-	        server.AddDocument(document_id, "The cat in the city", DocumentStatus::ACTUAL, ratings);
-	        server.AddDocument(document_id + 1, "The cat in the", DocumentStatus::ACTUAL, ratings);
-	        server.AddDocument(document_id + 2, "The cat in", DocumentStatus::ACTUAL, ratings);
-	        server.AddDocument(document_id + 3, "The", DocumentStatus::ACTUAL, ratings);
+// Короткие запросы из редких слов по большому словарю: стоимость поиска слова и его IDF
+void BenchmarkShortQueries(const BenchmarkCorpus& corpus) {
+    SearchServer server;
+    for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+        server.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+    }
+    mt19937 generator(42);
+    uniform_int_distribution<int> rare_word_distribution(10000, 100000);
+    vector<string> queries(100000);
+    for (string& query : queries) {
+        query = "w"s + to_string(rare_word_distribution(generator)) + " w"s + to_string(rare_word_distribution(generator));
+    }
 
-	        {
-	            const auto& result = server.FindTopDocuments("cat");
+    size_t checksum = 0;
+    const double first_pass = MeasureSeconds([&] {
+        for (const string& query : queries) {
+            checksum += server.FindTopDocuments(query).size();
+        }
+    });
+    const double second_pass = MeasureSeconds([&] {
+        for (const string& query : queries) {
+            checksum += server.FindTopDocuments(query).size();
+        }
+    });
+    double log_sum = 0.0;
+    const double log_calls = MeasureSeconds([&] {
+        for (size_t i = 0; i < 2 * queries.size(); ++i) {
+            log_sum += log(corpus.documents.size() * 1.0 / (i % 100 + 1));
+        }
+    });
+    cout << "short queries: cold IDF "s << first_pass / queries.size() * 1e6 << " us/query, cached IDF "s
+         << second_pass / queries.size() * 1e6 << " us/query, log() alone "s << log_calls / queries.size() * 1e6
+         << " us/query"s << " (checksum "s << checksum + (log_sum > 0) << ")"s << endl;
+}
 
-	            ASSERT_EQUAL_HINT(result.size(), 3, "Incorrect amount of returned documents");
+// Стоимость обработки одной словопозиции на широких запросах: считается по документной частоте
+// слов запроса, так что результат не зависит от числа найденных документов
+void BenchmarkPostingCost(const BenchmarkCorpus& corpus) {
+    SearchServer server;
+    for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+        // id разрежены, как у настоящих документов
+        server.AddDocument(document_id * 7 + 1000, corpus.documents[document_id],
+            document_id % 10 == 0 ? DocumentStatus::BANNED : DocumentStatus::ACTUAL, {document_id % 5});
+    }
+    map<string, size_t> document_freqs;
+    for (const string& document : corpus.documents) {
+        const vector<string_view> words = SplitIntoWords(document);
+        for (const string_view word : set<string_view>(words.begin(), words.end())) {
+            ++document_freqs[string(word)];
+        }
+    }
+    const vector<string> queries = { "w0 w1 w2"s, "w3 w4 w5 w6"s, "w1 w7 -w8"s, "w0 w9 w10 w11 w12"s };
+    size_t posting_count = 0;
+    for (const string& query : queries) {
+        for (const string_view word : SplitIntoWords(query)) {
+            posting_count += document_freqs[string(word[0] == '-' ? word.substr(1) : word)];
+        }
+    }
 
-	            const double idf = log(4.0 / 3.0);
+    const int repeat_count = 20;
+    size_t checksum = 0;
+    const double status_seconds = MeasureSeconds([&] {
+        for (int i = 0; i < repeat_count; ++i) {
+            for (const string& query : queries) {
+                checksum += server.FindTopDocuments(query).size();
+            }
+        }
+    });
+    const double predicate_seconds = MeasureSeconds([&] {
+        for (int i = 0; i < repeat_count; ++i) {
+            for (const string& query : queries) {
+                checksum += server.FindTopDocuments(query, [](int document_id, DocumentStatus, int rating) {
+                    return rating > 0 && document_id % 2 == 0;
+                }).size();
+            }
+        }
+    });
+    const double total_postings = static_cast<double>(posting_count) * repeat_count;
+    cout << "posting cost: "s << total_postings / repeat_count << " postings/round, status "s
+         << status_seconds / total_postings * 1e9 << " ns/posting, predicate "s
+         << predicate_seconds / total_postings * 1e9 << " ns/posting (checksum "s << checksum << ")"s << endl;
+}
 
-	            ASSERT_EQUAL_HINT(result[0].relevance, (1.0 / 3.0) * idf, "Relevance is not calculated correctly");
+// Широкие запросы с каждым ядром подсчёта релевантности
+void BenchmarkScoringKernels(const BenchmarkCorpus& corpus) {
+    SearchServer server;
+    for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+        server.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+    }
+    const vector<string> queries = { "w0 w1 w2"s, "w3 w4 w5 w6"s, "w1 w7 -w8"s, "w0 w9 w10 w11 w12 -w13"s };
+    const int repeat_count = 50;
+    for (const ScoringKernel kernel : { ScoringKernel::SCALAR, ScoringKernel::SSE2, ScoringKernel::AVX2 }) {
+        if (!SearchServer::IsScoringKernelSupported(kernel)) {
+            cout << "scoring kernel "s << GetScoringKernelName(kernel) << ": not supported"s << endl;
+            continue;
+        }
+        server.SetScoringKernel(kernel);
+        double checksum = 0.0;
+        const double seconds = MeasureSeconds([&] {
+            for (int i = 0; i < repeat_count; ++i) {
+                for (const string& query : queries) {
+                    checksum += server.FindTopDocuments(query)[0].relevance;
+                }
+            }
+        });
+        cout << "scoring kernel "s << GetScoringKernelName(kernel) << ": "s
+             << seconds / (repeat_count * queries.size()) * 1e6 << " us/query (checksum "s << checksum << ")"s << endl;
+    }
+}
 
-	            ASSERT_EQUAL_HINT(result[1].relevance, (1.0 / 4.0) * idf, "Relevance is not calculated correctly");
+// Размер словопозиции и скорость её обработки в несжатых и сжатых списках
+void BenchmarkCompressedPostings(const BenchmarkCorpus& corpus) {
+    SearchServer server;
+    for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+        server.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+    }
+    const vector<string> queries = { "w0 w1 w2"s, "w3 w4 w5 w6"s, "w1 w7 -w8"s, "w0 w9 w10 w11 w12 -w13"s };
+    size_t query_posting_count = 0;
+    for (const string& query : queries) {
+        for (const string_view word : SplitIntoWords(query)) {
+            const string_view term = word[0] == '-' ? word.substr(1) : word;
+            query_posting_count += count_if(server.begin(), server.end(), [&](int document_id) {
+                return server.GetWordFrequencies(document_id).count(term) > 0;
+            });
+        }
+    }
 
-	            ASSERT_EQUAL_HINT(result[2].relevance, (1.0 / 5.0) * idf, "Relevance is not calculated correctly");
-	        }
+    const int repeat_count = 20;
+    const int match_count = 200000;
+    const auto measure = [&](const string& name) {
+        const SearchServer::PostingMemoryStats stats = server.GetPostingMemoryStats();
+        double checksum = 0.0;
+        const double query_seconds = MeasureSeconds([&] {
+            for (int i = 0; i < repeat_count; ++i) {
+                for (const string& query : queries) {
+                    checksum += server.FindTopDocuments(query)[0].relevance;
+                }
+            }
+        });
+        const double match_seconds = MeasureSeconds([&] {
+            for (int i = 0; i < match_count; ++i) {
+                checksum += get<0>(server.MatchDocument("w0 w5 w50 -w500"s, i % server.GetDocumentCount())).size();
+            }
+        });
+        cout << "postings "s << name << ": "s << stats.byte_count * 1.0 / stats.posting_count << " bytes/posting, "s
+             << query_posting_count * repeat_count / query_seconds / 1e6 << " M postings/s in queries, "s
+             << match_seconds / match_count * 1e9 << " ns/MatchDocument (checksum "s << checksum << ")"s << endl;
+    };
+    measure("uncompressed"s);
+    const double compress_seconds = MeasureSeconds([&] {
+        server.CompressPostings();
+    });
+    measure("compressed"s);
+    cout << "postings compressed in "s << compress_seconds << " s"s << endl;
+}
 
+// Число оценённых документов и время запроса с отсечением и без него
+void BenchmarkDynamicPruning(const BenchmarkCorpus& corpus) {
+    SearchServer server;
+    for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+        server.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {document_id % 10});
+    }
+    const vector<pair<string, vector<string>>> query_sets = {
+        { "broad"s, { "w0 w1 w2"s, "w3 w4 w5 w6"s, "w1 w7 -w8"s, "w0 w9 w10 w11 w12 -w13"s } },
+        { "mixed"s, { "w0 w1 w500"s, "w2 w3 w4 w2000"s, "w1 w150 -w8"s, "w0 w9 w700 w5000"s } },
+        { "corpus"s, corpus.queries },
+    };
+    for (const auto& [name, queries] : query_sets) {
+        for (const bool pruning : { false, true }) {
+            server.SetDynamicPruning(pruning);
+            const SearchServer::ScoringStats stats_before = server.GetScoringStats();
+            double checksum = 0.0;
+            const int repeat_count = 10;
+            const double seconds = MeasureSeconds([&] {
+                for (int i = 0; i < repeat_count; ++i) {
+                    for (const string& query : queries) {
+                        for (const Document& document : server.FindTopDocuments(query)) {
+                            checksum += document.relevance;
+                        }
+                    }
+                }
+            });
+            const SearchServer::ScoringStats stats = server.GetScoringStats();
+            const double query_count = stats.query_count - stats_before.query_count;
+            cout << "pruning "s << (pruning ? "on "s : "off"s) << ", "s << name << " queries: "s
+                 << (stats.scored_document_count - stats_before.scored_document_count) / query_count << " documents scored/query, "s
+                 << seconds / query_count * 1e6 << " us/query (checksum "s << checksum << ")"s << endl;
+        }
+    }
 }
-/*
-Разместите код остальных тестов здесь
-*/
 
-// Функция TestSearchServer является точкой входа для запуска тестов
-void TestSearchServer() {
-    RUN_TEST(TestExcludeStopWordsFromAddedDocumentContent);
-    RUN_TEST(TestAddDocument);
-    RUN_TEST(TestMatchDocToRequest);
-    RUN_TEST(TestSortByRelevance);
-    RUN_TEST(TestCalcRating);
-    RUN_TEST(TestFiltrationByUserDefinedPredicate);
-    RUN_TEST(FindDocumentWithStatus);
-    RUN_TEST(TestCalcRelevance);
+// Задержки запросов к ConcurrentSearchServer без записи и во время загрузки документов.
+// Для сравнения тот же поток записи в SearchServer под общим мьютексом.
+void BenchmarkConcurrentIngest(const BenchmarkCorpus& corpus) {
+    const int base_count = static_cast<int>(corpus.documents.size()) / 2;
+    const auto report = [&](const string& name, vector<double> latencies) {
+        cout << "concurrent ingest, "s << name << ": "s << ComputeLatencyStats(move(latencies)) << endl;
+    };
+    const auto run_queries = [&](auto find_top_documents, const atomic<bool>& is_running) {
+        vector<double> latencies;
+        size_t checksum = 0;
+        for (size_t i = 0; is_running || latencies.size() < corpus.queries.size(); ++i) {
+            const string& query = corpus.queries[i % corpus.queries.size()];
+            latencies.push_back(MeasureSeconds([&] {
+                checksum += find_top_documents(query).size();
+            }));
+        }
+        cout << "(checksum "s << checksum << ") "s;
+        return latencies;
+    };
 
-    // Не забудьте вызывать остальные тесты здесь
+    ConcurrentSearchServer concurrent;
+    SearchServer locked;
+    mutex locked_mutex;
+    for (int document_id = 0; document_id < base_count; ++document_id) {
+        concurrent.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+        locked.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+    }
+    concurrent.Publish();
+
+    atomic<bool> is_idle{false};
+    report("idle"s, run_queries([&](const string& query) { return concurrent.FindTopDocuments(query); }, is_idle));
+
+    atomic<bool> is_writing{true};
+    thread writer([&] {
+        for (int document_id = base_count; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+            concurrent.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+        }
+        concurrent.Publish();
+        is_writing = false;
+    });
+    report("during ingest"s, run_queries([&](const string& query) { return concurrent.FindTopDocuments(query); }, is_writing));
+    writer.join();
+
+    // прежний способ: запись и чтение по очереди под одним мьютексом
+    is_writing = true;
+    thread locked_writer([&] {
+        for (int document_id = base_count; document_id < static_cast<int>(corpus.documents.size()); document_id += 64) {
+            lock_guard guard(locked_mutex);
+            for (int i = document_id; i < min(document_id + 64, static_cast<int>(corpus.documents.size())); ++i) {
+                locked.AddDocument(i, corpus.documents[i], DocumentStatus::ACTUAL, {1});
+            }
+        }
+        is_writing = false;
+    });
+    report("mutex during ingest"s, run_queries([&](const string& query) {
+        lock_guard guard(locked_mutex);
+        return locked.FindTopDocuments(query);
+    }, is_writing));
+    locked_writer.join();
 }
 
-// --------- Окончание модульных тестов поисковой системы -----------
+// Скорость загрузки по мере роста индекса: один SearchServer и сегменты со слиянием в фоне
+void BenchmarkSegmentedIngest(const BenchmarkCorpus& corpus) {
+    const int pass_count = 4;
+    const int document_count = static_cast<int>(corpus.documents.size());
+    SearchServer single;
+    ConcurrentSearchServer segmented;
+    for (int pass = 0; pass < pass_count; ++pass) {
+        const double single_seconds = MeasureSeconds([&] {
+            for (int i = 0; i < document_count; ++i) {
+                single.AddDocument(pass * document_count + i, corpus.documents[i], DocumentStatus::ACTUAL, {1});
+            }
+        });
+        const double segmented_seconds = MeasureSeconds([&] {
+            for (int i = 0; i < document_count; ++i) {
+                segmented.AddDocument(pass * document_count + i, corpus.documents[i], DocumentStatus::ACTUAL, {1});
+            }
+            segmented.Publish();
+        });
+        cout << "segmented ingest, documents "s << pass * document_count << "-"s << (pass + 1) * document_count << ": single index "s
+             << document_count / single_seconds << " docs/s, segments "s << document_count / segmented_seconds << " docs/s ("s
+             << segmented.GetSegmentCount() << " segments)"s << endl;
+    }
+    const double merge_seconds = MeasureSeconds([&] {
+        segmented.WaitForMerges();
+    });
+    double checksum = 0.0;
+    const double single_query_seconds = MeasureSeconds([&] {
+        for (const string& query : corpus.queries) {
+            checksum += single.FindTopDocuments(query).size();
+        }
+    });
+    const double segmented_query_seconds = MeasureSeconds([&] {
+        for (const string& query : corpus.queries) {
+            checksum += segmented.FindTopDocuments(query).size();
+        }
+    });
+    cout << "segmented ingest: merges finished "s << merge_seconds << " s after the last publish, "s
+         << segmented.GetSegmentCount() << " segments; queries: single index "s
+         << single_query_seconds / corpus.queries.size() * 1e6 << " us, segments "s
+         << segmented_query_seconds / corpus.queries.size() * 1e6 << " us (checksum "s << checksum << ")"s << endl;
+}
+
+// Пропускная способность и перцентили задержки каждой операции SearchServer на одном корпусе
+void BenchmarkOperations(const BenchmarkCorpus& corpus) {
+    const size_t min_sample_count = 10000;
+    const int document_count = static_cast<int>(corpus.documents.size());
+    const auto measure = [](size_t sample_count, auto operation) {
+        vector<double> latencies;
+        latencies.reserve(sample_count);
+        for (size_t i = 0; i < sample_count; ++i) {
+            latencies.push_back(MeasureSeconds([&] {
+                operation(i);
+            }));
+        }
+        return ComputeLatencyStats(move(latencies));
+    };
+    const size_t query_sample_count = max(min_sample_count, corpus.queries.size());
+    size_t checksum = 0;
+
+    SearchServer server;
+    cout << "operations, AddDocument: "s << measure(corpus.documents.size(), [&](size_t i) {
+        server.AddDocument(static_cast<int>(i), corpus.documents[i], DocumentStatus::ACTUAL, {1});
+    }) << endl;
+    cout << "operations, FindTopDocuments: "s << measure(query_sample_count, [&](size_t i) {
+        checksum += server.FindTopDocuments(corpus.queries[i % corpus.queries.size()]).size();
+    }) << endl;
+    cout << "operations, FindTopDocuments (par): "s << measure(query_sample_count, [&](size_t i) {
+        checksum += server.FindTopDocuments(execution::par, corpus.queries[i % corpus.queries.size()]).size();
+    }) << endl;
+    cout << "operations, MatchDocument: "s << measure(query_sample_count, [&](size_t i) {
+        checksum += get<0>(server.MatchDocument(corpus.queries[i % corpus.queries.size()],
+            static_cast<int>(i % document_count))).size();
+    }) << endl;
+    cout << "operations, RemoveDocument: "s << measure(corpus.documents.size() / 10, [&](size_t i) {
+        server.RemoveDocument(static_cast<int>(i * 10));
+    }) << endl;
+    cout << "operations: checksum "s << checksum << endl;
+}
+
+// Запросы с множеством минус-слов: фильтр статуса битовой картой против предиката.
+// Документы распределены по четырём статусам, ищутся актуальные.
+void BenchmarkStatusFiltering(const BenchmarkCorpus& corpus) {
+    SearchServer server;
+    for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+        server.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+    }
+    SearchServer filtered_server;
+    for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+        filtered_server.AddDocument(document_id, corpus.documents[document_id], static_cast<DocumentStatus>(document_id % 4), {1});
+    }
+    mt19937 generator(42);
+    uniform_int_distribution<int> minus_word_distribution(0, 200);
+    const vector<string> minus_queries = [&] {
+        vector<string> queries;
+        for (const string& query : corpus.queries) {
+            string minus_query = query;
+            for (int i = 0; i < 10; ++i) {
+                minus_query += " -w"s + to_string(minus_word_distribution(generator));
+            }
+            queries.push_back(move(minus_query));
+        }
+        return queries;
+    }();
+
+    const auto actual_predicate = [](int, DocumentStatus status, int) { return status == DocumentStatus::ACTUAL; };
+    size_t checksum = 0;
+    for (const auto& [name, queried_server] : { pair{"all actual"s, &server}, pair{"quarter actual"s, &filtered_server} }) {
+        for (const auto& [query_name, query_set] : { pair{"corpus"s, &corpus.queries}, pair{"10 minus words"s, &minus_queries} }) {
+            const double predicate_seconds = MeasureSeconds([&] {
+                for (const string& query : *query_set) {
+                    checksum += queried_server->FindTopDocuments(query, actual_predicate).size();
+                }
+            });
+            const double bitmap_seconds = MeasureSeconds([&] {
+                for (const string& query : *query_set) {
+                    checksum += queried_server->FindTopDocuments(query, DocumentStatus::ACTUAL).size();
+                }
+            });
+            cout << "status filtering, "s << name << ", "s << query_name << " queries: predicate "s
+                 << predicate_seconds / query_set->size() * 1e6 << " us/query, bitmap "s
+                 << bitmap_seconds / query_set->size() * 1e6 << " us/query"s << endl;
+        }
+    }
+    cout << "status filtering: checksum "s << checksum << endl;
+}
+
+// Добавление документов и запросы без метрик и со сбором метрик, задержки по гистограмме
+void BenchmarkMetrics(const BenchmarkCorpus& corpus) {
+    size_t checksum = 0;
+    double disabled_add_seconds = 0;
+    double disabled_query_seconds = 0;
+    for (const bool enabled : { false, true, false, true }) {
+        SearchServer server;
+        if (enabled) {
+            server.EnableMetrics();
+        }
+        const double add_seconds = MeasureSeconds([&] {
+            for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+                server.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+            }
+        });
+        double query_seconds = numeric_limits<double>::max();
+        for (int round = 0; round < 3; ++round) {
+            query_seconds = min(query_seconds, MeasureSeconds([&] {
+                for (const string& query : corpus.queries) {
+                    checksum += server.FindTopDocuments(query, DocumentStatus::ACTUAL).size();
+                }
+            }));
+        }
+        if (!enabled) {
+            disabled_add_seconds = add_seconds;
+            disabled_query_seconds = query_seconds;
+            continue;
+        }
+        const SearchMetrics::Snapshot snapshot = server.GetMetricsSnapshot();
+        const SearchMetrics::Histogram& latencies = snapshot.GetLatencies(SearchMetrics::Operation::FIND_TOP_DOCUMENTS);
+        cout << "metrics: add overhead "s << (add_seconds / disabled_add_seconds - 1) * 100 << "%, query overhead "s
+             << (query_seconds / disabled_query_seconds - 1) * 100 << "%, query p50 "s
+             << latencies.GetPercentileNanoseconds(0.5) / 1e3 << " us, p99 "s << latencies.GetPercentileNanoseconds(0.99) / 1e3
+             << " us, "s << snapshot.GetCounter(SearchMetrics::Counter::POSTINGS_SCANNED) / latencies.count << " postings/query"s << endl;
+    }
+    cout << "metrics: checksum "s << checksum << endl;
+}
+
+// Запросы с выделением памяти на каждый запрос и через переиспользуемый QueryContext.
+// Число выделений печатается в сборке с SEARCH_SERVER_COUNT_ALLOCATIONS.
+void BenchmarkQueryContext(const BenchmarkCorpus& corpus) {
+    SearchServer server;
+    for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+        server.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+    }
+    SearchServer::QueryContext context;
+    size_t checksum = 0;
+    for (const string& query : corpus.queries) {
+        checksum += server.FindTopDocuments(context, query).size();
+    }
+
+    for (const bool use_context : { false, true }) {
+#ifdef SEARCH_SERVER_COUNT_ALLOCATIONS
+        const uint64_t allocation_count = thread_allocation_count;
+#endif
+        vector<double> latencies;
+        latencies.reserve(corpus.queries.size());
+        for (const string& query : corpus.queries) {
+            latencies.push_back(MeasureSeconds([&] {
+                checksum += use_context ? server.FindTopDocuments(context, query).size() : server.FindTopDocuments(query).size();
+            }));
+        }
+        cout << "query context, "s << (use_context ? "reused context: "s : "per-query allocation: "s)
+             << ComputeLatencyStats(move(latencies));
+#ifdef SEARCH_SERVER_COUNT_ALLOCATIONS
+        cout << ", "s << (thread_allocation_count - allocation_count) * 1.0 / corpus.queries.size() << " allocations/query"s;
+#endif
+        cout << endl;
+    }
+    cout << "query context: checksum "s << checksum << endl;
+}
+
+// MatchDocument для запросов из корпуса и для длинных запросов, где документ отсекают минус-слова
+void BenchmarkMatchDocument(const BenchmarkCorpus& corpus) {
+    SearchServer server;
+    for (int document_id = 0; document_id < static_cast<int>(corpus.documents.size()); ++document_id) {
+        server.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+    }
+    string long_query;
+    for (int i = 0; i < 30; ++i) {
+        long_query += "w"s + to_string(i * 7 + 1) + " w"s + to_string(i * 7 + 1) + " "s;
+    }
+    for (int i = 0; i < 10; ++i) {
+        long_query += "-w"s + to_string(i) + " "s;
+    }
+
+    const int match_count = 100000;
+    size_t checksum = 0;
+    const auto measure = [&](const string& name, auto match_document) {
+        const double seconds = MeasureSeconds([&] {
+            for (int i = 0; i < match_count; ++i) {
+                const string& query = corpus.queries[i % corpus.queries.size()];
+                checksum += get<0>(match_document(query, i % server.GetDocumentCount())).size();
+            }
+        });
+        const double long_seconds = MeasureSeconds([&] {
+            for (int i = 0; i < match_count / 10; ++i) {
+                checksum += get<0>(match_document(long_query, i % server.GetDocumentCount())).size();
+            }
+        });
+        cout << "match document, "s << name << ": corpus queries "s << seconds / match_count * 1e9 << " ns, long queries "s
+             << long_seconds / (match_count / 10) * 1e9 << " ns"s << endl;
+    };
+    measure("seq"s, [&](const string& query, int document_id) { return server.MatchDocument(query, document_id); });
+    measure("par"s, [&](const string& query, int document_id) { return server.MatchDocument(execution::par, query, document_id); });
+    cout << "match document: checksum "s << checksum << endl;
+}
+
+#ifdef SEARCH_SERVER_HAS_SOCKETS
+// Один SearchServer против шардов в отдельных процессах: загрузка, задержка запросов и задержка каждого шарда
+void BenchmarkShardedSearch(const BenchmarkCorpus& corpus) {
+    const int document_count = static_cast<int>(corpus.documents.size());
+    SearchServer single;
+    const double single_ingest_seconds = MeasureSeconds([&] {
+        for (int document_id = 0; document_id < document_count; ++document_id) {
+            single.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+        }
+    });
+    vector<double> single_latencies;
+    size_t checksum = 0;
+    for (const string& query : corpus.queries) {
+        single_latencies.push_back(MeasureSeconds([&] {
+            checksum += single.FindTopDocuments(query).size();
+        }));
+    }
+    cout << "sharded search, single server: "s << document_count / single_ingest_seconds << " docs/s, queries "s
+         << ComputeLatencyStats(move(single_latencies)) << endl;
+
+    for (const size_t shard_count : {1, 2, 4}) {
+        ShardedSearchServer sharded(shard_count);
+        const double ingest_seconds = MeasureSeconds([&] {
+            for (int document_id = 0; document_id < document_count; ++document_id) {
+                sharded.AddDocument(document_id, corpus.documents[document_id], DocumentStatus::ACTUAL, {1});
+            }
+        });
+        const vector<ShardedSearchServer::ShardLatency> ingest_latencies = sharded.GetShardLatencies();
+        vector<double> latencies;
+        for (const string& query : corpus.queries) {
+            latencies.push_back(MeasureSeconds([&] {
+                checksum += sharded.FindTopDocuments(query).size();
+            }));
+        }
+        cout << "sharded search, "s << shard_count << " shards: "s << document_count / ingest_seconds << " docs/s, queries "s
+             << ComputeLatencyStats(move(latencies)) << endl;
+        for (size_t i = 0; i < shard_count; ++i) {
+            const ShardedSearchServer::ShardLatency& latency = sharded.GetShardLatencies()[i];
+            const uint64_t request_count = latency.request_count - ingest_latencies[i].request_count;
+            cout << "    shard "s << i << ": "s << request_count << " query requests, mean "s
+                 << (latency.total_seconds - ingest_latencies[i].total_seconds) / request_count * 1e6
+                 << " us, max of all requests "s << latency.max_seconds * 1e6 << " us"s << endl;
+        }
+    }
+    cout << "sharded search: checksum "s << checksum << endl;
+}
+#endif
+
+struct BenchmarkOptions {
+    int document_count = 50000;
+    int vocabulary_size = 100000;
+    int words_per_document = 40;
+    int query_count = 200;
+    unsigned seed = 42;
+    // Имена бенчмарков через запятую; пустая строка запускает все
+    string only;
+};
+
+// Разбирает аргументы после "bench": --documents N --vocabulary N --words N --queries N --seed N --only NAME[,NAME]
+BenchmarkOptions ParseBenchmarkOptions(const vector<string_view>& arguments) {
+    BenchmarkOptions options;
+    for (size_t i = 0; i < arguments.size(); i += 2) {
+        if (i + 1 == arguments.size()) {
+            throw invalid_argument("Missing value of "s + string(arguments[i]));
+        }
+        const string_view name = arguments[i];
+        const string_view value = arguments[i + 1];
+        if (name == "--only"sv) {
+            options.only = string(value);
+            continue;
+        }
+        long long number = 0;
+        const auto [end, error] = from_chars(value.data(), value.data() + value.size(), number);
+        if (error != errc() || end != value.data() + value.size() || number <= 0 || number > numeric_limits<int>::max()) {
+            throw invalid_argument("Invalid value of "s + string(name) + ": "s + string(value));
+        }
+        if (name == "--documents"sv) {
+            options.document_count = static_cast<int>(number);
+        } else if (name == "--vocabulary"sv) {
+            options.vocabulary_size = static_cast<int>(number);
+        } else if (name == "--words"sv) {
+            options.words_per_document = static_cast<int>(number);
+        } else if (name == "--queries"sv) {
+            options.query_count = static_cast<int>(number);
+        } else if (name == "--seed"sv) {
+            options.seed = static_cast<unsigned>(number);
+        } else {
+            throw invalid_argument("Unknown option "s + string(name));
+        }
+    }
+    return options;
+}
+
+void RunBenchmarks(const BenchmarkOptions& options) {
+    using Benchmark = void (*)(const BenchmarkCorpus&);
+    const vector<pair<string_view, Benchmark>> benchmarks = {
+#ifdef SEARCH_SERVER_HAS_SOCKETS
+        // Shards are started before other benchmarks create threads
+        {"sharded_search"sv, BenchmarkShardedSearch},
+#endif
+        {"posting_layout"sv, BenchmarkPostingLayout},
+        {"top_selection"sv, [](const BenchmarkCorpus&) { BenchmarkTopDocumentSelection(); }},
+        {"parallel_search"sv, BenchmarkParallelSearch},
+        {"process_queries"sv, BenchmarkProcessQueries},
+        {"term_pool"sv, BenchmarkTermPool},
+        {"snapshot"sv, BenchmarkSnapshot},
+        {"bulk_ingest"sv, BenchmarkBulkIngest},
+        {"query_cache"sv, BenchmarkQueryCache},
+        {"short_queries"sv, BenchmarkShortQueries},
+        {"posting_cost"sv, BenchmarkPostingCost},
+        {"scoring_kernels"sv, BenchmarkScoringKernels},
+        {"compressed_postings"sv, BenchmarkCompressedPostings},
+        {"dynamic_pruning"sv, BenchmarkDynamicPruning},
+        {"concurrent_ingest"sv, BenchmarkConcurrentIngest},
+        {"segmented_ingest"sv, BenchmarkSegmentedIngest},
+        {"match_document"sv, BenchmarkMatchDocument},
+        {"query_context"sv, BenchmarkQueryContext},
+        {"status_filtering"sv, BenchmarkStatusFiltering},
+        {"metrics"sv, BenchmarkMetrics},
+        {"operations"sv, BenchmarkOperations},
+    };
+    vector<string_view> selected_names;
+    for (string_view names = options.only; !names.empty();) {
+        const size_t comma = names.find(',');
+        selected_names.push_back(names.substr(0, comma));
+        names.remove_prefix(comma == names.npos ? names.size() : comma + 1);
+    }
+    for (const string_view name : selected_names) {
+        if (none_of(benchmarks.begin(), benchmarks.end(), [name](const auto& benchmark) { return benchmark.first == name; })) {
+            throw invalid_argument("Unknown benchmark "s + string(name));
+        }
+    }
+
+    const BenchmarkCorpus corpus = GenerateBenchmarkCorpus(options.document_count, options.vocabulary_size,
+        options.words_per_document, options.query_count, options.seed);
+    for (const auto& [name, benchmark] : benchmarks) {
+        if (selected_names.empty() || count(selected_names.begin(), selected_names.end(), name) > 0) {
+            benchmark(corpus);
+        }
+    }
+}
+
+// --------- Окончание бенчмарков поисковой системы -----------
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc > 1 && argv[1] == "bench"s) {
+        try {
+            RunBenchmarks(ParseBenchmarkOptions(vector<string_view>(argv + 2, argv + argc)));
+        } catch (const invalid_argument& e) {
+            cerr << e.what() << endl;
+            cerr << "Usage: "s << argv[0] << " bench [--documents N] [--vocabulary N] [--words N] [--queries N] [--seed N] [--only NAME[,NAME]]"s << endl;
+            return 1;
+        }
+        return 0;
+    }
     TestSearchServer();
     // Если вы видите эту строку, значит все тесты прошли успешно
     cout << "Search server testing finished"s << endl;